@@ -0,0 +1,512 @@
+#include "allocator.hpp"
+#include <atomic>
+#include <event2/event.h>
+#include <iostream>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+namespace dm
+{
+
+/** sizeClass value for blocks that came straight from malloc(). */
+#define LARGE_CLASS         0xFFFF
+/** Marks a header written by memAlloc(). Cleared when the block is freed. */
+#define HEADER_MAGIC        0xA110CA7E
+/** New blocks are carved out of chunks this big (or 4 blocks, if larger). */
+#define CHUNK_SIZE          (256 * 1024)
+/** Each thread keeps at most this many bytes of free blocks per size class
+ * before handing half of them back to the central lists. */
+#define CACHE_MAX_BYTES     (256 * 1024)
+
+/**
+ * Sits in front of every block handed out. Keeps the returned memory 16 byte
+ * aligned.
+ */
+struct MemHeader
+{
+    size_t size;
+    uint16_t sizeClass;
+    uint16_t subsystem;
+    uint32_t magic;
+};
+
+static_assert(sizeof(MemHeader) == ALLOC_HEADER_SIZE,
+        "MemHeader should be ALLOC_HEADER_SIZE bytes");
+
+struct FreeBlock
+{
+    FreeBlock* next;
+};
+
+/**
+ * A thread's private free lists and byte counters. Only the owning thread
+ * writes to it; the counters are atomics so memPrintStats() can read them.
+ */
+struct ThreadCache
+{
+    FreeBlock* free[ALLOC_CLASSES];
+    size_t count[ALLOC_CLASSES];
+    /** Requested bytes allocated minus freed, per subsystem. */
+    std::atomic<long long> bytes[MEM_SUBSYSTEMS];
+    /** Size-class capacity allocated minus freed. */
+    std::atomic<long long> classBytes;
+    ThreadCache* prev;
+    ThreadCache* next;
+};
+
+/**
+ * Free blocks shared by all threads, for one size class.
+ */
+struct CentralList
+{
+    FreeBlock* free;
+    pthread_mutex_t lock;
+};
+
+static bool sizeClasses = true;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t cacheKey;
+static CentralList central[ALLOC_CLASSES];
+/** Every live ThreadCache, protected by registryLock. */
+static ThreadCache* registry = NULL;
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+/** Counters folded in from threads that have exited. */
+static std::atomic<long long> retiredBytes[MEM_SUBSYSTEMS];
+static std::atomic<long long> retiredClassBytes(0);
+/** Bytes malloc()ed for chunks, which are never returned. */
+static std::atomic<long long> chunkBytes(0);
+static thread_local ThreadCache* tcache = NULL;
+/** Set once the thread's cache has been released at exit; anything the
+ * thread allocates after that goes straight to malloc(). */
+static thread_local bool cacheReleased = false;
+
+
+static inline size_t classSize(int c)
+{
+    return (size_t) 1 << (ALLOC_MIN_SHIFT + c);
+}
+
+
+static inline int classFor(size_t total)
+{
+    int c = 0;
+
+    while (c < ALLOC_CLASSES && classSize(c) < total)
+    {
+        c++;
+    }
+    return c;
+}
+
+
+static inline void addStat(std::atomic<long long>& stat, long long delta)
+{
+    // only the owning thread writes, so this doesn't need a locked add
+    stat.store(stat.load(std::memory_order_relaxed) + delta,
+            std::memory_order_relaxed);
+}
+
+
+/**
+ * Give a thread's free blocks back to the central lists and fold its counters
+ * into the retired totals. Runs when a thread that used memAlloc() exits.
+ */
+static void releaseCache(void* arg)
+{
+    ThreadCache* tc = (ThreadCache*) arg;
+    int c = 0;
+    int s = 0;
+
+    // later destructors (libevent's, OpenSSL's) may still allocate and free
+    tcache = NULL;
+    cacheReleased = true;
+
+    for (c = 0; c < ALLOC_CLASSES; c++)
+    {
+        if (!tc->free[c])
+        {
+            continue;
+        }
+        FreeBlock* last = tc->free[c];
+        while (last->next)
+        {
+            last = last->next;
+        }
+        pthread_mutex_lock(&central[c].lock);
+        last->next = central[c].free;
+        central[c].free = tc->free[c];
+        pthread_mutex_unlock(&central[c].lock);
+    }
+
+    pthread_mutex_lock(&registryLock);
+    for (s = 0; s < MEM_SUBSYSTEMS; s++)
+    {
+        retiredBytes[s] += tc->bytes[s].load();
+    }
+    retiredClassBytes += tc->classBytes.load();
+
+    if (tc->prev)
+    {
+        tc->prev->next = tc->next;
+    }
+    else
+    {
+        registry = tc->next;
+    }
+    if (tc->next)
+    {
+        tc->next->prev = tc->prev;
+    }
+    pthread_mutex_unlock(&registryLock);
+
+    free(tc);
+}
+
+
+static void initAllocator()
+{
+    int c = 0;
+
+    for (c = 0; c < ALLOC_CLASSES; c++)
+    {
+        central[c].free = NULL;
+        pthread_mutex_init(&central[c].lock, NULL);
+    }
+    pthread_key_create(&cacheKey, releaseCache);
+}
+
+
+/**
+ * @return The calling thread's cache, creating it the first time, or NULL if
+ *      it couldn't be created or the thread is exiting.
+ */
+static ThreadCache* getCache()
+{
+    if (tcache || cacheReleased)
+    {
+        return tcache;
+    }
+    pthread_once(&initOnce, initAllocator);
+
+    ThreadCache* tc = (ThreadCache*) calloc(1, sizeof(ThreadCache));
+    if (!tc)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registryLock);
+    tc->next = registry;
+    if (registry)
+    {
+        registry->prev = tc;
+    }
+    registry = tc;
+    pthread_mutex_unlock(&registryLock);
+
+    pthread_setspecific(cacheKey, tc);
+    tcache = tc;
+    return tc;
+}
+
+
+/**
+ * Fill an empty thread free list, from the central list if it has anything,
+ * otherwise by carving up a new chunk.
+ */
+static void refill(ThreadCache* tc, int c)
+{
+    size_t size = classSize(c);
+    size_t batch = CACHE_MAX_BYTES / 2 / size;
+    FreeBlock* block = NULL;
+
+    if (!batch)
+    {
+        batch = 1;
+    }
+
+    pthread_mutex_lock(&central[c].lock);
+    while (tc->count[c] < batch && (block = central[c].free))
+    {
+        central[c].free = block->next;
+        block->next = tc->free[c];
+        tc->free[c] = block;
+        tc->count[c]++;
+    }
+    pthread_mutex_unlock(&central[c].lock);
+
+    if (tc->free[c])
+    {
+        return;
+    }
+
+    size_t chunk = (size * 4 > CHUNK_SIZE) ? size * 4 : CHUNK_SIZE;
+    char* mem = (char*) malloc(chunk);
+    if (!mem)
+    {
+        return;
+    }
+    chunkBytes += chunk;
+
+    for (size_t offset = 0; offset + size <= chunk; offset += size)
+    {
+        block = (FreeBlock*) (mem + offset);
+        block->next = tc->free[c];
+        tc->free[c] = block;
+        tc->count[c]++;
+    }
+}
+
+
+/**
+ * Hand half of a thread's free blocks of one class to the central list.
+ */
+static void spill(ThreadCache* tc, int c)
+{
+    size_t keep = tc->count[c] / 2;
+    FreeBlock* last = tc->free[c];
+    size_t i = 0;
+
+    for (i = 1; i < keep; i++)
+    {
+        last = last->next;
+    }
+    FreeBlock* excess = last->next;
+    last->next = NULL;
+
+    FreeBlock* tail = excess;
+    while (tail->next)
+    {
+        tail = tail->next;
+    }
+
+    pthread_mutex_lock(&central[c].lock);
+    tail->next = central[c].free;
+    central[c].free = excess;
+    pthread_mutex_unlock(&central[c].lock);
+
+    tc->count[c] = keep;
+}
+
+
+/**
+ * Stop the program if ptr wasn't handed out by memAlloc() or has already been
+ * freed, since carrying on would corrupt the size class lists.
+ *
+ * @param h The header in front of the block.
+ * @param caller The function that was given the block.
+ */
+static void checkHeader(const MemHeader* h, const char* caller)
+{
+    if (h->magic != HEADER_MAGIC)
+    {
+        std::cerr << "Error: " << caller << "() was given " << (h + 1)
+                  << ", which is not an allocated block\n";
+        abort();
+    }
+}
+
+
+/**
+ * Count bytes allocated (or freed, if negative) for a subsystem. Without a
+ * thread cache they go straight to the retired totals.
+ */
+static void charge(ThreadCache* tc, int subsystem, long long delta)
+{
+    if (tc)
+    {
+        addStat(tc->bytes[subsystem], delta);
+    }
+    else
+    {
+        retiredBytes[subsystem] += delta;
+    }
+}
+
+
+void memUseSizeClasses(bool enable)
+{
+    sizeClasses = enable;
+}
+
+
+void* memAlloc(size_t size, MemSubsystem subsystem)
+{
+    ThreadCache* tc = getCache();
+    MemHeader* h = NULL;
+    int c = classFor(size + sizeof(MemHeader));
+
+    if (!tc || !sizeClasses || c == ALLOC_CLASSES)
+    {
+        if (!(h = (MemHeader*) malloc(size + sizeof(MemHeader))))
+        {
+            return NULL;
+        }
+        h->sizeClass = LARGE_CLASS;
+    }
+    else
+    {
+        if (!tc->free[c])
+        {
+            refill(tc, c);
+        }
+        if (!(h = (MemHeader*) tc->free[c]))
+        {
+            return NULL;
+        }
+        tc->free[c] = ((FreeBlock*) h)->next;
+        tc->count[c]--;
+        h->sizeClass = c;
+        addStat(tc->classBytes, classSize(c));
+    }
+
+    h->size = size;
+    h->subsystem = subsystem;
+    h->magic = HEADER_MAGIC;
+    charge(tc, subsystem, size);
+    return h + 1;
+}
+
+
+void* memRealloc(void* ptr, size_t size, MemSubsystem subsystem)
+{
+    if (!ptr)
+    {
+        return memAlloc(size, subsystem);
+    }
+    if (!size)
+    {
+        memFree(ptr);
+        return NULL;
+    }
+
+    MemHeader* h = (MemHeader*) ptr - 1;
+    checkHeader(h, "memRealloc");
+
+    if (h->sizeClass != LARGE_CLASS
+        && size + sizeof(MemHeader) <= classSize(h->sizeClass))
+    {
+        // still fits in the same block
+        charge(getCache(), h->subsystem,
+                (long long) size - (long long) h->size);
+        h->size = size;
+        return ptr;
+    }
+
+    void* resized = memAlloc(size, (MemSubsystem) h->subsystem);
+    if (resized)
+    {
+        memcpy(resized, ptr, h->size < size ? h->size : size);
+        memFree(ptr);
+    }
+    return resized;
+}
+
+
+void memFree(void* ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    ThreadCache* tc = getCache();
+    MemHeader* h = (MemHeader*) ptr - 1;
+    checkHeader(h, "memFree");
+    int c = h->sizeClass;
+
+    charge(tc, h->subsystem, -(long long) h->size);
+    h->magic = 0;
+
+    if (c == LARGE_CLASS)
+    {
+        free(h);
+        return;
+    }
+    if (!tc)
+    {
+        pthread_mutex_lock(&central[c].lock);
+        ((FreeBlock*) h)->next = central[c].free;
+        central[c].free = (FreeBlock*) h;
+        pthread_mutex_unlock(&central[c].lock);
+        retiredClassBytes -= classSize(c);
+        return;
+    }
+
+    addStat(tc->classBytes, -(long long) classSize(c));
+    ((FreeBlock*) h)->next = tc->free[c];
+    tc->free[c] = (FreeBlock*) h;
+
+    if (++tc->count[c] * classSize(c) > CACHE_MAX_BYTES)
+    {
+        spill(tc, c);
+    }
+}
+
+
+static void* libeventMalloc(size_t size)
+{
+    return memAlloc(size, MEM_LIBEVENT);
+}
+
+
+static void* libeventRealloc(void* ptr, size_t size)
+{
+    return memRealloc(ptr, size, MEM_LIBEVENT);
+}
+
+
+static void libeventInstall()
+{
+    event_set_mem_functions(libeventMalloc, libeventRealloc, memFree);
+}
+
+
+void memInstallLibevent()
+{
+    static pthread_once_t installOnce = PTHREAD_ONCE_INIT;
+    pthread_once(&installOnce, libeventInstall);
+}
+
+
+void memPrintStats(std::ostream& out)
+{
+    static const char* names[MEM_SUBSYSTEMS] =
+    {
+        "libevent", "payload", "other"
+    };
+    long long bytes[MEM_SUBSYSTEMS];
+    long long inClasses = retiredClassBytes.load();
+    int s = 0;
+
+    for (s = 0; s < MEM_SUBSYSTEMS; s++)
+    {
+        bytes[s] = retiredBytes[s].load();
+    }
+
+    pthread_mutex_lock(&registryLock);
+    for (ThreadCache* tc = registry; tc; tc = tc->next)
+    {
+        for (s = 0; s < MEM_SUBSYSTEMS; s++)
+        {
+            bytes[s] += tc->bytes[s].load(std::memory_order_relaxed);
+        }
+        inClasses += tc->classBytes.load(std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registryLock);
+
+    out << "Allocator (" << (sizeClasses ? "size classes" : "malloc")
+        << "):\n";
+    for (s = 0; s < MEM_SUBSYSTEMS; s++)
+    {
+        out << "\t" << names[s] << ":\t\t" << bytes[s] << " bytes\n";
+    }
+    if (sizeClasses)
+    {
+        out << "\tChunks:\t\t\t" << chunkBytes.load() << " bytes ("
+            << chunkBytes.load() - inClasses << " free)\n";
+    }
+    out << "\n";
+}
+
+} // namespace dm
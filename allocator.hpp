@@ -0,0 +1,82 @@
+#ifndef DM_ALLOCATOR_HPP
+#define DM_ALLOCATOR_HPP
+#include <ostream>
+#include <stddef.h>
+namespace dm
+{
+
+/** Smallest size class (including the block header) is 2^ALLOC_MIN_SHIFT. */
+#define ALLOC_MIN_SHIFT     5
+/** Number of size classes; the largest is 2^(ALLOC_MIN_SHIFT +
+ * ALLOC_CLASSES - 1) bytes (64 KiB). Anything bigger goes to malloc(). */
+#define ALLOC_CLASSES       12
+/** Bytes memAlloc() keeps in front of every block, so asking for a power of
+ * two minus this fills a size class exactly. */
+#define ALLOC_HEADER_SIZE   16
+
+/**
+ * Who asked for memory. Bytes are tracked separately for each one.
+ */
+enum MemSubsystem
+{
+    /** Everything libevent allocates (through event_set_mem_functions()). */
+    MEM_LIBEVENT,
+    /** Request and response payloads. */
+    MEM_PAYLOAD,
+    /** Anything else. */
+    MEM_OTHER,
+    MEM_SUBSYSTEMS
+};
+
+/**
+ * Choose between the size-class allocator and plain malloc(). Either way,
+ * bytes are tracked per subsystem. Must be called before anything is
+ * allocated with memAlloc().
+ *
+ * @param enable False to pass every request straight to malloc().
+ */
+void memUseSizeClasses(bool enable);
+
+/**
+ * Allocate memory from the calling thread's size-class cache. Blocks can be
+ * freed from any thread; they go back to the cache of the thread that frees
+ * them.
+ *
+ * @param size The number of bytes needed.
+ * @param subsystem Who the bytes are charged to.
+ * @return The memory (16 byte aligned), or NULL if it could not be allocated.
+ */
+void* memAlloc(size_t size, MemSubsystem subsystem);
+
+/**
+ * Resize memory from memAlloc(). Follows the rules of realloc().
+ *
+ * @param ptr The memory to resize, or NULL.
+ * @param size The number of bytes needed.
+ * @param subsystem Who the bytes are charged to if ptr is NULL.
+ * @return The resized memory, or NULL if it could not be allocated.
+ */
+void* memRealloc(void* ptr, size_t size, MemSubsystem subsystem);
+
+/**
+ * Free memory from memAlloc() or memRealloc().
+ *
+ * @param ptr The memory to free, or NULL.
+ */
+void memFree(void* ptr);
+
+/**
+ * Make libevent allocate through memAlloc(), charged to MEM_LIBEVENT. Must be
+ * called before any other libevent function.
+ */
+void memInstallLibevent();
+
+/**
+ * Write the bytes in use by each subsystem and how much the allocator holds.
+ *
+ * @param out Where to write the report.
+ */
+void memPrintStats(std::ostream& out);
+
+} // namespace dm
+#endif
@@ -0,0 +1,143 @@
+#!/bin/bash
+#
+# Runs the client against every combination of server mode, number of
+# clients, message size and thread pool size on loopback, a few times each,
+# then writes one line per run to $RESULTS and prints a table of the averages.
+# Linux only: the server's CPU time and peak RSS come from /proc.
+#
+# Anything below can be set in the environment (or on the make command line),
+# for example:
+#
+#   make bench MODES="epoll poll" CLIENTS="10 100" SIZES="1024 65536"
+
+MODES=${MODES:-"select poll epoll threads"}
+CLIENTS=${CLIENTS:-"10 100"}
+SIZES=${SIZES:-"1024 65536"}
+POOLS=${POOLS:-"4 16"}
+REPEATS=${REPEATS:-3}
+# requests made by each client
+COUNT=${COUNT:-200}
+PORT=${PORT:-32000}
+# passed to every client, such as "--engine epoll --consume trunc"
+CLIENT_ARGS=${CLIENT_ARGS:-""}
+RESULTS=${RESULTS:-bench_results.csv}
+SUMMARY=${SUMMARY:-bench_summary.txt}
+
+ticks=$(getconf CLK_TCK)
+
+# the server's flag for each mode (printf, since echo would take -e itself)
+flag() {
+    case $1 in
+        select)     printf -- "-s\n" ;;
+        poll)       printf -- "-p\n" ;;
+        epoll)      printf -- "-e\n" ;;
+        kqueue)     printf -- "-k\n" ;;
+        threads)    printf -- "-t\n" ;;
+        coroutines) printf -- "-C\n" ;;
+        *)          echo "Unknown mode: $1" >&2; exit 1 ;;
+    esac
+}
+
+# wait until something is listening on $PORT, or the server has died
+waitForListen() {
+    local hex=$(printf ":%04X " $PORT)
+    local i
+
+    for i in $(seq 100); do
+        kill -0 $1 2> /dev/null || return 1
+        grep -q "$hex.* 0A " /proc/net/tcp /proc/net/tcp6 2> /dev/null \
+                && return 0
+        sleep 0.05
+    done
+    return 1
+}
+
+# CPU seconds (user and system) a process has used
+cpuOf() {
+    awk -v t=$ticks '{ print ($14 + $15) / t }' /proc/$1/stat
+}
+
+# field n of the first line of the client's report that starts with label
+field() {
+    awk -v label="$2" -v n=$3 'index($0, label) == 1 { print $n; exit }' $1
+}
+
+for mode in $MODES; do
+    flag $mode > /dev/null || exit 1
+done
+if [ ! -x ./server ] || [ ! -x ./client ]; then
+    echo "Build the server and client first (make)"
+    exit 1
+fi
+
+log=$(mktemp)
+srvlog=$(mktemp)
+trap 'rm -f $log $srvlog' EXIT
+
+echo "mode,clients,size,pool,run,responses_per_sec,p50_usec,p99_usec,"\
+"p999_usec,max_usec,server_cpu_sec,server_rss_kb,client_cpu_sec" > $RESULTS
+
+for mode in $MODES; do
+for clients in $CLIENTS; do
+for size in $SIZES; do
+for pool in $POOLS; do
+for run in $(seq $REPEATS); do
+    ./server $(flag $mode) -P $PORT -T $pool > $srvlog 2>&1 &
+    server=$!
+    if ! waitForListen $server; then
+        echo "$mode: the server didn't start"
+        cat $srvlog
+        kill -9 $server 2> /dev/null
+        exit 1
+    fi
+
+    ./client -p $PORT -x $clients -s $size -c $COUNT -w 0 $CLIENT_ARGS \
+            > $log 2>&1
+    status=$?
+    cpu=$(cpuOf $server)
+    rss=$(awk '/^VmHWM/ { print $2 }' /proc/$server/status)
+    kill -INT $server
+    wait $server
+
+    # with --warmup the throughput is the steady state's
+    rate=$(field $log "Steady state:" 3)
+    rate=${rate:-$(field $log "Throughput:" 2)}
+    if [ $status -ne 0 ] || [ -z "$rate" ]; then
+        echo "$mode, $clients clients, $size bytes, pool $pool: failed"
+        tail -5 $log
+        continue
+    fi
+    echo "$mode,$clients,$size,$pool,$run,$rate,"\
+"$(field $log "Round trip" 6),$(field $log "Round trip" 8),"\
+"$(field $log "Round trip" 10),$(field $log "Round trip" 12),"\
+"$cpu,$rss,$(field $log "Client CPU:" 3)" >> $RESULTS
+    echo "$mode, $clients clients, $size bytes, pool $pool, run $run:" \
+         "$rate responses/s"
+done
+done
+done
+done
+done
+
+# the average of every cell's runs
+echo
+awk -F, 'NR > 1 {
+        key = $1 "," $2 "," $3 "," $4
+        if (!(key in runs)) { order[++cells] = key }
+        runs[key]++; rate[key] += $6; p50[key] += $7; p99[key] += $8
+        cpu[key] += $11; rss[key] += $12; ccpu[key] += $13
+    }
+    END {
+        printf "%-10s %8s %8s %5s %12s %10s %10s %9s %10s %9s\n", "mode",
+               "clients", "size", "pool", "responses/s", "p50 usec",
+               "p99 usec", "srv cpu", "srv rss kb", "cli cpu"
+        for (i = 1; i <= cells; i++) {
+            k = order[i]; n = runs[k]; split(k, f, ",")
+            printf "%-10s %8d %8d %5d %12.0f %10.1f %10.1f %9.2f %10.0f " \
+                   "%9.2f\n", f[1], f[2], f[3], f[4], rate[k] / n,
+                   p50[k] / n, p99[k] / n, cpu[k] / n, rss[k] / n,
+                   ccpu[k] / n
+        }
+    }' $RESULTS | tee $SUMMARY
+echo
+echo "Every run is in $RESULTS, the table in $SUMMARY"
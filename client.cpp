@@ -1,62 +1,196 @@
 #include <arpa/inet.h>
+#include <atomic>
 #include <boost/program_options.hpp>
 #include <errno.h>
+#include <fcntl.h>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <pthread.h>
-#include <math.h>
+#include <random>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sstream>
 #include <string>
+#include <time.h>
+#include <unistd.h>
 #include <vector>
+#include "control.hpp"
+#include "epolldriver.hpp"
+#include "histogram.hpp"
 #include "network.hpp"
+#include "protocol.hpp"
+#include "samples.hpp"
+#include "sizes.hpp"
+#include "tls.hpp"
 namespace po = boost::program_options;
 using namespace dm;
 
+static_assert(SIZE_LIMIT < LEGACY_SIZE_LIMIT,
+        "every size the client can ask for must fit in a legacy request");
+
 #define OUT_FILE        "response_times.csv"
-#define FILE_BUFSIZE    10
+/** The same records as OUT_FILE, as written by writeSamples(). */
+#define SAMPLE_FILE     "response_times.bin"
+/** What a depth sweep's files start with: the depth and .csv or .bin follow,
+ * as in response_times_depth4.csv. */
+#define DEPTH_FILE      "response_times_depth"
+/** The biggest read-ahead buffer given to a connection. Payloads are read
+ * into it and thrown away, so up to this much goes in one recv(). */
+#define MAX_READ_AHEAD  (256 * 1024)
+/** How often a finished open loop client checks whether its sender has
+ * stopped yet. */
+#define SENDER_POLL_NS  1000000
+/** How long after the clients start connecting a trace's first request is
+ * due, so that the connections are up by then. */
+#define TRACE_LEAD_NS   100000000
+/** How long a churning client waits to try again when there's no local port
+ * to connect from. */
+#define CHURN_RETRY_NS  10000000
 
-double secondsDiff(const timeval& val1, const timeval& val2);
+void printResults(struct clientArgs* ca, int clients);
+void saveSamples(struct clientArgs* ca, std::ostream& out, 
+                 const std::string& samplePath);
+void printChurn(struct clientArgs* ca);
+void printWindows(struct clientArgs* ca);
 
 struct clientArgs {
     std::string host;
     int port;
-    uint32_t size;
+    /** The server's TCP or UDP address, looked up once for every client. */
+    struct sockaddr_in addr;
+    std::string unixPath;
+    bool udp;
+    /** Use the compact protocol instead of legacy requests. */
+    bool compact;
+    /** PROTO_ flags for compact requests. */
+    uint8_t flags;
+    /** Where each client's response sizes come from. */
+    SizeMix sizes;
+    /** Requests to replay instead, dealt out to the clients in turn, or
+     * empty. */
+    std::vector<TraceEntry> trace;
+    /** When the trace's first request is due (monotonicNs()). */
+    uint64_t traceStart;
     int count;
     double timeout;
     int msgCount;
     int writeToFile;
-    std::ofstream out;
-    pthread_mutex_t fileMutex;
+    /** Every client's records, added once each thread is done. */
+    std::vector<Sample> samples;
+    pthread_mutex_t samplesMutex;
+    /** Every request's round trip, from every client. */
+    LatencyHistogram roundTrips;
+    /** The same, by response size (sizeBucket()). */
+    LatencyHistogram bySize[SIZE_BUCKETS];
+    /** Set when connections are encrypted. */
+    TlsContext* tls;
+    /** Connections where the kernel took over encryption or decryption. */
+    std::atomic<int> kernelSends;
+    std::atomic<int> kernelRecvs;
+    /** Reads made from stream sockets, by every client. */
+    std::atomic<unsigned long> readCalls;
+    int clients;
+    /** Requests per second from all the clients together, or 0 to send each
+     * request once the last one is answered. */
+    double rate;
+    /** Open loop arrivals: exponential gaps if set, otherwise even ones. */
+    bool poisson;
+    /** Requests each closed loop client keeps in flight. */
+    int depth;
+    /** Requests to make on each connection before closing it and opening
+     * another, or 0 to keep one connection for the whole run. */
+    int churn;
+    /** New connections per second from all the clients together, or 0 to
+     * connect as fast as they can. */
+    double connectRate;
+    /** How long each connection took to make, and how many times a client
+     * had to wait for a free local port. */
+    LatencyHistogram connects;
+    unsigned long portWaits;
+    /** The number of this process's first client. Worker processes number
+     * their clients on from those of the workers before them, so ca->clients
+     * counts every process's clients. */
+    int firstClient;
+    /** How late each open loop request went out, and how many were offered
+     * per second. */
+    LatencyHistogram sendLag;
+    double offered;
+    /** Seconds the run took, and the seconds every client took added up. */
+    double elapsed;
+    double totalTime;
+    /** When the clients were started (monotonicNs()). */
+    uint64_t runStart;
+    /** How they connect: spread evenly over rampSeconds if rampSteps is 0
+     * (all at once if that's 0 too), otherwise in rampSteps groups,
+     * rampSeconds apart. */
+    int rampSteps;
+    double rampSeconds;
+    /** Seconds from the start of the run to leave out of the results, and
+     * the length of each window after that (0 for none). */
+    double warmup;
+    double window;
+    /** Round trips after the warmup, by window. */
+    LatencyWindows windows;
+    /** How response payloads are thrown away. */
+    DiscardMode consume;
+    /** Response bytes received, headers and all, and the CPU seconds this
+     * process used while the clients ran (from cpuStart). */
+    std::atomic<uint64_t> bytesIn;
+    double cpu;
+    double cpuStart;
 };
 
-void* requestData(void* args)
+/**
+ * Open a connection to the server: a unix domain stream socket if ca->unixPath
+ * is set, a connected UDP socket if ca->udp is set, otherwise TCP.
+ *
+ * @param ca The client's settings.
+ * @param nonBlocking True to return a non-blocking socket. A TCP connection
+ *      may still be on its way then; the socket becomes writable once it's
+ *      made, and SO_ERROR says whether it worked.
+ * @return The connected socket, or -1 (on a non-blocking socket only) if
+ *      there's no local port free to connect from.
+ */
+int connectToServer(struct clientArgs* ca, bool nonBlocking)
 {
-    std::pair<struct clientArgs*, int>* threadArgs 
-            = (std::pair<struct clientArgs*, int>*) args;
-    struct clientArgs* ca = threadArgs->first;
-    int threadID = threadArgs->second;
-    threadID += 1;
-    delete threadArgs;
-    int i = 0;
-    char requestMsg[REQUEST_SIZE];
-    requestMsg[3] = (uint32_t) ((ca->size >> 24) & 0xFF);
-    requestMsg[2] = (uint32_t) ((ca->size >> 16) & 0xFF);
-    requestMsg[1] = (uint32_t) ((ca->size >>  8) & 0xFF);
-    requestMsg[0] = (uint32_t) ((ca->size & 0xFF));
-    char* responseMsg = new char[ca->size];
-    int bytesToRead = ca->size;
-    int flag = 0;
-
     int sock;
-    struct sockaddr_in server;
-    struct hostent* hp;
 
-    if ((sock = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    if (!ca->unixPath.empty())
+    {
+        struct sockaddr_un server;
+
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        {
+            exit(sockError("socket()", 0));
+        }
+        memset((char*) &server, 0, sizeof(struct sockaddr_un));
+        server.sun_family = AF_UNIX;
+        strncpy(server.sun_path, ca->unixPath.c_str(), 
+                sizeof(server.sun_path) - 1);
+
+        // a unix connect only blocks while the server's backlog is full
+        if (connect(sock, (struct sockaddr*) &server, sizeof(server)))
+        {
+            exit(sockError("connect()", 0));
+        }
+        if (nonBlocking && fcntl(sock, F_SETFL, O_NONBLOCK) == -1)
+        {
+            exit(sockError("fcntl()", 0));
+        }
+        return sock;
+    }
+
+    if ((sock = socket(PF_INET, ca->udp ? SOCK_DGRAM : SOCK_STREAM, 0)) == -1)
     {
         exit(sockError("socket()", 0));
     }
@@ -67,22 +201,292 @@ void* requestData(void* args)
         exit(sockError("setsockopt()", 0));
     }
 
-    // set up address structure
-    memset((char*) &server, 0, sizeof(struct sockaddr_in));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(ca->port);
-    if (!(hp = gethostbyname(ca->host.c_str())))
+    if (ca->udp)
     {
-        std::cerr << "Error: unknown server address\n";
-        exit(1);
+        // a lost datagram shows up as a timeout rather than a hang
+        struct timeval tv;
+        tv.tv_sec = (long) ca->timeout;
+        tv.tv_usec = (long) ((ca->timeout - tv.tv_sec) * 1000000);
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+        {
+            exit(sockError("setsockopt()", 0));
+        }
+        arg = ca->sizes.max() < MAX_DATAGRAM * DATAGRAM_BATCH 
+                ? ca->sizes.max() * 2 : MAX_DATAGRAM * DATAGRAM_BATCH;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &arg, sizeof(arg));
+    }
+
+    if (nonBlocking && fcntl(sock, F_SETFL, O_NONBLOCK) == -1)
+    {
+        exit(sockError("fcntl()", 0));
     }
-    memcpy((char*) &server.sin_addr, hp->h_addr, hp->h_length);
 
     // connect
-    if (connect(sock, (struct sockaddr*) &server, sizeof(server)))
+    if (connect(sock, (struct sockaddr*) &ca->addr, sizeof(ca->addr))
+            && !(nonBlocking && errno == EINPROGRESS))
     {
+        if (nonBlocking && errno == EADDRNOTAVAIL)
+        {
+            close(sock);
+            return -1;
+        }
         exit(sockError("connect()", 0));
     }
+    return sock;
+}
+
+/**
+ * @param ca The clients' settings.
+ * @param clientID The client, from 1.
+ * @return How long after the start of the run the client should connect.
+ */
+uint64_t rampDelayNs(struct clientArgs* ca, int clientID)
+{
+    if (!ca->rampSteps)
+    {
+        return (uint64_t) (ca->rampSeconds * 1e9 * (clientID - 1) 
+                           / ca->clients);
+    }
+    return (uint64_t) (ca->rampSeconds * 1e9 
+                       * ((uint64_t) (clientID - 1) * ca->rampSteps 
+                          / ca->clients));
+}
+
+/**
+ * @return The CPU seconds, user and system, this process has used so far.
+ */
+double cpuSeconds()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Note when the run starts, and start counting the warmup and the CPU used
+ * from then.
+ *
+ * @param ca The clients' settings.
+ */
+void startRun(struct clientArgs* ca)
+{
+    ca->cpuStart = cpuSeconds();
+    ca->runStart = monotonicNs();
+    if (ca->warmup > 0 || ca->window > 0)
+    {
+        ca->windows.reset(ca->runStart + (uint64_t) (ca->warmup * 1e9), 
+                          (uint64_t) (ca->window * 1e9));
+    }
+}
+
+/**
+ * Block until the monotonic clock reaches ns.
+ *
+ * @param ns When to wake up (monotonicNs()).
+ */
+void sleepUntil(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) 
+            == EINTR)
+    {
+    }
+}
+
+/**
+ * Where one client is in recording its round trip times.
+ */
+struct recordState {
+    /** The client's number in the file, from 1. */
+    int clientID;
+    /** When the record's first request was sent, or was meant to be
+     * (monotonicNs()). */
+    uint64_t sendNs;
+    /** Where finished records go; owned by the client's thread. */
+    SampleBuffer* samples;
+    /** The number of requests the client makes. */
+    int count;
+    /** Response bytes so far in the record. */
+    uint64_t bytes;
+};
+
+/**
+ * @param ca The clients' settings.
+ * @param clientID The client, from 1.
+ * @return The number of requests the client makes: its share of the trace
+ *      when replaying one, otherwise --message-count.
+ */
+int requestCount(struct clientArgs* ca, int clientID)
+{
+    if (ca->trace.empty())
+    {
+        return ca->count;
+    }
+    return (ca->trace.size() + ca->clients - clientID) / ca->clients;
+}
+
+/**
+ * Note the send time if request i starts a new record.
+ *
+ * @param ca The client's settings.
+ * @param rs The client's records.
+ * @param i The request, from 0.
+ * @param sendNs When it was sent, or was meant to be (monotonicNs()).
+ */
+void startRecord(struct clientArgs* ca, struct recordState* rs, int i, 
+        uint64_t sendNs)
+{
+    if (ca->writeToFile && i % ca->msgCount == 0)
+    {
+        rs->sendNs = sendNs;
+    }
+}
+
+/**
+ * Finish the record if response i ends one, keeping it in the thread's
+ * samples until the run is over.
+ *
+ * @param ca The client's settings.
+ * @param rs The client's records.
+ * @param i The response just received, from 0.
+ * @param size The response's size.
+ * @return False if the record took longer than the timeout, in which case the
+ *      client should give up.
+ */
+bool finishRecord(struct clientArgs* ca, struct recordState* rs, int i,
+        uint32_t size)
+{
+    struct Sample sample;
+
+    rs->bytes += size;
+    if (!ca->writeToFile ||
+            (i % ca->msgCount != ca->msgCount - 1 && i != rs->count - 1))
+    {
+        return true;
+    }
+    sample.client = rs->clientID;
+    sample.first = i / ca->msgCount * ca->msgCount + 1;
+    sample.last = i + 1;
+    // the average, if the sizes vary
+    sample.size = rs->bytes / (sample.last - sample.first + 1);
+    sample.sendNs = rs->sendNs;
+    sample.ns = monotonicNs() - rs->sendNs;
+    rs->samples->add(sample);
+    rs->bytes = 0;
+
+    if (sample.ns / 1e9 >= ca->timeout)
+    {
+        std::cerr << "Server took too long to respond to request\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @param ca The clients' settings.
+ * @param clients How many clients will share one SampleBuffer.
+ * @return A SampleBuffer with room for all their records, or NULL if they
+ *      won't be kept.
+ */
+SampleBuffer* newSamples(struct clientArgs* ca, int clients)
+{
+    if (!ca->writeToFile)
+    {
+        return NULL;
+    }
+    return new SampleBuffer((size_t) clients 
+            * ((requestCount(ca, 1) + ca->msgCount - 1) / ca->msgCount));
+}
+
+/**
+ * Hand a thread's records over to ca->samples and free them.
+ *
+ * @param ca The clients' settings.
+ * @param samples What newSamples() returned.
+ */
+void keepSamples(struct clientArgs* ca, SampleBuffer* samples)
+{
+    if (samples)
+    {
+        pthread_mutex_lock(&ca->samplesMutex);
+        samples->copyTo(&ca->samples);
+        pthread_mutex_unlock(&ca->samplesMutex);
+        delete samples;
+    }
+}
+
+void* requestData(void* args)
+{
+    std::pair<struct clientArgs*, int>* threadArgs 
+            = (std::pair<struct clientArgs*, int>*) args;
+    struct clientArgs* ca = threadArgs->first;
+    int threadID = threadArgs->second;
+    threadID += 1;
+    delete threadArgs;
+    int i = 0;
+    char requestMsg[MAX_REQUEST_SIZE];
+    const SizeDistribution* sizes = ca->sizes.forClient(threadID);
+    SizeRng rng(threadID);
+    struct Request req;
+    req.size = 0;
+    req.id = 0;
+    req.flags = ca->flags;
+    req.compact = ca->compact;
+    int requestSize = writeRequest(requestMsg, req);
+    int headerSize = responseHeaderSize(req);
+    int bytesToRead = headerSize + sizes->max();
+    // over a stream only the header is kept; the payload is skipped over, so
+    // a datagram client only grows this as big as its responses get
+    std::vector<char> responseMsg;
+    char responseHeader[RESPONSE_HEADER_SIZE];
+    const char* header = responseHeader;
+    uint32_t responseId = 0;
+    uint32_t responseSize = 0;
+    int flag = 0;
+    uint64_t now = 0;
+    uint64_t bytesIn = 0;
+    SpliceSink* sink = NULL;
+
+    sleepUntil(ca->runStart + rampDelayNs(ca, threadID));
+    int sock = connectToServer(ca, false);
+    SSL* ssl = NULL;
+
+    if (ca->tls)
+    {
+        if (!(ssl = ca->tls->newSession(sock)) || SSL_connect(ssl) != 1)
+        {
+            std::cerr << "Error: TLS handshake failed\n";
+            ERR_print_errors_fp(stderr);
+            exit(1);
+        }
+        ca->kernelSends += tlsKernelSend(ssl);
+        ca->kernelRecvs += tlsKernelRecv(ssl);
+    }
+    SocketReader* reader = NULL;
+    if (!ca->udp)
+    {
+        size_t capacity = bytesToRead < READ_AHEAD_SIZE ? READ_AHEAD_SIZE
+                : bytesToRead < MAX_READ_AHEAD ? bytesToRead : MAX_READ_AHEAD;
+        reader = ssl ? new TlsReader(ssl, sock, capacity) 
+                     : new SocketReader(sock, capacity);
+        if (ca->consume == DISCARD_SPLICE)
+        {
+            try
+            {
+                sink = new SpliceSink();
+            }
+            catch (const std::exception&)
+            {
+                exit(sockError("pipe()", 0));
+            }
+        }
+        reader->discardBy(ca->consume, sink);
+    }
 
 #ifdef __APPLE__
     int set = 1;
@@ -94,91 +498,97 @@ void* requestData(void* args)
     flag = MSG_NOSIGNAL;
 #endif
 
-    struct timeval startTime;
-    if (gettimeofday(&startTime, NULL) == -1)
-    {
-        exit(sockError("gettimeofday()", 0));
-    }
+    uint64_t startTime = monotonicNs();
 
-    struct timeval sendTime;
-    struct timeval recvTime;
-    double roundTrips[FILE_BUFSIZE];
-    size_t firstMsgNo = 1;
-	size_t lastMsgNo[FILE_BUFSIZE];
-    size_t msgInBuf = 0;
-    double requestTime = 0;
+    struct recordState records;
+    records.clientID = threadID;
+    records.samples = newSamples(ca, 1);
+    records.count = requestCount(ca, threadID);
+    records.bytes = 0;
+    LatencyHistogram latency;
+    uint64_t requestStart = 0;
 
     // transmit request and receive packets
-    for (i = 0; i < ca->count; i++)
+    for (i = 0; i < records.count; i++)
     {
-        if (ca->writeToFile && i % ca->msgCount == 0)
+        req.id = i;
+        req.size = sizes->next(rng);
+        writeRequest(requestMsg, req);
+        bytesToRead = headerSize + req.size;
+        if (ca->udp && responseMsg.size() < (size_t) bytesToRead)
         {
-            if (gettimeofday(&sendTime, NULL) == -1)
-            {
-                exit(sockError("gettimeofday()", 0));
-            }
+            responseMsg.resize(bytesToRead);
+            header = &responseMsg[0];
         }
-        if (send(sock, requestMsg, REQUEST_SIZE, flag) < 0)
+        requestStart = monotonicNs();
+        startRecord(ca, &records, i, requestStart);
+        if ((ssl ? tlsSend(ssl, sock, requestMsg, requestSize)
+                 : send(sock, requestMsg, requestSize, flag)) < 0)
         {
             perror("send() failed");
             exit(1);
         }
-        clearSocket(sock, responseMsg, bytesToRead);
-
-        if (ca->writeToFile &&
-                (i % ca->msgCount == ca->msgCount - 1 || i == ca->count - 1))
+        if (ca->udp && recvDatagrams(sock, &responseMsg[0], bytesToRead) 
+                < bytesToRead)
         {
-            if (gettimeofday(&recvTime, NULL) == -1)
-            {
-                exit(sockError("gettimeofday()", 0));
-            }
-            requestTime = secondsDiff(sendTime, recvTime);
-            roundTrips[msgInBuf % FILE_BUFSIZE] = requestTime;
-			lastMsgNo[msgInBuf % FILE_BUFSIZE] = i + 1;
-            msgInBuf++;
-
-            if (requestTime >= ca->timeout)
-            {
-                i = ca->count -1;
-                std::cerr << "Server took too long to respond to request\n";
-                break;
-            }
+            std::cerr << "Server took too long to respond to request\n";
+            break;
+        }
+        else if (reader 
+                 && (reader->read(responseHeader, headerSize) < headerSize
+                     || reader->discard(req.size) < (long) req.size))
+        {
+            std::cerr << "Error: the server closed the connection\n";
+            break;
+        }
+        now = monotonicNs();
+        requestStart = now - requestStart;
+        bytesIn += bytesToRead;
+        if (ca->windows.record(now, requestStart))
+        {
+            latency.record(requestStart);
+            ca->bySize[sizeBucket(req.size)].record(requestStart);
+        }
 
-            if (msgInBuf % FILE_BUFSIZE == 0 || i == ca->count - 1)
+        if (req.compact)
+        {
+            parseResponseHeader(header, &responseId, &responseSize);
+            if (responseId != req.id || responseSize != req.size)
             {
-                pthread_mutex_lock(&ca->fileMutex);
-                for (size_t j = 0; j < msgInBuf; j++)
-                {
-                    ca->out << threadID << "," << firstMsgNo << " to "
-							<< lastMsgNo[j] << "," << ca->size << ","
-							<< roundTrips[j] << "\n";
-					firstMsgNo = lastMsgNo[j] + 1;
-                }
-                pthread_mutex_unlock(&ca->fileMutex);
-                msgInBuf = 0;
+                std::cerr << "Error: got response " << responseId << " ("
+                          << responseSize << " bytes) to request " << req.id
+                          << "\n";
+                exit(1);
             }
         }
 
+        if (!finishRecord(ca, &records, i, req.size))
+        {
+            break;
+        }
     }
-    close(sock);
-
-    struct timeval endTime;
-    if (gettimeofday(&endTime, NULL) == -1)
+    if (reader)
     {
-        exit(sockError("gettimeofday()", 0));
+        ca->readCalls += reader->calls();
+        delete reader;
     }
+    delete sink;
+    ca->bytesIn += bytesIn;
+    SSL_free(ssl);
+    close(sock);
+    ca->roundTrips.merge(latency);
+    keepSamples(ca, records.samples);
 
     double* timeToComplete = new double();
-    *timeToComplete = secondsDiff(startTime, endTime);
+    *timeToComplete = (monotonicNs() - startTime) / 1e9;
 #ifdef DEBUG
     std::cout << *timeToComplete << "\n";
 #endif
 
-    delete responseMsg;
     return timeToComplete;
 }
 
-void runClients(struct clientArgs* ca, int clients) 
+double runClients(struct clientArgs* ca, int clients) 
 {
     std::vector<pthread_t> threads;
     threads.resize(clients);
@@ -192,15 +602,15 @@ void runClients(struct clientArgs* ca, int clients)
     int rtn = 0;
     int i = 0;
     double* timeToComplete = 0;
-    double totalTime = 0;
-    double averageTime = 0;
-    
+
+    // each client waits for its turn to connect (rampDelayNs())
+    startRun(ca);
     for (i = 0; i < clients; i++)
     {
         std::pair<struct clientArgs*, int>* args 
                 = new std::pair<struct clientArgs*, int>();
         args->first = ca;
-        args->second = i;
+        args->second = ca->firstClient - 1 + i;
 
         if ((rtn = pthread_create(&threads[i], NULL, &requestData, 
                         (void*) args)))
@@ -212,117 +622,1631 @@ void runClients(struct clientArgs* ca, int clients)
             perror("pthread_create()");
             exit(1);
         }
-        usleep(1000);
     }
     for (i = 0; i < clients; i++)
     {
         pthread_join(threads[i], (void**) &timeToComplete);
-        totalTime += *timeToComplete;
+        ca->totalTime += *timeToComplete;
         delete timeToComplete;
     }
-    averageTime = totalTime / i;
-    std::cout << "Average connection time: " << averageTime << " seconds\n\n";
+    ca->elapsed = (monotonicNs() - ca->runStart) / 1e9;
+    ca->cpu = cpuSeconds() - ca->cpuStart;
+    return ca->roundTrips.count() / ca->elapsed;
 }
 
-int main(int argc, char** argv)
-{
-    int opt = 0;
-    double dopt = 0;
-    std::string option = "";
-    int clients = 0;
-
-    po::options_description desc("Allowed options");
-    desc.add_options()
-        ("host,h", po::value<std::string>(&option)->default_value("localhost"),
-         "host to connect to")
-        ("port,p", po::value<int>(&opt)->default_value(32000),
-         "port to use")
-        ("message-size,s", po::value<int>(&opt)->default_value(1024), 
-         "length of packets to request")
-        ("message-count,c", po::value<int>(&opt)->default_value(250),
-         "number of packets to request")
-        ("clients,x", po::value<int>(&opt)->default_value(250),
-         "number of clients to create")
-        ("write-to-file,w", po::value<int>(&opt)->default_value(1),
-         "write response time to disk (0 to disable)")
-        ("record-size,r", po::value<int>(&opt)->default_value(1),
-         "number of responses in each output record")
-        ("timeout,t", po::value<double>(&dopt)->default_value(10),
-         "seconds in timeout")
-        ("help", "show this message")
-    ;
-
-    po::variables_map vm;
-    try 
-    {
-        po::store(po::parse_command_line(argc, argv, desc), vm);
-        po::notify(vm);
-    } 
-    catch (const std::exception& e)
-    {
-        std::cerr << "Error: " << e.what() << "\n";
-        std::cerr << "\tuse --help to see program options\n";
-        return 1;
-    }
-    
-    if (vm.count("help"))
-    {
-        std::cout << desc << "\n";
-        return 0;
-    }
-
-    struct clientArgs args;
-
-    args.host = vm["host"].as<std::string>();
-    args.port = vm["port"].as<int>();
-    args.size = vm["message-size"].as<int>();
-    args.count = vm["message-count"].as<int>();
-    args.timeout = vm["timeout"].as<double>();
-    args.msgCount = vm["record-size"].as<int>();
-    args.writeToFile = vm["write-to-file"].as<int>();
-    clients = vm["clients"].as<int>();
+/**
+ * The connections driven by one thread of the epoll engine.
+ */
+struct engineThread {
+    struct clientArgs* ca;
+    EpollDriver driver;
+    /** Connections that haven't finished yet. */
+    int running;
+    /** Added up over every finished connection. */
+    double totalTime;
+    LatencyHistogram latency;
+    /** How late each open loop request went out, and when the last one
+     * did (monotonicNs()). */
+    LatencyHistogram sendLag;
+    uint64_t lastSend;
+    unsigned long readCalls;
+    /** Every connection's records, or NULL if they aren't kept. */
+    SampleBuffer* samples;
+    /** Round trips by response size (sizeBucket()). */
+    LatencyHistogram bySize[SIZE_BUCKETS];
+    LatencyHistogram connects;
+    unsigned long portWaits;
+    /** Response bytes received, and the pipe for --consume splice (or
+     * NULL), shared by every connection on the thread. */
+    uint64_t bytesIn;
+    SpliceSink* sink;
+};
 
-    std::cout << "Host:\t\t\t" << args.host << "\n";
-    std::cout << "Port:\t\t\t" << args.port << "\n";
-    std::cout << "Message size:\t\t" << args.size << "\n";
-    std::cout << "Message count:\t\t" << args.count << "\n";
-    std::cout << "Number of clients:\t" << clients << "\n";
-    std::cout << "Write to file:\t\t" << args.writeToFile << "\n";
-    std::cout << "Record size:\t\t" << args.msgCount << "\n";
-    std::cout << "Seconds to wait:\t" << args.timeout << "\n";
+/**
+ * The requests of one open loop client, shared by the coroutine sending them
+ * and the one reading the responses.
+ */
+struct openLoop {
+    int sock;
+    /** When each request was meant to go out (monotonicNs()). */
+    std::vector<uint64_t> intended;
+    /** The size of each response, chosen up front: legacy responses have no
+     * header, so the reader may need it before the request has gone. */
+    std::vector<uint32_t> sizes;
+    /** Requests sent so far. */
+    int sent;
+    /** Set by the reader when the sender should give up. */
+    bool failed;
+    /** Set by the sender once it has stopped. */
+    bool done;
+};
 
-    args.out.open(OUT_FILE);
-    if (!args.out)
-    {
-        std::cerr << "unable to open \"" << OUT_FILE << "\"\n";
-        exit(1);
-    }
-    args.out << "Thread ID,Message Count,Message Size,Seconds\n";
+/**
+ * Send one client's requests on schedule, whether or not the responses to
+ * the earlier ones have come back, so that a slow server can't slow down
+ * the load it's offered. The gaps between requests are either all the same
+ * or drawn from an exponential distribution (Poisson arrivals). When
+ * replaying a trace, the client sends every clients'th request in it, when
+ * the trace says to.
+ *
+ * @param et The thread running the client.
+ * @param ol The client's schedule.
+ * @param clientID The client's number, from 1.
+ */
+Task paceRequests(struct engineThread* et, struct openLoop* ol, int clientID)
+{
+    struct clientArgs* ca = et->ca;
+    EpollDriver* driver = &et->driver;
+    char requestMsg[MAX_REQUEST_SIZE];
+    struct Request req;
+    req.size = 0;
+    req.id = 0;
+    req.flags = ca->flags;
+    req.compact = ca->compact;
+    int requestSize = writeRequest(requestMsg, req);
+    int count = ol->intended.size();
+    // the mean gap between this client's requests, unless it's a trace's
+    double gapNs = ca->rate > 0 ? 1e9 * ca->clients / ca->rate : 0;
+    std::minstd_rand rng(clientID);
+    std::exponential_distribution<double> gaps(1.0);
+    uint64_t now = monotonicNs();
+    // fixed arrivals are spread out so the clients don't send in step
+    uint64_t next = now + (uint64_t) (ca->poisson ? gaps(rng) * gapNs
+            : gapNs * (clientID - 1) / ca->clients);
+    size_t traced = clientID - 1;
+    long done = 0;
+    long rtn = 0;
 
-    if (pthread_mutex_init(&args.fileMutex, NULL))
+    while (ol->sent < count && !ol->failed)
     {
-        std::cerr << "Error creating mutex\n";
-        exit(1);
+        if (!ca->trace.empty())
+        {
+            next = ca->traceStart + ca->trace[traced].ns;
+        }
+        if ((now = monotonicNs()) < next)
+        {
+            co_await driver->sleep(next - now);
+            continue;
+        }
+        req.id = ol->sent;
+        req.size = ol->sizes[ol->sent];
+        writeRequest(requestMsg, req);
+        ol->intended[ol->sent] = next;
+        for (done = 0; done < requestSize && !ol->failed; )
+        {
+            if ((rtn = send(ol->sock, requestMsg + done, requestSize - done, 
+                            MSG_NOSIGNAL)) >= 0)
+            {
+                done += rtn;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                co_await driver->writable(ol->sock);
+            }
+            else if (errno != EINTR)
+            {
+                // the reader finds out why
+                ol->failed = true;
+            }
+        }
+        if (ol->failed)
+        {
+            break;
+        }
+        et->lastSend = monotonicNs();
+        et->sendLag.record(et->lastSend - next);
+        ol->sent++;
+        traced += ca->clients;
+        next += (uint64_t) (ca->poisson ? gaps(rng) * gapNs : gapNs);
     }
-
-    runClients(&args, clients);
-
-    args.out.close();
-    return 0;
+    ol->done = true;
 }
 
 /**
- * Finds the difference between val1 and val2 in seconds. Accurate to 
- * microseconds.
- * @return The difference in seconds.
- * @author Dean Morin
+ * One client of the epoll engine: the same requests and records as
+ * requestData(), over a non-blocking socket, waiting on the thread's epoll
+ * loop whenever the socket would block. With a target rate or a trace the
+ * requests are sent by paceRequests() instead, and each round trip is timed
+ * from when its request was meant to go out rather than when it did.
+ *
+ * @param et The thread running the client.
+ * @param clientID The client's number in the CSV file, from 1.
  */
-double secondsDiff(const timeval& val1, const timeval& val2)
+Task driveClient(struct engineThread* et, int clientID)
 {
-    long sec1 = val1.tv_sec;
-    long sec2 = val2.tv_sec;
-    long usec1 = val1.tv_usec;
-    long usec2 = val2.tv_usec;
+    struct clientArgs* ca = et->ca;
+    EpollDriver* driver = &et->driver;
+    const SizeDistribution* sizes = ca->sizes.forClient(clientID);
+    SizeRng sizeRng(clientID);
+    struct Request req;
+    req.size = 0;
+    req.id = 0;
+    req.flags = ca->flags;
+    req.compact = ca->compact;
+    std::vector<char> requestMsgs(ca->depth * MAX_REQUEST_SIZE);
+    int requestSize = writeRequest(&requestMsgs[0], req);
+    int count = requestCount(ca, clientID);
+    bool paced = ca->rate > 0 || !ca->trace.empty();
+    // unordered responses can come back from anywhere in what's been sent
+    std::vector<uint64_t> sendTimes(req.flags & PROTO_UNORDERED ? count 
+                                                                : ca->depth);
+    std::vector<uint32_t> sendSizes(sendTimes.size());
+    uint32_t size = 0;
+    int sent = 0;
+    int batch = 0;
+    int headerSize = responseHeaderSize(req);
+    char responseHeader[RESPONSE_HEADER_SIZE];
+    uint32_t responseId = 0;
+    uint32_t responseSize = 0;
+    struct recordState records;
+    records.clientID = clientID;
+    records.samples = et->samples;
+    records.count = count;
+    records.bytes = 0;
+    struct openLoop ol;
+    uint64_t startTime = 0;
+    uint64_t requestStart = 0;
+    // the gap between this client's connections, if they're paced
+    double connectGapNs = ca->connectRate > 0 
+            ? 1e9 * ca->clients / ca->connectRate : 0;
+    uint64_t nextConnect = ca->runStart + rampDelayNs(ca, clientID)
+            + (uint64_t) (connectGapNs * (clientID - 1) / ca->clients);
+    uint64_t now = 0;
+    long done = 0;
+    long rtn = 0;
+    int err = 0;
+    socklen_t errSize = sizeof(err);
+    int sock = -1;
+    int i = 0;
 
-    return abs(sec2 - sec1) + abs(usec2 - usec1) * pow(10, -6);
+    // room for every response in flight, but no more: there may be 100k
+    size_t window = (size_t) (headerSize + sizes->max()) * ca->depth;
+    SocketReader reader(sock, window < READ_AHEAD_SIZE ? window 
+                                                       : READ_AHEAD_SIZE);
+    reader.discardBy(ca->consume, et->sink);
+
+    ol.sent = 0;
+    ol.failed = false;
+    ol.done = true;
+    if (paced)
+    {
+        ol.intended.resize(count);
+        ol.sizes.resize(count);
+        for (i = 0; i < count; i++)
+        {
+            ol.sizes[i] = ca->trace.empty() ? sizes->next(sizeRng)
+                    : ca->trace[clientID - 1 + (size_t) i * ca->clients].size;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (ca->churn && i && i % ca->churn == 0)
+        {
+            // this connection has made its share of the requests
+            driver->forget(sock);
+            close(sock);
+            sock = -1;
+        }
+        while (sock == -1)
+        {
+            if ((now = monotonicNs()) < nextConnect)
+            {
+                co_await driver->sleep(nextConnect - now);
+                continue;
+            }
+            if ((sock = connectToServer(ca, true)) == -1)
+            {
+                // every local port is taken, most likely by TIME_WAIT
+                et->portWaits++;
+                co_await driver->sleep(CHURN_RETRY_NS);
+                continue;
+            }
+            if (driver->watch(sock) == -1)
+            {
+                exit(sockError("epoll_ctl()", 0));
+            }
+            co_await driver->writable(sock);
+            if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errSize) == -1)
+            {
+                exit(sockError("getsockopt()", 0));
+            }
+            if (err)
+            {
+                exit(sockError("connect()", err));
+            }
+            et->connects.record(monotonicNs() - now);
+            nextConnect += (uint64_t) connectGapNs;
+            reader.reset(sock);
+
+            if (!startTime)
+            {
+                startTime = monotonicNs();
+            }
+            if (paced)
+            {
+                // an open loop client keeps its one connection
+                ol.sock = sock;
+                ol.done = false;
+                paceRequests(et, &ol, clientID);
+            }
+        }
+
+        // top up to ca->depth requests in flight, in one send(), but no
+        // further than the end of this connection's share
+        for (batch = 0; !paced && sent + batch < count 
+                && sent + batch < i + ca->depth 
+                && (!ca->churn || (sent + batch) / ca->churn == i / ca->churn);
+                batch++)
+        {
+            req.id = sent + batch;
+            req.size = sizes->next(sizeRng);
+            writeRequest(&requestMsgs[batch * requestSize], req);
+            sendTimes[req.id % sendTimes.size()] = monotonicNs();
+            sendSizes[req.id % sendSizes.size()] = req.size;
+        }
+        for (done = 0; done < batch * requestSize; )
+        {
+            if ((rtn = send(sock, &requestMsgs[done], 
+                            batch * requestSize - done, MSG_NOSIGNAL)) >= 0)
+            {
+                done += rtn;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                co_await driver->writable(sock);
+            }
+            else if (errno != EINTR)
+            {
+                perror("send() failed");
+                exit(1);
+            }
+        }
+
+        // read() and discard() stop short with EAGAIN when the socket is dry
+        for (done = 0, rtn = 0; rtn != -1 && done < headerSize; done += rtn)
+        {
+            if ((rtn = reader.read(responseHeader + done, headerSize - done))
+                    == -1)
+            {
+                break;
+            }
+            if (done + rtn < headerSize)
+            {
+                co_await driver->readable(sock);
+            }
+        }
+        if (rtn == -1)
+        {
+            std::cerr << "Error: the server closed the connection\n";
+            break;
+        }
+        sent += batch;
+
+        // legacy responses, and ordered compact ones, come back in order
+        responseId = i;
+        if (req.compact)
+        {
+            parseResponseHeader(responseHeader, &responseId, &responseSize);
+            if (req.flags & PROTO_UNORDERED 
+                    ? responseId >= (uint32_t) (paced ? ol.sent : sent)
+                    : responseId != (uint32_t) i)
+            {
+                std::cerr << "Error: got response " << responseId 
+                          << " to request " << i << "\n";
+                exit(1);
+            }
+        }
+        size = paced ? ol.sizes[responseId] 
+                     : sendSizes[responseId % sendSizes.size()];
+        if (req.compact && responseSize != size)
+        {
+            std::cerr << "Error: got " << responseSize << " bytes for request "
+                      << responseId << ", not " << size << "\n";
+            exit(1);
+        }
+
+        for (done = 0; done < (long) size; done += rtn)
+        {
+            if ((rtn = reader.discard(size - done)) == -1)
+            {
+                break;
+            }
+            if (done + rtn < (long) size)
+            {
+                co_await driver->readable(sock);
+            }
+        }
+        if (rtn == -1)
+        {
+            std::cerr << "Error: the server closed the connection\n";
+            break;
+        }
+
+        requestStart = paced ? ol.intended[responseId]
+                : sendTimes[responseId % sendTimes.size()];
+        startRecord(ca, &records, i, requestStart);
+        now = monotonicNs();
+        requestStart = now - requestStart;
+        et->bytesIn += headerSize + size;
+        if (ca->windows.record(now, requestStart))
+        {
+            et->latency.record(requestStart);
+            et->bySize[sizeBucket(size)].record(requestStart);
+        }
+
+        if (!finishRecord(ca, &records, i, size))
+        {
+            break;
+        }
+    }
+
+    if (!ol.done)
+    {
+        // wake the sender wherever it's waiting and let it see it's over
+        ol.failed = true;
+        shutdown(sock, SHUT_RDWR);
+        while (!ol.done)
+        {
+            co_await driver->sleep(SENDER_POLL_NS);
+        }
+    }
+    et->readCalls += reader.calls();
+    if (sock != -1)
+    {
+        driver->forget(sock);
+        close(sock);
+    }
+
+    et->totalTime += (monotonicNs() - startTime) / 1e9;
+    if (!--et->running)
+    {
+        driver->stop();
+    }
+}
+
+/**
+ * Body of an epoll engine thread.
+ *
+ * @param arg The thread's engineThread.
+ * @return NULL.
+ */
+void* runEngineThread(void* arg)
+{
+    ((struct engineThread*) arg)->driver.run();
+    return NULL;
+}
+
+/**
+ * Run the clients as coroutines spread over a few threads, each with its own
+ * epoll loop, rather than a thread each. Stream transports without TLS only.
+ *
+ * @param ca The clients' settings.
+ * @param clients The number of clients (connections) to run.
+ * @param numThreads The number of threads to run them on.
+ * @return The responses received per second.
+ */
+double runEngine(struct clientArgs* ca, int clients, int numThreads)
+{
+    std::vector<struct engineThread*> threads;
+    std::vector<pthread_t> ids;
+    struct rlimit rlim;
+    uint64_t start = 0;
+    uint64_t lastSend = 0;
+    int rtn = 0;
+    int i = 0;
+    int j = 0;
+
+    // a descriptor per connection, plus one epoll instance per thread
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+    if (rlim.rlim_cur < (rlim_t) clients + numThreads + 16)
+    {
+        std::cerr << "Warning: only " << rlim.rlim_cur << " file descriptors "
+                  << "allowed for " << clients << " connections\n";
+    }
+
+    if (numThreads > clients)
+    {
+        numThreads = clients;
+    }
+    threads.resize(numThreads);
+    ids.resize(numThreads);
+    for (i = 0; i < numThreads; i++)
+    {
+        try
+        {
+            threads[i] = new engineThread();
+        }
+        catch (const std::exception&)
+        {
+            exit(sockError("epoll_create1()", 0));
+        }
+        threads[i]->ca = ca;
+        threads[i]->running = clients / numThreads 
+                + (i < clients % numThreads);
+        threads[i]->samples = newSamples(ca, threads[i]->running);
+        threads[i]->totalTime = 0;
+        threads[i]->readCalls = 0;
+        threads[i]->lastSend = 0;
+        threads[i]->portWaits = 0;
+        threads[i]->bytesIn = 0;
+        threads[i]->sink = NULL;
+        try
+        {
+            if (ca->consume == DISCARD_SPLICE)
+            {
+                threads[i]->sink = new SpliceSink();
+            }
+        }
+        catch (const std::exception&)
+        {
+            exit(sockError("pipe()", 0));
+        }
+    }
+
+    // each client runs up to its connect here, then waits for its loop
+    startRun(ca);
+    for (i = 0; i < clients; i++)
+    {
+        driveClient(threads[i % numThreads], ca->firstClient + i);
+    }
+
+    start = monotonicNs();
+    ca->traceStart = start + TRACE_LEAD_NS;
+    for (i = 1; i < numThreads; i++)
+    {
+        if ((rtn = pthread_create(&ids[i], NULL, &runEngineThread, 
+                        (void*) threads[i])))
+        {
+            errno = rtn;
+            perror("pthread_create()");
+            exit(1);
+        }
+    }
+    runEngineThread(threads[0]);
+
+    for (i = 0; i < numThreads; i++)
+    {
+        if (i)
+        {
+            pthread_join(ids[i], NULL);
+        }
+        ca->totalTime += threads[i]->totalTime;
+        ca->roundTrips.merge(threads[i]->latency);
+        ca->sendLag.merge(threads[i]->sendLag);
+        for (j = 0; j < SIZE_BUCKETS; j++)
+        {
+            ca->bySize[j].merge(threads[i]->bySize[j]);
+        }
+        lastSend = std::max(lastSend, threads[i]->lastSend);
+        ca->connects.merge(threads[i]->connects);
+        ca->portWaits += threads[i]->portWaits;
+        ca->readCalls += threads[i]->readCalls;
+        ca->bytesIn += threads[i]->bytesIn;
+        delete threads[i]->sink;
+        keepSamples(ca, threads[i]->samples);
+        delete threads[i];
+    }
+    if (!ca->trace.empty())
+    {
+        // the lead before the first traced request isn't part of it
+        start = ca->traceStart;
+    }
+    if (ca->sendLag.count() && lastSend > start)
+    {
+        ca->offered = ca->sendLag.count() * 1e9 / (lastSend - start);
+    }
+    ca->elapsed = (monotonicNs() - start) / 1e9;
+    ca->cpu = cpuSeconds() - ca->cpuStart;
+    return ca->roundTrips.count() / ca->elapsed;
+}
+
+/**
+ * Write the round trip records kept so far, then forget them, so that the
+ * next run of a depth sweep starts its files empty.
+ *
+ * @param ca The clients' settings and results.
+ * @param out Where the records go as CSV.
+ * @param samplePath The file the records go in as written by writeSamples(),
+ *        if the clients were asked to keep them.
+ */
+void saveSamples(struct clientArgs* ca, std::ostream& out, 
+                 const std::string& samplePath)
+{
+    sortSamples(&ca->samples);
+    writeCsv(out, ca->samples);
+    if (ca->writeToFile 
+            && writeSamples(samplePath.c_str(), ca->samples) == -1)
+    {
+        perror(samplePath.c_str());
+    }
+    ca->samples.clear();
+}
+
+/**
+ * Print what every client measured.
+ *
+ * @param ca The clients' settings and results.
+ * @param clients The number of clients that ran.
+ */
+void printResults(struct clientArgs* ca, int clients)
+{
+    int i = 0;
+
+    if (ca->churn || ca->connectRate > 0)
+    {
+        printChurn(ca);
+    }
+    if (ca->sendLag.count())
+    {
+        std::cout << "Open loop:\t\t" << ca->offered << " requests/s offered";
+        if (ca->rate > 0)
+        {
+            std::cout << " of " << ca->rate;
+        }
+        std::cout << "\n";
+        ca->sendLag.print(std::cout, "Send lag");
+    }
+    if (ca->warmup <= 0)
+    {
+        // otherwise it's the steady state throughput, below
+        std::cout << "Throughput:\t\t" << ca->roundTrips.count() / ca->elapsed
+                  << " responses per second\n";
+    }
+    std::cout << "Average connection time: " << ca->totalTime / clients 
+              << " seconds\n";
+    ca->roundTrips.print(std::cout, "Round trip");
+    if (ca->sizes.varies() || !ca->trace.empty())
+    {
+        for (i = 0; i < SIZE_BUCKETS; i++)
+        {
+            if (ca->bySize[i].count())
+            {
+                std::string name = std::string("  ") + sizeBucketName(i);
+                ca->bySize[i].print(std::cout, name.c_str());
+            }
+        }
+    }
+    if (ca->warmup > 0 || ca->window > 0)
+    {
+        printWindows(ca);
+    }
+    if (!ca->udp)
+    {
+        std::cout << "Socket reads:\t\t" << ca->readCalls << " for "
+                  << ca->roundTrips.count() << " responses\n";
+    }
+    // if the client is busy, the results say as much about it as the server
+    std::cout << "Client CPU:\t\t" << ca->cpu << " seconds, " 
+              << 100 * ca->cpu / ca->elapsed << "% of a core";
+    if (ca->bytesIn)
+    {
+        std::cout << ", " << ca->cpu / (ca->bytesIn / 1e9) 
+                  << " seconds per GB received";
+    }
+    std::cout << "\n";
+    if (ca->tls)
+    {
+        std::cout << "Kernel TLS:\t\tsend on " << ca->kernelSends 
+                  << ", recv on " << ca->kernelRecvs << " of " << clients
+                  << " connections\n";
+    }
+    std::cout << "\n";
+}
+
+/**
+ * Print the throughput after the warmup, and the throughput and latency of
+ * each window, so that a long run shows whether it slowed down.
+ *
+ * @param ca The clients' settings and results.
+ */
+void printWindows(struct clientArgs* ca)
+{
+    double measured = ca->windows.measured() / 1e9;
+    double length = 0;
+    size_t i = 0;
+
+    std::cout << "Steady state:\t\t" 
+              << (measured > 0 ? ca->roundTrips.count() / measured : 0)
+              << " responses per second over " << measured << " seconds";
+    if (ca->warmup > 0)
+    {
+        std::cout << ", after " << ca->warmup << " seconds of warmup";
+    }
+    std::cout << "\n";
+    if (ca->window <= 0 || !ca->windows.size())
+    {
+        return;
+    }
+
+    std::cout << "Window (s)\tResponses/s\tp50 (usec)\tp99 (usec)\t"
+              << "max (usec)\n";
+    for (i = 0; i < ca->windows.size(); i++)
+    {
+        const LatencyHistogram* window = ca->windows.window(i);
+        // the last one stops when the run did
+        length = std::min(ca->window, measured - i * ca->window);
+        std::cout << ca->warmup + i * ca->window << "\t\t";
+        if (!window || !window->count())
+        {
+            std::cout << "0\n";
+            continue;
+        }
+        std::cout << (length > 0 ? window->count() / length : 0) << "\t\t"
+                  << window->percentile(50) / 1000.0 << "\t\t" 
+                  << window->percentile(99) / 1000.0 << "\t\t" 
+                  << window->max() / 1000.0 << "\n";
+    }
+}
+
+/**
+ * Count this machine's TCP sockets to the server that are in TIME_WAIT, each
+ * holding a local port until it times out. Linux only.
+ *
+ * @param ca The clients' settings.
+ * @param ports Set to the number of local ports there are to connect from.
+ * @return The number of sockets, or -1 if they can't be counted.
+ */
+int countTimeWait(struct clientArgs* ca, int* ports)
+{
+    std::ifstream range("/proc/sys/net/ipv4/ip_local_port_range");
+    std::ifstream table("/proc/net/tcp");
+    std::string line;
+    unsigned int remoteAddr = 0;
+    unsigned int remotePort = 0;
+    unsigned int state = 0;
+    int low = 0;
+    int high = 0;
+    int count = 0;
+
+    if (!ca->unixPath.empty() || !(range >> low >> high) || !table)
+    {
+        return -1;
+    }
+    *ports = high - low + 1;
+
+    // "sl: local_ip:port remote_ip:port st ...", in hex; the addresses are
+    // as they're stored, so they compare with sin_addr as is
+    std::getline(table, line);
+    while (std::getline(table, line))
+    {
+        if (sscanf(line.c_str(), "%*d: %*x:%*x %x:%x %x", &remoteAddr, 
+                    &remotePort, &state) == 3
+                && state == TCP_TIME_WAIT
+                && remoteAddr == ca->addr.sin_addr.s_addr
+                && remotePort == ntohs(ca->addr.sin_port))
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Print how a churning run's connections went: how fast they were made, how
+ * long each took, and how many local ports they used up.
+ *
+ * @param ca The clients' settings and results.
+ */
+void printChurn(struct clientArgs* ca)
+{
+    int ports = 0;
+    int waiting = countTimeWait(ca, &ports);
+
+    std::cout << "Connections:\t\t" << ca->connects.count() << ", "
+              << ca->connects.count() / ca->elapsed << " per second";
+    if (ca->connectRate > 0)
+    {
+        std::cout << " of " << ca->connectRate;
+    }
+    std::cout << "\n";
+    ca->connects.print(std::cout, "Connect");
+    if (ca->portWaits)
+    {
+        std::cout << "Out of ports:\t\t" << ca->portWaits << " waits for a "
+                  << "local port\n";
+    }
+    if (waiting != -1)
+    {
+        std::cout << "TIME_WAIT:\t\t" << waiting << " sockets to the server, "
+                  << "of " << ports << " local ports\n";
+    }
+}
+
+/**
+ * Run the clients on whichever engine was asked for.
+ *
+ * @param ca The clients' settings.
+ * @param clients The number of clients to run.
+ * @param epoll True for the epoll engine, false for a thread each.
+ * @param numThreads The number of threads for the epoll engine.
+ * @return The responses received per second.
+ */
+double runLoad(struct clientArgs* ca, int clients, bool epoll, int numThreads)
+{
+    return epoll ? runEngine(ca, clients, numThreads) : runClients(ca, clients);
+}
+
+/**
+ * Pack up everything a worker process measured, for its coordinator.
+ *
+ * @param ca The worker's settings and results.
+ * @return The body of a CONTROL_RESULTS message.
+ */
+std::string packResults(struct clientArgs* ca)
+{
+    std::string body;
+    int i = 0;
+
+    pack(&body, ca->elapsed);
+    pack(&body, ca->totalTime);
+    pack(&body, ca->offered);
+    pack(&body, (uint64_t) ca->readCalls);
+    pack(&body, (uint64_t) ca->portWaits);
+    pack(&body, (uint64_t) ca->bytesIn);
+    pack(&body, ca->cpu);
+    pack(&body, (int32_t) ca->kernelSends);
+    pack(&body, (int32_t) ca->kernelRecvs);
+    packHistogram(&body, ca->roundTrips);
+    for (i = 0; i < SIZE_BUCKETS; i++)
+    {
+        packHistogram(&body, ca->bySize[i]);
+    }
+    packHistogram(&body, ca->connects);
+    packHistogram(&body, ca->sendLag);
+    packWindows(&body, ca->windows);
+    pack(&body, (uint64_t) ca->samples.size());
+    body.append((const char*) ca->samples.data(), 
+                ca->samples.size() * sizeof(Sample));
+    return body;
+}
+
+/**
+ * Add a worker's results to the coordinator's. The slowest worker's run time
+ * is kept as the run's, and the rates they offered are added up.
+ *
+ * @param body A CONTROL_RESULTS message from packResults().
+ * @param ca The coordinator's settings and results.
+ * @return False if the message is cut short.
+ */
+bool unpackResults(const std::string& body, struct clientArgs* ca)
+{
+    size_t at = 0;
+    double elapsed = 0;
+    double totalTime = 0;
+    double offered = 0;
+    uint64_t readCalls = 0;
+    uint64_t portWaits = 0;
+    uint64_t bytesIn = 0;
+    double cpu = 0;
+    int32_t kernelSends = 0;
+    int32_t kernelRecvs = 0;
+    uint64_t samples = 0;
+    int i = 0;
+
+    if (!unpack(body, &at, &elapsed) || !unpack(body, &at, &totalTime)
+            || !unpack(body, &at, &offered) || !unpack(body, &at, &readCalls)
+            || !unpack(body, &at, &portWaits) 
+            || !unpack(body, &at, &bytesIn) || !unpack(body, &at, &cpu)
+            || !unpack(body, &at, &kernelSends)
+            || !unpack(body, &at, &kernelRecvs)
+            || !unpackHistogram(body, &at, &ca->roundTrips))
+    {
+        return false;
+    }
+    for (i = 0; i < SIZE_BUCKETS; i++)
+    {
+        if (!unpackHistogram(body, &at, &ca->bySize[i]))
+        {
+            return false;
+        }
+    }
+    if (!unpackHistogram(body, &at, &ca->connects) 
+            || !unpackHistogram(body, &at, &ca->sendLag)
+            || !unpackWindows(body, &at, &ca->windows)
+            || !unpack(body, &at, &samples)
+            || (body.size() - at) / sizeof(Sample) != samples)
+    {
+        return false;
+    }
+    ca->samples.resize(ca->samples.size() + samples);
+    body.copy((char*) (ca->samples.data() + ca->samples.size() - samples),
+              samples * sizeof(Sample), at);
+
+    ca->elapsed = std::max(ca->elapsed, elapsed);
+    ca->totalTime += totalTime;
+    ca->offered += offered;
+    ca->readCalls += readCalls;
+    ca->portWaits += portWaits;
+    ca->bytesIn += bytesIn;
+    ca->cpu += cpu;
+    ca->kernelSends += kernelSends;
+    ca->kernelRecvs += kernelRecvs;
+    return true;
+}
+
+/**
+ * Run clients as one of a coordinator's worker processes: say how many
+ * clients this process has, wait until every worker is ready, run, then send
+ * back everything measured. The coordinator numbers the clients.
+ *
+ * @param ca The clients' settings.
+ * @param clients The number of clients this worker runs.
+ * @param control The socket to the coordinator; closed.
+ * @param epoll True for the epoll engine, false for a thread each.
+ * @param numThreads The number of threads for the epoll engine.
+ * @return The exit status: 0, or 1 if the coordinator couldn't be reached.
+ */
+int runWorker(struct clientArgs* ca, int clients, int control, bool epoll,
+        int numThreads)
+{
+    std::string body;
+    size_t at = 0;
+    int32_t firstClient = 0;
+    int32_t allClients = 0;
+
+    pack(&body, (int32_t) clients);
+    if (sendControl(control, CONTROL_READY, body) 
+            || recvControl(control, CONTROL_GO, &body)
+            || !unpack(body, &at, &firstClient) 
+            || !unpack(body, &at, &allClients))
+    {
+        perror("Error waiting for the coordinator");
+        close(control);
+        return 1;
+    }
+    ca->firstClient = firstClient;
+    ca->clients = allClients;
+
+    runLoad(ca, clients, epoll, numThreads);
+
+    if (sendControl(control, CONTROL_RESULTS, packResults(ca)))
+    {
+        perror("Error sending results to the coordinator");
+        close(control);
+        return 1;
+    }
+    close(control);
+    return 0;
+}
+
+/**
+ * Run the clients in several worker processes, each with its own share of
+ * them, and gather their results. None starts until all are ready. The
+ * workers are either forked here, splitting the clients evenly, or started
+ * separately (with --worker) and connected to a unix domain socket here,
+ * each running as many clients as it was told to.
+ *
+ * @param ca The clients' settings; every worker's results are added to it.
+ * @param clients The number of clients to split between forked workers.
+ * @param processes The number of workers.
+ * @param controlPath Where to listen for workers, or "" to fork them.
+ * @param epoll True for the epoll engine, false for a thread each.
+ * @param numThreads The number of threads for each worker's epoll engine.
+ * @return The responses received per second by all the workers together.
+ */
+double coordinate(struct clientArgs* ca, int clients, int processes,
+        const std::string& controlPath, bool epoll, int numThreads)
+{
+    std::vector<int> socks(processes);
+    std::vector<int32_t> counts(processes);
+    std::vector<pid_t> pids;
+    std::string body;
+    int32_t firstClient = 1;
+    int32_t allClients = 0;
+    int listenFd = -1;
+    int pair[2];
+    pid_t pid = 0;
+    size_t at = 0;
+    int i = 0;
+    int j = 0;
+
+    if (controlPath.empty())
+    {
+        // anything buffered would be printed again by every worker
+        std::cout.flush();
+        for (i = 0; i < processes; i++)
+        {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+            {
+                exit(sockError("socketpair()", 0));
+            }
+            if ((pid = fork()) == -1)
+            {
+                perror("fork()");
+                exit(1);
+            }
+            if (!pid)
+            {
+                close(pair[0]);
+                for (j = 0; j < i; j++)
+                {
+                    close(socks[j]);
+                }
+                _exit(runWorker(ca, clients / processes 
+                                    + (i < clients % processes),
+                                pair[1], epoll, numThreads));
+            }
+            close(pair[1]);
+            socks[i] = pair[0];
+            pids.push_back(pid);
+        }
+    }
+    else
+    {
+        if ((listenFd = listenControl(controlPath.c_str(), processes)) == -1)
+        {
+            perror(controlPath.c_str());
+            exit(1);
+        }
+        std::cout << "Waiting for " << processes << " workers on " 
+                  << controlPath << "\n";
+        std::cout.flush();
+        for (i = 0; i < processes; i++)
+        {
+            if ((socks[i] = accept(listenFd, NULL, NULL)) == -1)
+            {
+                exit(sockError("accept()", 0));
+            }
+        }
+        close(listenFd);
+        unlink(controlPath.c_str());
+    }
+
+    // the barrier: every worker is set up before any of them starts
+    for (i = 0; i < processes; i++)
+    {
+        at = 0;
+        if (recvControl(socks[i], CONTROL_READY, &body)
+                || !unpack(body, &at, &counts[i]))
+        {
+            perror("Error waiting for a worker");
+            exit(1);
+        }
+        allClients += counts[i];
+    }
+    for (i = 0; i < processes; i++)
+    {
+        body.clear();
+        pack(&body, firstClient);
+        pack(&body, allClients);
+        if (sendControl(socks[i], CONTROL_GO, body))
+        {
+            perror("Error starting a worker");
+            exit(1);
+        }
+        firstClient += counts[i];
+    }
+
+    ca->clients = allClients;
+    for (i = 0; i < processes; i++)
+    {
+        if (recvControl(socks[i], CONTROL_RESULTS, &body)
+                || !unpackResults(body, ca))
+        {
+            perror("Error getting a worker's results");
+            exit(1);
+        }
+        close(socks[i]);
+    }
+    for (i = 0; i < (int) pids.size(); i++)
+    {
+        waitpid(pids[i], NULL, 0);
+    }
+    return ca->roundTrips.count() / ca->elapsed;
+}
+
+/**
+ * Parse a --ramp profile into ca->rampSteps and ca->rampSeconds.
+ *
+ * @param spec "instant", "linear:SECONDS" or "step:STEPS:SECONDS".
+ * @param ca The clients' settings.
+ * @return False if spec doesn't make sense.
+ */
+bool parseRamp(const std::string& spec, struct clientArgs* ca)
+{
+    std::stringstream in(spec);
+    std::string kind;
+    char colon = 0;
+
+    std::getline(in, kind, ':');
+    ca->rampSteps = 0;
+    ca->rampSeconds = 0;
+    if (kind == "instant")
+    {
+        return in.eof();
+    }
+    if (kind == "step" && !(in >> ca->rampSteps >> colon 
+                && colon == ':' && ca->rampSteps >= 1))
+    {
+        return false;
+    }
+    if (kind != "linear" && kind != "step")
+    {
+        return false;
+    }
+    return in >> ca->rampSeconds && in.eof() && ca->rampSeconds >= 0;
+}
+
+int main(int argc, char** argv)
+{
+    int opt = 0;
+    double dopt = 0;
+    std::string option = "";
+    int clients = 0;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("host,h", po::value<std::string>(&option)->default_value("localhost"),
+         "host to connect to")
+        ("port,p", po::value<int>(&opt)->default_value(32000),
+         "port to use")
+        ("unix,u", po::value<std::string>(),
+         "connect to a unix domain socket at this path instead of TCP")
+        ("udp", "send requests over UDP instead of TCP")
+        ("tls", "encrypt connections with TLS, offloaded to the kernel "
+         "(kTLS) where possible")
+        ("compact", "send compact requests with IDs instead of the legacy "
+         "66-byte format")
+        ("unordered", "let the server answer requests out of order "
+         "(implies --compact)")
+        ("message-size,s", po::value<int>(&opt)->default_value(1024), 
+         "length of packets to request")
+        ("sizes", po::value<std::vector<std::string> >(),
+         "response sizes to draw from instead of --message-size: N, "
+         "uniform:MIN:MAX, lognormal:MEDIAN:SIGMA, zipf:MAX:S or "
+         "bimodal:SMALL:LARGE:P (sizes may end in K or M). Repeat for a "
+         "mix, each given to its share of the clients, optionally weighted "
+         "as WEIGHT*SPEC")
+        ("trace", po::value<std::string>(),
+         "replay a file of 'seconds,size' lines, dealing the requests out "
+         "to the clients in turn and sending each when the trace says "
+         "(needs --engine epoll; replaces --message-count and --rate)")
+        ("message-count,c", po::value<int>(&opt)->default_value(250),
+         "number of packets to request")
+        ("clients,x", po::value<int>(&opt)->default_value(250),
+         "number of clients to create")
+        ("write-to-file,w", po::value<int>(&opt)->default_value(1),
+         "write response time to disk (0 to disable)")
+        ("record-size,r", po::value<int>(&opt)->default_value(1),
+         "number of responses in each output record")
+        ("timeout,t", po::value<double>(&dopt)->default_value(10),
+         "seconds in timeout")
+        ("engine", po::value<std::string>(&option)->default_value("threads"),
+         "how to run the clients: 'threads' (a thread each) or 'epoll' "
+         "(non-blocking connections shared by a few threads; tcp and unix "
+         "only, no tls)")
+        ("threads,T", po::value<int>(&opt)->default_value(
+         sysconf(_SC_NPROCESSORS_ONLN)),
+         "number of threads for --engine epoll")
+        ("rate", po::value<double>(&dopt)->default_value(0),
+         "requests per second from all the clients together, sent on "
+         "schedule whether or not earlier ones have been answered (open "
+         "loop; needs --engine epoll). 0 sends each request once the last "
+         "one is answered")
+        ("arrivals", po::value<std::string>(&option)->default_value(
+         "poisson"),
+         "gaps between open loop requests: 'poisson' (random) or 'fixed'")
+        ("pipeline", po::value<std::string>(&option)->default_value("1"),
+         "requests each client keeps in flight (needs --engine epoll past 1). "
+         "A list, such as 1,4,16, runs once per depth and compares them")
+        ("churn", po::value<int>(&opt)->default_value(0),
+         "requests to make on each connection before closing it and "
+         "connecting again (needs --engine epoll). 0 keeps one connection")
+        ("connect-rate", po::value<double>(&dopt)->default_value(0),
+         "new connections per second from all the clients together (needs "
+         "--engine epoll). 0 connects as fast as they can")
+        ("consume", po::value<std::string>(&option)->default_value("copy"),
+         "how to throw away response payloads: 'copy' (read them into a "
+         "reused buffer), 'trunc' (recv() with MSG_TRUNC; tcp only) or "
+         "'splice' (through a pipe to /dev/null; tcp or unix). Neither of "
+         "the last two copies the bytes; use them for big responses")
+        ("ramp", po::value<std::string>(),
+         "how the clients connect: 'instant' (all at once), "
+         "'linear:SECONDS' (spread evenly over SECONDS) or "
+         "'step:STEPS:SECONDS' (in STEPS groups, SECONDS apart). By default "
+         "threads connect 1 ms apart and --engine epoll connects at once")
+        ("warmup", po::value<double>(&dopt)->default_value(0),
+         "seconds from the start of the run to leave out of the latency "
+         "results")
+        ("window", po::value<double>(&dopt)->default_value(0),
+         "also report throughput and latency for each window of this many "
+         "seconds after the warmup")
+        ("processes", po::value<int>(&opt)->default_value(1),
+         "worker processes to split the clients between, started together "
+         "and reported on as one run")
+        ("control", po::value<std::string>(),
+         "wait at this unix domain socket for --processes workers started "
+         "separately with --worker, instead of forking them")
+        ("worker", po::value<std::string>(),
+         "run as a worker for the coordinator listening at this unix domain "
+         "socket, which reports the results")
+        ("help", "show this message")
+    ;
+
+    po::variables_map vm;
+    try 
+    {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } 
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    
+    if (vm.count("help"))
+    {
+        std::cout << desc << "\n";
+        return 0;
+    }
+
+    struct clientArgs args;
+
+    args.host = vm["host"].as<std::string>();
+    args.port = vm["port"].as<int>();
+    args.udp = vm.count("udp");
+    if (vm.count("unix"))
+    {
+        args.unixPath = vm["unix"].as<std::string>();
+    }
+    if (args.udp && !args.unixPath.empty())
+    {
+        std::cerr << "Error: --unix and --udp can't be used together\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (args.udp && vm.count("tls"))
+    {
+        std::cerr << "Error: --tls needs a stream transport, not --udp\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    std::string engine = vm["engine"].as<std::string>();
+    int engineThreads = vm["threads"].as<int>();
+    if (engine != "threads" && engine != "epoll")
+    {
+        std::cerr << "Error: --engine must be 'threads' or 'epoll'\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (engine == "epoll" && (args.udp || vm.count("tls")))
+    {
+        std::cerr << "Error: --engine epoll doesn't do --udp or --tls\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    args.rate = vm["rate"].as<double>();
+    args.poisson = vm["arrivals"].as<std::string>() == "poisson";
+    if (args.rate < 0 || (!args.poisson 
+                && vm["arrivals"].as<std::string>() != "fixed"))
+    {
+        std::cerr << "Error: --rate can't be negative, and --arrivals must "
+                  << "be 'poisson' or 'fixed'\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (args.rate > 0 && engine != "epoll")
+    {
+        std::cerr << "Error: --rate needs --engine epoll\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    std::vector<int> depths;
+    std::stringstream depthList(vm["pipeline"].as<std::string>());
+    while (std::getline(depthList, option, ','))
+    {
+        depths.push_back(atoi(option.c_str()));
+        if (depths.back() < 1)
+        {
+            std::cerr << "Error: --pipeline depths must be at least 1\n";
+            std::cerr << "\tuse --help to see program options\n";
+            return 1;
+        }
+    }
+    if (depths.empty() || ((depths.size() > 1 || depths[0] > 1) 
+                && (engine != "epoll" || args.rate > 0 || vm.count("trace"))))
+    {
+        std::cerr << "Error: --pipeline needs --engine epoll, and no --rate "
+                  << "or --trace\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    args.churn = vm["churn"].as<int>();
+    args.connectRate = vm["connect-rate"].as<double>();
+    args.portWaits = 0;
+    args.firstClient = 1;
+    args.offered = 0;
+    args.elapsed = 0;
+    args.totalTime = 0;
+    if (args.churn < 0 || args.connectRate < 0)
+    {
+        std::cerr << "Error: --churn and --connect-rate can't be negative\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if ((args.churn || args.connectRate > 0) 
+            && (engine != "epoll" || args.rate > 0 || vm.count("trace")))
+    {
+        std::cerr << "Error: --churn and --connect-rate need --engine epoll, "
+                  << "and no --rate or --trace\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    int processes = vm["processes"].as<int>();
+    std::string controlPath;
+    if (vm.count("control"))
+    {
+        controlPath = vm["control"].as<std::string>();
+    }
+    if (processes < 1 || (vm.count("worker") && vm.count("control")))
+    {
+        std::cerr << "Error: --processes must be at least 1, and --worker "
+                  << "can't be used with --control\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (depths.size() > 1 && (processes > 1 || vm.count("control") 
+                || vm.count("worker")))
+    {
+        std::cerr << "Error: a list of --pipeline depths can't be split "
+                  << "between processes\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (engineThreads < 1)
+    {
+        std::cerr << "Error: --threads must be at least 1\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (args.unixPath.empty())
+    {
+        struct hostent* hp;
+
+        memset((char*) &args.addr, 0, sizeof(args.addr));
+        args.addr.sin_family = AF_INET;
+        args.addr.sin_port = htons(args.port);
+        if (!(hp = gethostbyname(args.host.c_str())))
+        {
+            std::cerr << "Error: unknown server address\n";
+            exit(1);
+        }
+        memcpy((char*) &args.addr.sin_addr, hp->h_addr, hp->h_length);
+    }
+
+    args.compact = vm.count("compact") || vm.count("unordered");
+    args.flags = vm.count("unordered") ? PROTO_UNORDERED : 0;
+    args.tls = NULL;
+    args.kernelSends = 0;
+    args.readCalls = 0;
+    args.kernelRecvs = 0;
+    if (vm.count("tls"))
+    {
+        try
+        {
+            args.tls = new TlsContext(false);
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Error creating the TLS context\n";
+            return 1;
+        }
+        // OpenSSL writes to sockets without MSG_NOSIGNAL
+        signal(SIGPIPE, SIG_IGN);
+    }
+    if (!vm.count("sizes"))
+    {
+        args.sizes.add(std::to_string(vm["message-size"].as<int>()));
+    }
+    else
+    {
+        std::vector<std::string> specs 
+                = vm["sizes"].as<std::vector<std::string> >();
+        for (size_t i = 0; i < specs.size(); i++)
+        {
+            if (!args.sizes.add(specs[i]))
+            {
+                std::cerr << "Error: bad size distribution \"" << specs[i] 
+                          << "\"\n";
+                std::cerr << "\tuse --help to see program options\n";
+                return 1;
+            }
+        }
+    }
+    if (vm.count("trace"))
+    {
+        std::string path = vm["trace"].as<std::string>();
+        size_t line = 0;
+
+        if (engine != "epoll" || args.rate > 0)
+        {
+            std::cerr << "Error: --trace needs --engine epoll, and no "
+                      << "--rate\n";
+            std::cerr << "\tuse --help to see program options\n";
+            return 1;
+        }
+        if (loadTrace(path.c_str(), &args.trace, &line) == -1)
+        {
+            if (errno == EINVAL)
+            {
+                std::cerr << "Error: " << path << " line " << line 
+                          << " isn't 'seconds,size'\n";
+            }
+            else
+            {
+                perror(path.c_str());
+            }
+            return 1;
+        }
+        if (args.trace.empty())
+        {
+            std::cerr << "Error: " << path << " has no requests in it\n";
+            return 1;
+        }
+    }
+    args.count = vm["message-count"].as<int>();
+    args.timeout = vm["timeout"].as<double>();
+    args.msgCount = vm["record-size"].as<int>();
+    args.writeToFile = vm["write-to-file"].as<int>();
+    clients = vm["clients"].as<int>();
+    args.clients = clients;
+    std::string consume = vm["consume"].as<std::string>();
+    args.consume = consume == "trunc" ? DISCARD_TRUNC 
+            : consume == "splice" ? DISCARD_SPLICE : DISCARD_COPY;
+    args.bytesIn = 0;
+    args.cpu = 0;
+    if (consume != "copy" && consume != "trunc" && consume != "splice")
+    {
+        std::cerr << "Error: --consume must be 'copy', 'trunc' or "
+                  << "'splice'\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (args.consume != DISCARD_COPY && (args.udp || args.tls 
+                || (args.consume == DISCARD_TRUNC && !args.unixPath.empty())))
+    {
+        std::cerr << "Error: --consume " << consume << " needs a plain "
+                  << (args.consume == DISCARD_TRUNC ? "tcp" : "stream") 
+                  << " socket, no --udp or --tls\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    args.warmup = vm["warmup"].as<double>();
+    args.window = vm["window"].as<double>();
+    args.rampSteps = 0;
+    args.rampSeconds = engine == "epoll" ? 0 : clients / 1000.0;
+    if (vm.count("ramp") 
+            && !parseRamp(vm["ramp"].as<std::string>(), &args))
+    {
+        std::cerr << "Error: --ramp must be 'instant', 'linear:SECONDS' or "
+                  << "'step:STEPS:SECONDS'\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (args.warmup < 0 || args.window < 0)
+    {
+        std::cerr << "Error: --warmup and --window can't be negative\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (processes > 1 && controlPath.empty() && clients < processes)
+    {
+        std::cerr << "Error: --processes can't be more than --clients\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+
+    std::cout << "Host:\t\t\t" << args.host << "\n";
+    std::cout << "Port:\t\t\t" << args.port << "\n";
+    std::cout << "Transport:\t\t" << (args.udp ? "udp" 
+            : args.unixPath.empty() ? "tcp" : args.unixPath) 
+            << (args.tls ? " + tls" : "") << "\n";
+    std::cout << "Protocol:\t\t" << (!args.compact ? "legacy" 
+            : args.flags & PROTO_UNORDERED ? "compact, unordered" : "compact")
+            << "\n";
+    if (args.trace.empty())
+    {
+        std::cout << "Message size:\t\t" << args.sizes.describe() << "\n";
+        std::cout << "Message count:\t\t" << args.count << "\n";
+    }
+    else
+    {
+        std::cout << "Trace:\t\t\t" << vm["trace"].as<std::string>() << ", "
+                  << args.trace.size() << " requests over " 
+                  << args.trace.back().ns / 1e9 << " seconds\n";
+    }
+    std::cout << "Number of clients:\t" << clients << "\n";
+    if (processes > 1 || !controlPath.empty())
+    {
+        std::cout << "Processes:\t\t" << processes 
+                  << (controlPath.empty() ? "\n" : " (started separately)\n");
+    }
+    std::cout << "Engine:\t\t\t" << engine;
+    if (engine == "epoll")
+    {
+        std::cout << ", " << engineThreads << " threads";
+    }
+    std::cout << "\n";
+    std::cout << "Pipeline depth:\t\t" << vm["pipeline"].as<std::string>()
+              << "\n";
+    std::cout << "Offered load:\t\t";
+    if (args.rate > 0)
+    {
+        std::cout << args.rate << " requests/s, " 
+                  << (args.poisson ? "poisson" : "fixed") << " arrivals\n";
+    }
+    else
+    {
+        std::cout << (args.trace.empty() ? "closed loop\n" : "as traced\n");
+    }
+    if (args.churn || args.connectRate > 0)
+    {
+        std::cout << "Connections:\t\t";
+        if (args.churn)
+        {
+            std::cout << "a new one every " << args.churn << " requests, ";
+        }
+        if (args.connectRate > 0)
+        {
+            std::cout << args.connectRate << " per second\n";
+        }
+        else
+        {
+            std::cout << "as fast as possible\n";
+        }
+    }
+    std::cout << "Consume:\t\t" << consume << "\n";
+    std::cout << "Ramp up:\t\t";
+    if (args.rampSeconds <= 0)
+    {
+        std::cout << "instant\n";
+    }
+    else if (!args.rampSteps)
+    {
+        std::cout << "linear over " << args.rampSeconds << " seconds\n";
+    }
+    else
+    {
+        std::cout << args.rampSteps << " steps, " << args.rampSeconds 
+                  << " seconds apart\n";
+    }
+    if (args.warmup > 0 || args.window > 0)
+    {
+        std::cout << "Measurement:\t\t" << args.warmup 
+                  << " seconds of warmup";
+        if (args.window > 0)
+        {
+            std::cout << ", then " << args.window << " second windows";
+        }
+        std::cout << "\n";
+    }
+    std::cout << "Write to file:\t\t" << args.writeToFile << "\n";
+    std::cout << "Record size:\t\t" << args.msgCount << "\n";
+    std::cout << "Seconds to wait:\t" << args.timeout << "\n";
+
+    if (pthread_mutex_init(&args.samplesMutex, NULL))
+    {
+        std::cerr << "Error creating mutex\n";
+        exit(1);
+    }
+    args.depth = depths[0];
+
+    // a worker leaves the report and the output files to its coordinator
+    if (vm.count("worker"))
+    {
+        int control = connectControl(vm["worker"].as<std::string>().c_str());
+        if (control == -1)
+        {
+            perror(vm["worker"].as<std::string>().c_str());
+            return 1;
+        }
+        std::cout.flush();
+        opt = runWorker(&args, clients, control, engine == "epoll", 
+                        engineThreads);
+        delete args.tls;
+        return opt;
+    }
+
+    std::ofstream out;
+    if (depths.size() == 1)
+    {
+        out.open(OUT_FILE);
+        if (!out)
+        {
+            std::cerr << "unable to open \"" << OUT_FILE << "\"\n";
+            exit(1);
+        }
+    }
+
+    if (processes > 1 || !controlPath.empty())
+    {
+        coordinate(&args, clients, processes, controlPath, 
+                   engine == "epoll", engineThreads);
+        printResults(&args, args.clients);
+    }
+    else if (depths.size() == 1)
+    {
+        runLoad(&args, clients, engine == "epoll", engineThreads);
+        printResults(&args, clients);
+    }
+    else
+    {
+        std::vector<double> throughput;
+        std::vector<uint64_t> p50;
+        std::vector<uint64_t> p99;
+        size_t i = 0;
+
+        for (i = 0; i < depths.size(); i++)
+        {
+            std::cout << "Pipeline depth:\t\t" << depths[i] << "\n";
+            args.depth = depths[i];
+            args.roundTrips.reset();
+            for (size_t j = 0; j < SIZE_BUCKETS; j++)
+            {
+                args.bySize[j].reset();
+            }
+            args.readCalls = 0;
+            args.connects.reset();
+            args.portWaits = 0;
+            args.sendLag.reset();
+            args.offered = 0;
+            args.totalTime = 0;
+            args.bytesIn = 0;
+            throughput.push_back(runEngine(&args, clients, engineThreads));
+            printResults(&args, clients);
+            p50.push_back(args.roundTrips.percentile(50));
+            p99.push_back(args.roundTrips.percentile(99));
+
+            // each depth gets its own files; one file couldn't tell them apart
+            std::string name = DEPTH_FILE + std::to_string(depths[i]);
+            out.open(name + ".csv");
+            if (!out)
+            {
+                std::cerr << "unable to open \"" << name << ".csv\"\n";
+                exit(1);
+            }
+            saveSamples(&args, out, name + ".bin");
+            out.close();
+        }
+        std::cout << "Depth\tRequests/s\tp50 (usec)\tp99 (usec)\n";
+        for (i = 0; i < depths.size(); i++)
+        {
+            std::cout << depths[i] << "\t" << throughput[i] << "\t\t"
+                      << p50[i] / 1000.0 << "\t\t" << p99[i] / 1000.0 << "\n";
+        }
+    }
+
+    // written once everyone is done, so writing can't slow down the run
+    if (depths.size() == 1)
+    {
+        saveSamples(&args, out, SAMPLE_FILE);
+        out.close();
+    }
+    delete args.tls;
+    return 0;
 }
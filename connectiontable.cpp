@@ -0,0 +1,137 @@
+#include "connectiontable.hpp"
+#include <arpa/inet.h>
+#include <new>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+namespace dm {
+
+/** Never reserve more entries than this, even with an unlimited fd limit. */
+#define MAX_TABLE_ENTRIES   (1 << 24)
+
+static_assert(sizeof(ConnectionEntry) == CACHE_LINE_SIZE,
+        "ConnectionEntry should fill exactly one cache line");
+
+
+ConnectionTable::ConnectionTable()
+    : entries_(NULL), capacity_(0), used_(0), count_(0), highWater_(0)
+{
+    struct rlimit rlim;
+
+    capacity_ = MAX_TABLE_ENTRIES;
+    if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur != RLIM_INFINITY
+        && rlim.rlim_cur < MAX_TABLE_ENTRIES)
+    {
+        capacity_ = rlim.rlim_cur;
+    }
+
+    // anonymous pages are zero filled and only committed once touched
+    void* mem = mmap(NULL, capacity_ * sizeof(ConnectionEntry),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON
+#ifdef MAP_NORESERVE
+            | MAP_NORESERVE
+#endif
+            , -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+    entries_ = (ConnectionEntry*) mem;
+}
+
+
+ConnectionTable::~ConnectionTable()
+{
+    munmap(entries_, capacity_ * sizeof(ConnectionEntry));
+}
+
+
+ConnectionEntry*
+ConnectionTable::open(int fd, const struct sockaddr_in* addr)
+{
+    ConnectionEntry* entry = get(fd);
+
+    if (!entry)
+    {
+        return NULL;
+    }
+    entry->addr = *addr;
+    entry->dataSent = 0;
+    entry->requestsRecv = 0;
+    entry->generation++;
+    entry->bev = NULL;
+    entry->ssl = NULL;
+    entry->requestStart = 0;
+    entry->inUse = 1;
+    entry->inFlight = 0;
+    entry->throttled = 0;
+    entry->paused = 0;
+    entry->jobs = 0;
+
+    if ((size_t) fd >= used_)
+    {
+        used_ = fd + 1;
+    }
+    if (++count_ > highWater_)
+    {
+        highWater_ = count_;
+    }
+    return entry;
+}
+
+
+void
+ConnectionTable::close(int fd)
+{
+    ConnectionEntry* entry = get(fd);
+
+    if (entry && entry->inUse)
+    {
+        entry->inUse = 0;
+        entry->bev = NULL;
+        count_--;
+    }
+}
+
+
+size_t
+ConnectionTable::committedBytes()
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t bytes = used_ * sizeof(ConnectionEntry);
+
+    return (bytes + page - 1) / page * page;
+}
+
+
+void
+ConnectionTable::printConnections(std::ostream& out)
+{
+    char host[INET_ADDRSTRLEN];
+    size_t fd = 0;
+
+    for (fd = 0; fd < used_; fd++)
+    {
+        ConnectionEntry* c = &entries_[fd];
+
+        if (!c->inUse)
+        {
+            continue;
+        }
+        if (c->addr.sin_family == AF_INET)
+        {
+            inet_ntop(AF_INET, &c->addr.sin_addr, host, sizeof(host));
+            out << "\tHost name:\t\t" << host << "\n"
+                << "\tPort:\t\t\t" << ntohs(c->addr.sin_port) << "\n";
+        }
+        else
+        {
+            out << "\tHost name:\t\t(unix socket)\n";
+        }
+        out << "\tRequests received:\t" << c->requestsRecv << "\n"
+            << "\tData sent:\t\t" << c->dataSent << "\n\n";
+    }
+}
+
+} // namespace dm
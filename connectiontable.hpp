@@ -0,0 +1,154 @@
+#ifndef DM_CONNECTIONTABLE_HPP
+#define DM_CONNECTIONTABLE_HPP
+#include <atomic>
+#include <netinet/in.h>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+struct bufferevent;
+struct ssl_st;
+namespace dm {
+
+/** The size of a cache line on the machines we run on. */
+#define CACHE_LINE_SIZE     64
+
+/**
+ * Everything the server keeps for one connection. Exactly one cache line, so
+ * two connections being served by different threads never share one.
+ */
+struct alignas(CACHE_LINE_SIZE) ConnectionEntry
+{
+    /** The client's address. Formatted as text only when reporting. Only
+     * sin_family is set for unix domain connections. */
+    struct sockaddr_in addr;
+    /** Bytes sent to the client. */
+    uint64_t dataSent;
+    /** Requests received from the client. */
+    uint32_t requestsRecv;
+    /** Bumped every time the fd is reused, so work queued for an earlier
+     * connection on the same fd can be recognized as stale. */
+    uint32_t generation;
+    /** The connection's bufferevent, if the server is using libevent. */
+    struct bufferevent* bev;
+    /** The connection's TLS session, if TLS is on. */
+    struct ssl_st* ssl;
+    /** When the loop picked up the oldest request no worker has taken yet
+     * (monotonicNs()), or 0 if there isn't one. Set by the loop, taken by
+     * the worker that answers the request (pool mode). */
+    std::atomic<uint64_t> requestStart;
+    /** Non-zero while the fd belongs to a client. */
+    uint8_t inUse;
+    /** Responses being built by workers (handoff mode). More than one only
+     * for requests flagged PROTO_UNORDERED. */
+    uint8_t inFlight;
+    /** Non-zero while the connection waits out a rate limit, so only one
+     * endThrottle() is ever pending for it. */
+    std::atomic<uint8_t> throttled;
+    /** Non-zero while the connection is in the list of those paused by the
+     * overload policy. Only touched by the event loop. */
+    uint8_t paused;
+    /** Jobs queued or running for the connection (pool mode). Added by the
+     * loop, taken away by the worker that ran the job. */
+    std::atomic<uint32_t> jobs;
+};
+
+/**
+ * The connections the server is tracking, in a flat array indexed by fd. The
+ * array is reserved for every fd the process may open, but the memory is only
+ * committed as fds are used, so an idle server with a huge fd limit costs
+ * nothing. Entries never move, so pointers to them stay valid.
+ *
+ * Not synchronized; the caller provides any locking it needs.
+ */
+class ConnectionTable
+{
+private:
+    /** One entry per possible fd. */
+    ConnectionEntry* entries_;
+    /** Number of entries reserved. */
+    size_t capacity_;
+    /** Highest fd that has ever been opened, plus one. */
+    size_t used_;
+    /** Number of entries in use. */
+    size_t count_;
+    /** The highest count_ has been. */
+    size_t highWater_;
+
+public:
+    /**
+     * Reserves an entry for every fd allowed by RLIMIT_NOFILE.
+     *
+     * @throws bad_alloc the table could not be reserved.
+     */
+    ConnectionTable();
+    ~ConnectionTable();
+
+    ConnectionTable(const ConnectionTable&) = delete;
+    ConnectionTable& operator=(const ConnectionTable&) = delete;
+
+    /**
+     * Start tracking a new connection.
+     *
+     * @param fd The connection's socket.
+     * @param addr The client's address.
+     * @return The connection's entry, or NULL if fd is too large for the table.
+     */
+    ConnectionEntry* open(int fd, const struct sockaddr_in* addr);
+
+    /**
+     * Stop tracking a connection.
+     *
+     * @param fd The socket that is being closed.
+     */
+    void close(int fd);
+
+    /**
+     * @param fd A socket.
+     * @return The entry for fd (which may not be in use), or NULL if fd is
+     *      out of range.
+     */
+    ConnectionEntry* get(int fd)
+    {
+        return (fd >= 0 && (size_t) fd < capacity_) ? &entries_[fd] : NULL;
+    }
+
+    /**
+     * @return One more than the highest fd ever opened; every entry in use is
+     *      below this.
+     */
+    size_t end()
+    {
+        return used_;
+    }
+
+    /**
+     * @return The number of connections being tracked.
+     */
+    size_t count()
+    {
+        return count_;
+    }
+
+    /**
+     * @return The most connections that have been tracked at once.
+     */
+    size_t highWater()
+    {
+        return highWater_;
+    }
+
+    /**
+     * @return The number of bytes of table that are actually committed.
+     */
+    size_t committedBytes();
+
+    /**
+     * Write one line per connection in use.
+     *
+     * @param out Where to write the report.
+     */
+    void printConnections(std::ostream& out);
+};
+
+} // namespace dm
+#endif
@@ -0,0 +1,223 @@
+#include "connpool.hpp"
+#include "allocator.hpp"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <iostream>
+#include <stdlib.h>
+namespace dm {
+
+
+/**
+ * @return The percentage of hits, or 0 if there haven't been any requests.
+ */
+static double hitRate(unsigned long hits, unsigned long misses)
+{
+    return (hits + misses) ? 100.0 * hits / (hits + misses) : 0;
+}
+
+
+/**
+ * Allocate a payload buffer, stopping the program if there's no memory left,
+ * as the new[] the buffers replaced would have.
+ *
+ * @param size The number of bytes needed.
+ * @return The buffer.
+ */
+static void* allocPayload(size_t size)
+{
+    void* block = memAlloc(size, MEM_PAYLOAD);
+
+    if (!block)
+    {
+        std::cerr << "Error: out of memory for a " << size 
+                  << " byte buffer\n";
+        abort();
+    }
+    return block;
+}
+
+
+BuffereventPool::BuffereventPool(size_t max)
+    : max_(max), hits_(0), misses_(0), discards_(0)
+{
+    free_.reserve(max);
+}
+
+
+BuffereventPool::~BuffereventPool()
+{
+    size_t i = 0;
+
+    for (i = 0; i < free_.size(); i++)
+    {
+        bufferevent_free(free_[i]);
+    }
+}
+
+
+struct bufferevent*
+BuffereventPool::get(struct event_base* base, evutil_socket_t fd, int options)
+{
+    struct bufferevent* bev = NULL;
+
+    if (free_.empty())
+    {
+        misses_++;
+        return bufferevent_socket_new(base, fd, options);
+    }
+    hits_++;
+    bev = free_.back();
+    free_.pop_back();
+    bufferevent_setfd(bev, fd);
+    return bev;
+}
+
+
+void
+BuffereventPool::put(struct bufferevent* bev)
+{
+    evutil_socket_t fd = bufferevent_getfd(bev);
+
+    if (free_.size() >= max_)
+    {
+        discards_++;
+        bufferevent_free(bev);
+        return;
+    }
+
+    bufferevent_disable(bev, EV_READ | EV_WRITE);
+    bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+    bufferevent_setfd(bev, -1);
+    evutil_closesocket(fd);
+
+    // anything left over belongs to the old connection
+    struct evbuffer* input = bufferevent_get_input(bev);
+    struct evbuffer* output = bufferevent_get_output(bev);
+    evbuffer_drain(input, evbuffer_get_length(input));
+    evbuffer_drain(output, evbuffer_get_length(output));
+
+    free_.push_back(bev);
+}
+
+
+void
+BuffereventPool::printStats(std::ostream& out)
+{
+    out << "Bufferevent pool:\n"
+        << "\tHits / misses:\t\t" << hits_ << " / " << misses_ << " ("
+        << hitRate(hits_, misses_) << "% hit rate)\n"
+        << "\tDiscarded:\t\t" << discards_ << "\n"
+        << "\tIdle:\t\t\t" << free_.size() << " / " << max_ << "\n\n";
+}
+
+
+BufferPool::BufferPool(size_t maxBytes)
+    : maxBytes_(maxBytes), retainedBytes_(0), hits_(0), misses_(0),
+      discards_(0)
+{
+    int i = 0;
+
+    for (i = 0; i < BUFFER_POOL_CLASSES; i++)
+    {
+        free_[i] = NULL;
+        pthread_mutex_init(&locks_[i], NULL);
+    }
+}
+
+
+BufferPool::~BufferPool()
+{
+    int i = 0;
+
+    for (i = 0; i < BUFFER_POOL_CLASSES; i++)
+    {
+        while (free_[i])
+        {
+            Block* block = free_[i];
+            free_[i] = block->next;
+            memFree(block);
+        }
+        pthread_mutex_destroy(&locks_[i]);
+    }
+}
+
+
+void*
+BufferPool::get(size_t size, size_t* capacity)
+{
+    int c = 0;
+    size_t classSize = (size_t) 1 << BUFFER_POOL_MIN_SHIFT;
+    Block* block = NULL;
+
+    while (classSize - ALLOC_HEADER_SIZE < size && c < BUFFER_POOL_CLASSES)
+    {
+        classSize <<= 1;
+        c++;
+    }
+    if (c == BUFFER_POOL_CLASSES)
+    {
+        // too big to pool
+        misses_++;
+        *capacity = size;
+        return allocPayload(size);
+    }
+
+    pthread_mutex_lock(&locks_[c]);
+    if ((block = free_[c]))
+    {
+        free_[c] = block->next;
+    }
+    pthread_mutex_unlock(&locks_[c]);
+
+    *capacity = classSize - ALLOC_HEADER_SIZE;
+    if (block)
+    {
+        hits_++;
+        retainedBytes_ -= *capacity;
+        return block;
+    }
+    misses_++;
+    return allocPayload(*capacity);
+}
+
+
+void
+BufferPool::put(void* block, size_t capacity)
+{
+    int c = 0;
+    size_t classSize = (size_t) 1 << BUFFER_POOL_MIN_SHIFT;
+
+    while (classSize - ALLOC_HEADER_SIZE < capacity && c < BUFFER_POOL_CLASSES)
+    {
+        classSize <<= 1;
+        c++;
+    }
+    if (c == BUFFER_POOL_CLASSES || classSize - ALLOC_HEADER_SIZE != capacity
+        || retainedBytes_ + capacity > maxBytes_)
+    {
+        discards_++;
+        memFree(block);
+        return;
+    }
+    retainedBytes_ += capacity;
+
+    pthread_mutex_lock(&locks_[c]);
+    ((Block*) block)->next = free_[c];
+    free_[c] = (Block*) block;
+    pthread_mutex_unlock(&locks_[c]);
+}
+
+
+void
+BufferPool::printStats(std::ostream& out)
+{
+    out << "Buffer pool:\n"
+        << "\tHits / misses:\t\t" << hits_ << " / " << misses_ << " ("
+        << hitRate(hits_, misses_) << "% hit rate)\n"
+        << "\tDiscarded:\t\t" << discards_ << "\n"
+        << "\tIdle bytes:\t\t" << retainedBytes_ << " / " << maxBytes_
+        << "\n\n";
+}
+
+} // namespace dm
@@ -0,0 +1,132 @@
+#ifndef DM_CONNPOOL_HPP
+#define DM_CONNPOOL_HPP
+#include <atomic>
+#include <event2/util.h>
+#include <ostream>
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+struct bufferevent;
+struct event_base;
+namespace dm {
+
+/** Smallest block the BufferPool hands out, counting the allocator's
+ * header. */
+#define BUFFER_POOL_MIN_SHIFT   8
+/** Number of block sizes; the largest is 2^(BUFFER_POOL_MIN_SHIFT +
+ * BUFFER_POOL_CLASSES - 1) bytes (1 MiB), counting the header. */
+#define BUFFER_POOL_CLASSES     13
+
+/**
+ * Recycles socket bufferevents (and the evbuffers they own) across
+ * connections, so a connect-request-close cycle doesn't have to allocate and
+ * tear down a bufferevent every time. Only the event loop thread may use it.
+ */
+class BuffereventPool
+{
+private:
+    /** Bufferevents with no fd, ready to be reused. */
+    std::vector<struct bufferevent*> free_;
+    /** The most bufferevents to keep. */
+    size_t max_;
+    unsigned long hits_;
+    unsigned long misses_;
+    unsigned long discards_;
+
+public:
+    /**
+     * @param max The most idle bufferevents to keep. 0 disables pooling.
+     */
+    explicit BuffereventPool(size_t max);
+    ~BuffereventPool();
+
+    BuffereventPool(const BuffereventPool&) = delete;
+    BuffereventPool& operator=(const BuffereventPool&) = delete;
+
+    /**
+     * Get a bufferevent for a new connection, reusing an idle one if there is
+     * one. Every bufferevent from a pool must be created with the same base
+     * and options.
+     *
+     * @param base The event base to create a new bufferevent on.
+     * @param fd The new connection's socket.
+     * @param options The BEV_OPT_ flags for a new bufferevent.
+     * @return The bufferevent, with no callbacks and nothing enabled.
+     */
+    struct bufferevent* get(struct event_base* base, evutil_socket_t fd,
+            int options);
+
+    /**
+     * Close a connection's socket and keep its bufferevent for reuse, or
+     * free it if the pool is full.
+     *
+     * @param bev The bufferevent of a connection that is done.
+     */
+    void put(struct bufferevent* bev);
+
+    /**
+     * @param out Where to write the hit rate and number of bufferevents kept.
+     */
+    void printStats(std::ostream& out);
+};
+
+/**
+ * Recycles payload buffers in power of two sizes, from 256 bytes to 1 MiB.
+ * Anything bigger isn't kept. Blocks come from memAlloc(), charged to
+ * MEM_PAYLOAD, and are ALLOC_HEADER_SIZE bytes short of the power of two so
+ * that each fills one of its size classes exactly. Safe to use from any
+ * thread; each size has its own lock.
+ */
+class BufferPool
+{
+private:
+    struct Block
+    {
+        Block* next;
+    };
+
+    /** Idle blocks of each size. */
+    Block* free_[BUFFER_POOL_CLASSES];
+    /** One lock per size. */
+    pthread_mutex_t locks_[BUFFER_POOL_CLASSES];
+    /** The most bytes to keep in idle blocks. */
+    size_t maxBytes_;
+    /** Bytes currently kept in idle blocks. */
+    std::atomic<size_t> retainedBytes_;
+    std::atomic<unsigned long> hits_;
+    std::atomic<unsigned long> misses_;
+    std::atomic<unsigned long> discards_;
+
+public:
+    /**
+     * @param maxBytes The most bytes to keep in idle blocks. 0 disables
+     *      pooling.
+     */
+    explicit BufferPool(size_t maxBytes);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /**
+     * @param size The number of bytes needed.
+     * @param capacity Set to the real size of the block, which must be passed
+     *      back to put().
+     * @return The block. Never NULL: the program stops if memory runs out.
+     */
+    void* get(size_t size, size_t* capacity);
+
+    /**
+     * @param block A block from get().
+     * @param capacity The capacity get() returned with it.
+     */
+    void put(void* block, size_t capacity);
+
+    /**
+     * @param out Where to write the hit rate and number of bytes kept.
+     */
+    void printStats(std::ostream& out);
+};
+
+} // namespace dm
+#endif
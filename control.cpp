@@ -0,0 +1,233 @@
+#include "control.hpp"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+namespace dm {
+
+/**
+ * Fill in a unix domain socket address.
+ *
+ * @return False if path is too long for one.
+ */
+static bool controlAddress(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+
+int listenControl(const char* path, int backlog)
+{
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if (!controlAddress(path, &addr)
+            || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))
+            || listen(fd, backlog))
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+
+int connectControl(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if (!controlAddress(path, &addr)
+            || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)))
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+
+/**
+ * Send all len bytes of buf, however many calls it takes.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+static int sendAll(int fd, const char* buf, size_t len)
+{
+    ssize_t rtn = 0;
+
+    while (len)
+    {
+        if ((rtn = send(fd, buf, len, MSG_NOSIGNAL)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += rtn;
+        len -= rtn;
+    }
+    return 0;
+}
+
+
+/**
+ * Read exactly len bytes into buf.
+ *
+ * @return 0 on success, or -1 on error or if the socket closed first (errno
+ *      is 0).
+ */
+static int recvAll(int fd, char* buf, size_t len)
+{
+    ssize_t rtn = 0;
+
+    while (len)
+    {
+        if ((rtn = recv(fd, buf, len, 0)) <= 0)
+        {
+            if (rtn == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (!rtn)
+            {
+                errno = 0;
+            }
+            return -1;
+        }
+        buf += rtn;
+        len -= rtn;
+    }
+    return 0;
+}
+
+
+int sendControl(int fd, ControlType type, const std::string& body)
+{
+    uint32_t header[2] = { (uint32_t) type, (uint32_t) body.size() };
+
+    if (sendAll(fd, (const char*) header, sizeof(header)))
+    {
+        return -1;
+    }
+    return sendAll(fd, body.data(), body.size());
+}
+
+
+int recvControl(int fd, ControlType type, std::string* body)
+{
+    uint32_t header[2];
+
+    if (recvAll(fd, (char*) header, sizeof(header)))
+    {
+        return -1;
+    }
+    if (header[0] != (uint32_t) type)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    body->resize(header[1]);
+    return header[1] ? recvAll(fd, &(*body)[0], header[1]) : 0;
+}
+
+
+void packHistogram(std::string* body, const LatencyHistogram& histogram)
+{
+    uint64_t saved[HIST_SAVED];
+
+    histogram.save(saved);
+    body->append((const char*) saved, sizeof(saved));
+}
+
+
+bool unpackHistogram(const std::string& body, size_t* at,
+        LatencyHistogram* histogram)
+{
+    uint64_t saved[HIST_SAVED];
+
+    if (body.size() - *at < sizeof(saved))
+    {
+        return false;
+    }
+    body.copy((char*) saved, sizeof(saved), *at);
+    *at += sizeof(saved);
+    histogram->merge(saved);
+    return true;
+}
+
+
+void packWindows(std::string* body, const LatencyWindows& windows)
+{
+    uint64_t saved[HIST_SAVED];
+    uint64_t count = windows.size();
+    uint64_t i = 0;
+
+    pack(body, windows.measured());
+    pack(body, count);
+    for (i = 0; i < count; i++)
+    {
+        if (windows.window(i))
+        {
+            windows.window(i)->save(saved);
+        }
+        else
+        {
+            memset(saved, 0, sizeof(saved));
+        }
+        body->append((const char*) saved, sizeof(saved));
+    }
+}
+
+
+bool unpackWindows(const std::string& body, size_t* at,
+        LatencyWindows* windows)
+{
+    uint64_t saved[HIST_SAVED];
+    uint64_t measured = 0;
+    uint64_t count = 0;
+    uint64_t i = 0;
+
+    if (!unpack(body, at, &measured) || !unpack(body, at, &count))
+    {
+        return false;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (body.size() - *at < sizeof(saved))
+        {
+            return false;
+        }
+        body.copy((char*) saved, sizeof(saved), *at);
+        *at += sizeof(saved);
+        windows->merge(i, saved);
+    }
+    windows->extend(measured);
+    return true;
+}
+
+} // namespace dm
@@ -0,0 +1,134 @@
+#ifndef DM_CONTROL_HPP
+#define DM_CONTROL_HPP
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "histogram.hpp"
+namespace dm {
+
+/**
+ * What a message between a coordinating client and one of its worker
+ * processes says. A worker sends READY once it is set up, waits for GO, runs,
+ * then sends RESULTS.
+ */
+enum ControlType
+{
+    CONTROL_READY = 1,
+    CONTROL_GO,
+    CONTROL_RESULTS
+};
+
+/**
+ * Listen for workers on a unix domain socket, replacing any socket file
+ * already at path.
+ *
+ * @param path Where to create the socket.
+ * @param backlog How many workers may be waiting to be accepted.
+ * @return The listening socket, or -1 on error (errno is set).
+ */
+int listenControl(const char* path, int backlog);
+
+/**
+ * Connect to a coordinator listening with listenControl().
+ *
+ * @param path The coordinator's socket.
+ * @return The connected socket, or -1 on error (errno is set).
+ */
+int connectControl(const char* path);
+
+/**
+ * Send a message: its type and the length of its body as uint32_ts, then the
+ * body.
+ *
+ * @param fd The control socket.
+ * @param type What the message is.
+ * @param body Its contents, in this machine's byte order.
+ * @return 0 on success, or -1 on error (errno is set).
+ */
+int sendControl(int fd, ControlType type, const std::string& body);
+
+/**
+ * Wait for a message from sendControl().
+ *
+ * @param fd The control socket.
+ * @param type The kind of message expected.
+ * @param body Set to its contents.
+ * @return 0 on success, or -1 if the socket failed (errno is set), closed
+ *      (errno is 0) or sent some other message (errno is EPROTO).
+ */
+int recvControl(int fd, ControlType type, std::string* body);
+
+/**
+ * Add a value to a message body.
+ *
+ * @param body The body to add to.
+ * @param value The value, copied as is.
+ */
+template <typename T>
+void pack(std::string* body, const T& value)
+{
+    body->append((const char*) &value, sizeof(value));
+}
+
+/**
+ * Take the next value out of a message body.
+ *
+ * @param body The body.
+ * @param at Where the value starts; moved past it.
+ * @param value Set to the value.
+ * @return False if the body is too short.
+ */
+template <typename T>
+bool unpack(const std::string& body, size_t* at, T* value)
+{
+    if (body.size() - *at < sizeof(*value))
+    {
+        return false;
+    }
+    body.copy((char*) value, sizeof(*value), *at);
+    *at += sizeof(*value);
+    return true;
+}
+
+/**
+ * Add everything a histogram has recorded to a message body.
+ *
+ * @param body The body to add to.
+ * @param histogram The histogram.
+ */
+void packHistogram(std::string* body, const LatencyHistogram& histogram);
+
+/**
+ * Take a histogram packed by packHistogram() out of a message body and merge
+ * it into another.
+ *
+ * @param body The body.
+ * @param at Where the histogram starts; moved past it.
+ * @param histogram The histogram to merge it into.
+ * @return False if the body is too short.
+ */
+bool unpackHistogram(const std::string& body, size_t* at,
+        LatencyHistogram* histogram);
+
+/**
+ * Add every window a LatencyWindows has recorded to a message body.
+ *
+ * @param body The body to add to.
+ * @param windows The windows.
+ */
+void packWindows(std::string* body, const LatencyWindows& windows);
+
+/**
+ * Take windows packed by packWindows() out of a message body and merge each
+ * into the same window of another LatencyWindows.
+ *
+ * @param body The body.
+ * @param at Where the windows start; moved past them.
+ * @param windows The windows to merge them into.
+ * @return False if the body is too short.
+ */
+bool unpackWindows(const std::string& body, size_t* at,
+        LatencyWindows* windows);
+
+} // namespace dm
+#endif
@@ -0,0 +1,242 @@
+#include "epolldriver.hpp"
+#include <atomic>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "histogram.hpp"
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+namespace dm {
+
+#define NS_PER_MS   1000000
+#define NS_PER_SEC  1000000000
+
+
+#ifdef __linux__
+
+/**
+ * epoll_wait() with a timeout in nanoseconds (epoll_pwait2()), so that short
+ * sleeps aren't rounded up to a whole millisecond. Falls back to milliseconds
+ * if the C library or the kernel (before 5.11) doesn't have it.
+ *
+ * @param ns The timeout, or -1 to wait for as long as it takes.
+ */
+static int waitNs(int epfd, struct epoll_event* events, int max, int64_t ns)
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    static std::atomic<bool> missing(false);
+
+    if (!missing.load(std::memory_order_relaxed))
+    {
+        struct timespec ts;
+        int n = 0;
+
+        ts.tv_sec = ns / NS_PER_SEC;
+        ts.tv_nsec = ns % NS_PER_SEC;
+        if ((n = epoll_pwait2(epfd, events, max, ns < 0 ? NULL : &ts, NULL))
+                != -1 || errno != ENOSYS)
+        {
+            return n;
+        }
+        missing.store(true, std::memory_order_relaxed);
+    }
+#endif
+    return epoll_wait(epfd, events, max, 
+                      ns < 0 ? -1 : (int) ((ns + NS_PER_MS - 1) / NS_PER_MS));
+}
+
+
+EpollDriver::EpollDriver()
+    : epfd_(epoll_create1(EPOLL_CLOEXEC)), wakeups_(0), resumes_(0),
+      stopped_(false)
+{
+    if (epfd_ == -1)
+    {
+        throw std::exception();
+    }
+}
+
+
+EpollDriver::~EpollDriver()
+{
+    close(epfd_);
+}
+
+
+int
+EpollDriver::watch(int fd, bool exclusive)
+{
+    struct epoll_event ev;
+
+    ev.events = exclusive ? EPOLLIN | EPOLLEXCLUSIVE
+                          : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+
+    if ((size_t) fd >= waiters_.size())
+    {
+        waiters_.resize(fd + 1);
+    }
+    return epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+void
+EpollDriver::forget(int fd)
+{
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL);
+    // events for fd already taken from the kernel will find nobody waiting
+    waiters_[fd] = Waiters();
+}
+
+
+void
+EpollDriver::park(int fd, bool write, std::coroutine_handle<> handle)
+{
+    if (write)
+    {
+        waiters_[fd].writer = handle;
+    }
+    else
+    {
+        waiters_[fd].reader = handle;
+    }
+}
+
+
+void
+EpollDriver::resume(std::coroutine_handle<>& slot)
+{
+    std::coroutine_handle<> handle = slot;
+
+    if (handle)
+    {
+        slot = std::coroutine_handle<>();
+        resumes_++;
+        handle.resume();
+    }
+}
+
+
+EpollDriver::SleepAwaiter
+EpollDriver::sleep(uint64_t ns)
+{
+    return SleepAwaiter{this, monotonicNs() + ns};
+}
+
+
+void
+EpollDriver::run()
+{
+    struct epoll_event events[DRIVER_EVENTS];
+    int64_t timeout = -1;
+    int n = 0;
+    int i = 0;
+
+    while (!stopped_)
+    {
+        timeout = -1;
+        if (!timers_.empty())
+        {
+            uint64_t now = monotonicNs();
+            uint64_t at = timers_.top().at;
+            timeout = at > now ? at - now : 0;
+        }
+
+        if ((n = waitNs(epfd_, events, DRIVER_EVENTS, timeout)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::exception();
+        }
+        wakeups_++;
+
+        for (i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            uint32_t what = events[i].events;
+
+            // an error or hangup wakes whoever is waiting, to find out
+            if (what & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                resume(waiters_[fd].reader);
+            }
+            if (what & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            {
+                resume(waiters_[fd].writer);
+            }
+        }
+
+        if (!timers_.empty())
+        {
+            uint64_t now = monotonicNs();
+            while (!timers_.empty() && timers_.top().at <= now)
+            {
+                std::coroutine_handle<> handle = timers_.top().handle;
+                timers_.pop();
+                resumes_++;
+                handle.resume();
+            }
+        }
+    }
+}
+
+#else
+
+EpollDriver::EpollDriver()
+    : epfd_(-1), wakeups_(0), resumes_(0),
+      stopped_(false)
+{
+    errno = ENOSYS;
+    throw std::exception();
+}
+
+
+EpollDriver::~EpollDriver()
+{
+}
+
+
+int
+EpollDriver::watch(int, bool)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+void
+EpollDriver::forget(int)
+{
+}
+
+
+void
+EpollDriver::park(int, bool, std::coroutine_handle<>)
+{
+}
+
+
+void
+EpollDriver::resume(std::coroutine_handle<>&)
+{
+}
+
+
+EpollDriver::SleepAwaiter
+EpollDriver::sleep(uint64_t ns)
+{
+    return SleepAwaiter{this, ns};
+}
+
+
+void
+EpollDriver::run()
+{
+}
+
+#endif
+
+} // namespace dm
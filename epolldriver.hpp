@@ -0,0 +1,229 @@
+#ifndef DM_EPOLLDRIVER_HPP
+#define DM_EPOLLDRIVER_HPP
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <ostream>
+#include <queue>
+#include <stdint.h>
+#include <vector>
+namespace dm {
+
+/** The most events taken from the kernel per epoll_wait(). */
+#define DRIVER_EVENTS   256
+
+/**
+ * The return type of a coroutine that nobody waits for. It starts running as
+ * soon as it's called and frees itself when it finishes.
+ */
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object()
+        {
+            return Task();
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+        void return_void()
+        {
+        }
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+/**
+ * An epoll loop that resumes coroutines when their sockets are ready or their
+ * sleep is over. Sockets are watched edge-triggered, so a coroutine must only
+ * wait after a read or write on the socket has failed with EAGAIN. Wakeups
+ * may be spurious; the coroutine just tries again.
+ *
+ * Each driver belongs to the thread that calls run(), and the coroutines it
+ * resumes run on that thread. Linux only.
+ */
+class EpollDriver
+{
+private:
+    /** The coroutines waiting on one socket. */
+    struct Waiters
+    {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+    };
+
+    struct Timer
+    {
+        /** When to wake up (monotonicNs()). */
+        uint64_t at;
+        std::coroutine_handle<> handle;
+
+        bool operator>(const Timer& other) const
+        {
+            return at > other.at;
+        }
+    };
+
+    int epfd_;
+    /** Indexed by fd. */
+    std::vector<Waiters> waiters_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> >
+            timers_;
+    /** Returns from epoll_wait(), and coroutines resumed. Only touched by the
+     * driver's thread. */
+    unsigned long wakeups_;
+    unsigned long resumes_;
+    /** Set by stop(). */
+    bool stopped_;
+
+    /**
+     * Remember that handle is waiting on fd.
+     */
+    void park(int fd, bool write, std::coroutine_handle<> handle);
+
+    /**
+     * Resume the coroutine in slot, if there is one, emptying the slot first.
+     */
+    void resume(std::coroutine_handle<>& slot);
+
+public:
+    /**
+     * Waits until a socket is ready. Returned by readable() and writable().
+     */
+    struct IoAwaiter
+    {
+        EpollDriver* driver;
+        int fd;
+        bool write;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            driver->park(fd, write, handle);
+        }
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    /**
+     * Waits until some time has passed. Returned by sleep().
+     */
+    struct SleepAwaiter
+    {
+        EpollDriver* driver;
+        uint64_t at;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            driver->timers_.push(Timer{at, handle});
+        }
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    /**
+     * @throws exception The epoll instance couldn't be created (errno is set).
+     */
+    EpollDriver();
+    ~EpollDriver();
+
+    EpollDriver(const EpollDriver&) = delete;
+    EpollDriver& operator=(const EpollDriver&) = delete;
+
+    /**
+     * Start watching a non-blocking socket. A socket shared by several
+     * drivers, such as a listening socket, should be exclusive, so that only
+     * one driver is woken per connection.
+     *
+     * @param fd The socket.
+     * @param exclusive True to watch for reads only, level-triggered, with
+     *      EPOLLEXCLUSIVE.
+     * @return 0 on success, or -1 on error (errno is set).
+     */
+    int watch(int fd, bool exclusive = false);
+
+    /**
+     * Stop watching a socket. Call before closing it.
+     *
+     * @param fd The socket.
+     */
+    void forget(int fd);
+
+    /**
+     * @param fd A watched socket.
+     * @return Something to co_await until fd may have something to read.
+     */
+    IoAwaiter readable(int fd)
+    {
+        return IoAwaiter{this, fd, false};
+    }
+
+    /**
+     * @param fd A watched socket.
+     * @return Something to co_await until fd may have room to write.
+     */
+    IoAwaiter writable(int fd)
+    {
+        return IoAwaiter{this, fd, true};
+    }
+
+    /**
+     * @param ns How long to sleep, in nanoseconds. Kernels before 5.11 only
+     *      wake the loop in whole milliseconds, so short sleeps are rounded
+     *      up there.
+     * @return Something to co_await until the time has passed.
+     */
+    SleepAwaiter sleep(uint64_t ns);
+
+    /**
+     * Resume coroutines as their sockets become ready, until stop() is called.
+     */
+    void run();
+
+    /**
+     * Make run() return once it has handled the events it woke up for. Only
+     * called from the driver's own thread, usually by the last coroutine to
+     * finish.
+     */
+    void stop()
+    {
+        stopped_ = true;
+    }
+
+    /**
+     * @return The number of times the loop has woken up.
+     */
+    unsigned long wakeups() const
+    {
+        return wakeups_;
+    }
+
+    /**
+     * @return The number of coroutines the loop has resumed.
+     */
+    unsigned long resumes() const
+    {
+        return resumes_;
+    }
+};
+
+} // namespace dm
+#endif
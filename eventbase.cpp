@@ -1,26 +1,73 @@
 #include "eventbase.hpp"
+#include "allocator.hpp"
 #include <event2/thread.h>
 #include <string.h>
 #include "badbaseexception.hpp"
 namespace dm {
 
 
-EventBase::EventBase(const char* method)
+EventBase::EventBase(const char* method, const EventBaseOptions& options)
+    : options_(options)
 {
+    // has to happen before libevent allocates anything
+    if (options.sizeClassAllocator)
+    {
+        memInstallLibevent();
+    }
+
     // enable locking for libevent structure
-    if (evthread_use_pthreads())
+    if (options.threadSafe && evthread_use_pthreads())
     {
         throw std::exception();
     }
 
 #ifdef DEBUG
-    evthread_enable_lock_debuging();
+    if (options.threadSafe)
+    {
+        evthread_enable_lock_debuging();
+    }
     event_enable_debug_mode();
 #endif
 
     struct event_config *config;
     config = event_config_new();
 
+    if (!options.threadSafe)
+    {
+        event_config_set_flag(config, EVENT_BASE_FLAG_NOLOCK);
+    }
+    if (options.noCacheTime)
+    {
+        event_config_set_flag(config, EVENT_BASE_FLAG_NO_CACHE_TIME);
+    }
+    if (options.epollChangelist)
+    {
+        event_config_set_flag(config, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+    }
+    if (options.maxDispatchMsec >= 0 || options.maxDispatchCallbacks >= 0)
+    {
+        struct timeval tv;
+        tv.tv_sec = options.maxDispatchMsec / 1000;
+        tv.tv_usec = (options.maxDispatchMsec % 1000) * 1000;
+        event_config_set_max_dispatch_interval(config, 
+                options.maxDispatchMsec >= 0 ? &tv : NULL,
+                options.maxDispatchCallbacks, options.minPriority);
+    }
+
+    int features = 0;
+    if (options.requireEdgeTriggered)
+    {
+        features |= EV_FEATURE_ET;
+    }
+    if (options.requireO1)
+    {
+        features |= EV_FEATURE_O1;
+    }
+    if (features)
+    {
+        event_config_require_features(config, features);
+    }
+
     int i = 0;
     const char** availMethods = event_get_supported_methods();
 
@@ -31,13 +78,18 @@ EventBase::EventBase(const char* method)
         }
     }
     base_ = event_base_new_with_config(config);
+    event_config_free(config);
 
     if (!base_)
     {
         throw BadBaseException();
     }
-    event_base_get_method(base_);
-    event_config_free(config);
+    if (options.priorities > 1 
+        && event_base_priority_init(base_, options.priorities))
+    {
+        event_base_free(base_);
+        throw BadBaseException();
+    }
 }
 
 
@@ -61,6 +113,52 @@ EventBase::getBase()
 }
 
 
+bool
+EventBase::isThreadSafe()
+{
+    return options_.threadSafe;
+}
+
+
+int
+EventBase::getPriorities()
+{
+    return event_base_get_npriorities(base_);
+}
+
+
+void
+EventBase::printConfig(std::ostream& out)
+{
+    int features = event_base_get_features(base_);
+
+    out << "Using: " << getMethod() << "\n"
+        << "\tFeatures:\t\t"
+        << ((features & EV_FEATURE_ET) ? "edge-triggered " : "")
+        << ((features & EV_FEATURE_O1) ? "O(1) " : "")
+        << ((features & EV_FEATURE_FDS) ? "any-fd " : "") << "\n"
+        << "\tThread safe:\t\t" << options_.threadSafe << "\n"
+        << "\tNo cache time:\t\t" << options_.noCacheTime << "\n"
+        << "\tEpoll changelist:\t" << options_.epollChangelist << "\n"
+        << "\tPriorities:\t\t" << getPriorities() << "\n"
+        << "\tSize-class allocator:\t" << options_.sizeClassAllocator << "\n";
+
+    if (options_.maxDispatchMsec >= 0 || options_.maxDispatchCallbacks >= 0)
+    {
+        out << "\tMax dispatch:\t\t";
+        if (options_.maxDispatchMsec >= 0)
+        {
+            out << options_.maxDispatchMsec << " ms ";
+        }
+        if (options_.maxDispatchCallbacks >= 0)
+        {
+            out << options_.maxDispatchCallbacks << " callbacks ";
+        }
+        out << "(priority " << options_.minPriority << " and up)\n";
+    }
+}
+
+
 const char**
 EventBase::getAvailableMethods()
 {
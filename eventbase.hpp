@@ -1,8 +1,53 @@
 #ifndef DM_EVENTBASE_HPP
 #define DM_EVENTBASE_HPP
 #include <event2/event.h>
+#include <ostream>
 namespace dm {
 
+/**
+ * Tuning knobs for an EventBase. The defaults give the same base libevent
+ * would create without any configuration (plus thread safety).
+ */
+struct EventBaseOptions
+{
+    /** False skips libevent's locking entirely, in which case only the thread
+     * running the loop may touch the base or anything created on it. */
+    bool threadSafe;
+    /** Check the clock on every callback instead of once per loop iteration
+     * (EVENT_BASE_FLAG_NO_CACHE_TIME). */
+    bool noCacheTime;
+    /** Batch epoll_ctl() changes until the next dispatch
+     * (EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST). */
+    bool epollChangelist;
+    /** Check for new events after running callbacks for this many
+     * milliseconds, or -1 for no limit. */
+    int maxDispatchMsec;
+    /** Check for new events after running this many callbacks, or -1 for no
+     * limit. */
+    int maxDispatchCallbacks;
+    /** The limits above only apply to callbacks with a priority number of at
+     * least this much. */
+    int minPriority;
+    /** Number of event priorities. 1 means all events are equal. */
+    int priorities;
+    /** Refuse any method that can't do edge-triggered events. */
+    bool requireEdgeTriggered;
+    /** Refuse any method where adding, deleting and activating an event isn't
+     * O(1). */
+    bool requireO1;
+    /** Route libevent's allocations through the size-class allocator (see
+     * allocator.hpp) so they are pooled and counted. */
+    bool sizeClassAllocator;
+
+    EventBaseOptions()
+        : threadSafe(true), noCacheTime(false), epollChangelist(false),
+          maxDispatchMsec(-1), maxDispatchCallbacks(-1), minPriority(0),
+          priorities(1), requireEdgeTriggered(false), requireO1(false),
+          sizeClassAllocator(false)
+    {
+    }
+};
+
 /**
  * Wrapper class for setting up an event base. Once constructed, pass the event
  * base to any libevent calls with eventbasename.getBase().
@@ -14,6 +59,8 @@ class EventBase
 private:
     /** The structure needed by many libevent calls. */
     struct event_base* base_;
+    /** How the base was configured. */
+    EventBaseOptions options_;
 
 public:
     /**
@@ -21,10 +68,13 @@ public:
      *
      * @author Dean Morin
      * @param method The event method to use (select, epoll, kqueue, etc.).
-     * @throws BadBaseException method is not available on this system.
+     * @param options Flags and limits to configure the base with.
+     * @throws BadBaseException method is not available on this system, or
+     *      doesn't have the features that options requires.
      * @throws exception pthreads are not available on this system. 
      */
-    EventBase(const char* method);
+    EventBase(const char* method,
+            const EventBaseOptions& options = EventBaseOptions());
     ~EventBase();
 
     /**
@@ -41,6 +91,25 @@ public:
      * @return The event base structure.
      */
     struct event_base* getBase();
+    /**
+     * Whether libevent locking was enabled for this base.
+     *
+     * @return True if the base may be used from more than one thread.
+     */
+    bool isThreadSafe();
+    /**
+     * Get the number of priorities events on this base can have.
+     *
+     * @return The number of priorities, 0 being the most urgent.
+     */
+    int getPriorities();
+    /**
+     * Write the method, its features and the options the base was created
+     * with.
+     *
+     * @param out Where to write the description.
+     */
+    void printConfig(std::ostream& out);
     /**
      * Get a list of the event bases for this system (select, epoll, kqueue, 
      * etc.).
@@ -20,6 +20,9 @@ yum install boost-program-options
 echo
 echo ">>> Installing libevent dependencies"
 yum install libevent-devel
+echo
+echo ">>> Installing OpenSSL dependencies"
+yum install openssl-devel
 
 echo
 read -n 1 -p ">>> Will this shell be running a client? [y/n] "
@@ -0,0 +1,327 @@
+#include "histogram.hpp"
+#include <time.h>
+namespace dm {
+
+/** Sub-buckets per power of two. */
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+
+
+uint64_t monotonicNs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * @return The bucket value belongs in.
+ */
+static int bucketFor(uint64_t value)
+{
+    if (value < HIST_SUB_COUNT)
+    {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS)
+            + ((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+
+/**
+ * @return The highest value that belongs in bucket.
+ */
+static uint64_t bucketTop(int bucket)
+{
+    if (bucket < HIST_SUB_COUNT)
+    {
+        return bucket;
+    }
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t sub = HIST_SUB_COUNT + (bucket & (HIST_SUB_COUNT - 1));
+    return (sub << shift) + (((uint64_t) 1 << shift) - 1);
+}
+
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+
+void
+LatencyHistogram::record(uint64_t ns)
+{
+    counts_[bucketFor(ns)].fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t seen = max_.load(std::memory_order_relaxed);
+    while (ns > seen
+           && !max_.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+
+void
+LatencyHistogram::merge(const LatencyHistogram& other)
+{
+    int i = 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        uint64_t n = other.counts_[i].load(std::memory_order_relaxed);
+        if (n)
+        {
+            counts_[i].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+    total_.fetch_add(other.count(), std::memory_order_relaxed);
+
+    uint64_t ns = other.max();
+    uint64_t seen = max_.load(std::memory_order_relaxed);
+    while (ns > seen
+           && !max_.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+
+void
+LatencyHistogram::save(uint64_t* out) const
+{
+    int i = 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        out[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    out[HIST_BUCKETS] = max();
+}
+
+
+void
+LatencyHistogram::merge(const uint64_t* saved)
+{
+    int i = 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        if (saved[i])
+        {
+            counts_[i].fetch_add(saved[i], std::memory_order_relaxed);
+            total_.fetch_add(saved[i], std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t ns = saved[HIST_BUCKETS];
+    uint64_t seen = max_.load(std::memory_order_relaxed);
+    while (ns > seen
+           && !max_.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+
+void
+LatencyHistogram::reset()
+{
+    int i = 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        counts_[i].store(0, std::memory_order_relaxed);
+    }
+    total_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+
+uint64_t
+LatencyHistogram::count() const
+{
+    return total_.load(std::memory_order_relaxed);
+}
+
+
+uint64_t
+LatencyHistogram::max() const
+{
+    return max_.load(std::memory_order_relaxed);
+}
+
+
+uint64_t
+LatencyHistogram::percentile(double percent) const
+{
+    uint64_t total = count();
+    uint64_t seen = 0;
+    int i = 0;
+
+    if (!total)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percent / 100 * total + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += counts_[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            uint64_t top = bucketTop(i);
+            return top < max() ? top : max();
+        }
+    }
+    return max();
+}
+
+
+void
+LatencyHistogram::print(std::ostream& out, const char* name) const
+{
+    out << name << " (" << count() << ", usec):\tp50 "
+        << percentile(50) / 1000.0 << "  p99 "
+        << percentile(99) / 1000.0 << "  p99.9 "
+        << percentile(99.9) / 1000.0 << "  max "
+        << max() / 1000.0 << "\n";
+}
+
+
+LatencyWindows::LatencyWindows()
+    : start_(0), length_(0), measured_(0)
+{
+    size_t i = 0;
+
+    for (i = 0; i < HIST_WINDOWS; i++)
+    {
+        windows_[i].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+
+LatencyWindows::~LatencyWindows()
+{
+    reset(0, 0);
+}
+
+
+LatencyHistogram*
+LatencyWindows::open(size_t window)
+{
+    LatencyHistogram* hist = windows_[window].load(std::memory_order_acquire);
+    LatencyHistogram* made = NULL;
+
+    if (hist)
+    {
+        return hist;
+    }
+    // whoever loses the race throws theirs away
+    made = new LatencyHistogram();
+    if (windows_[window].compare_exchange_strong(hist, made, 
+                std::memory_order_acq_rel))
+    {
+        return made;
+    }
+    delete made;
+    return hist;
+}
+
+
+void
+LatencyWindows::reset(uint64_t startNs, uint64_t lengthNs)
+{
+    size_t i = 0;
+
+    for (i = 0; i < HIST_WINDOWS; i++)
+    {
+        delete windows_[i].exchange(NULL, std::memory_order_relaxed);
+    }
+    start_ = startNs;
+    length_ = lengthNs;
+    measured_.store(0, std::memory_order_relaxed);
+}
+
+
+bool
+LatencyWindows::record(uint64_t nowNs, uint64_t ns)
+{
+    size_t window = 0;
+
+    if (!start_)
+    {
+        return true;
+    }
+    if (nowNs < start_)
+    {
+        return false;
+    }
+    if (length_)
+    {
+        window = (nowNs - start_) / length_;
+        open(window < HIST_WINDOWS ? window : HIST_WINDOWS - 1)->record(ns);
+    }
+    extend(nowNs - start_);
+    return true;
+}
+
+
+void
+LatencyWindows::merge(size_t window, const uint64_t* saved)
+{
+    open(window < HIST_WINDOWS ? window : HIST_WINDOWS - 1)->merge(saved);
+}
+
+
+void
+LatencyWindows::extend(uint64_t ns)
+{
+    uint64_t seen = measured_.load(std::memory_order_relaxed);
+
+    while (ns > seen && !measured_.compare_exchange_weak(seen, ns, 
+                std::memory_order_relaxed))
+    {
+    }
+}
+
+
+uint64_t
+LatencyWindows::measured() const
+{
+    return measured_.load(std::memory_order_relaxed);
+}
+
+
+uint64_t
+LatencyWindows::length() const
+{
+    return length_;
+}
+
+
+size_t
+LatencyWindows::size() const
+{
+    size_t i = HIST_WINDOWS;
+
+    while (i && !windows_[i - 1].load(std::memory_order_acquire))
+    {
+        i--;
+    }
+    return i;
+}
+
+
+const LatencyHistogram*
+LatencyWindows::window(size_t window) const
+{
+    return windows_[window].load(std::memory_order_acquire);
+}
+
+} // namespace dm
@@ -0,0 +1,186 @@
+#ifndef DM_HISTOGRAM_HPP
+#define DM_HISTOGRAM_HPP
+#include <atomic>
+#include <ostream>
+#include <stdint.h>
+namespace dm {
+
+/** Each power of two is split into 2^HIST_SUB_BITS buckets, so a recorded
+ * value is off by at most 1/16th (about 6%). */
+#define HIST_SUB_BITS   4
+/** Enough buckets to cover every uint64_t. */
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+/** The number of values save() writes: every bucket's count, then the max. */
+#define HIST_SAVED      (HIST_BUCKETS + 1)
+/** The most windows LatencyWindows keeps apart; the last takes everything
+ * after it. */
+#define HIST_WINDOWS    4096
+
+/**
+ * @return Nanoseconds on the monotonic clock.
+ */
+uint64_t monotonicNs();
+
+/**
+ * Counts latencies in log-linear buckets, like an HDR histogram: exact below
+ * 16 ns, then within about 6% of the true value all the way up. Recording is
+ * lock free and safe from any number of threads.
+ */
+class LatencyHistogram
+{
+private:
+    std::atomic<uint64_t> counts_[HIST_BUCKETS];
+    std::atomic<uint64_t> total_;
+    std::atomic<uint64_t> max_;
+
+public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    /**
+     * @param ns The latency to count, in nanoseconds.
+     */
+    void record(uint64_t ns);
+
+    /**
+     * Add every value counted by other to this histogram.
+     *
+     * @param other The histogram to add.
+     */
+    void merge(const LatencyHistogram& other);
+
+    /**
+     * Copy out everything recorded, such as to send to another process.
+     *
+     * @param out Where to put the HIST_SAVED values.
+     */
+    void save(uint64_t* out) const;
+
+    /**
+     * Add the values saved from another histogram to this one, as merge()
+     * does.
+     *
+     * @param saved HIST_SAVED values from save().
+     */
+    void merge(const uint64_t* saved);
+
+    /**
+     * Forget everything that has been recorded.
+     */
+    void reset();
+
+    /**
+     * @return The number of values recorded.
+     */
+    uint64_t count() const;
+
+    /**
+     * @return The biggest value recorded, exactly.
+     */
+    uint64_t max() const;
+
+    /**
+     * @param percent Which percentile to find, from 0 to 100.
+     * @return The highest value that falls in the same bucket as the
+     *      percentile (never more than max()), or 0 if nothing was recorded.
+     */
+    uint64_t percentile(double percent) const;
+
+    /**
+     * Write the count, p50, p99, p99.9 and max on one line, in microseconds.
+     *
+     * @param out Where to write them.
+     * @param name What to label the line with.
+     */
+    void print(std::ostream& out, const char* name) const;
+};
+
+/**
+ * Latencies by when they were measured: none at all during a warmup, then a
+ * histogram for each window of a fixed length, so that a long run shows
+ * whether things get slower as it goes. A window's histogram is only made
+ * once something is recorded in it, and until reset() is first called
+ * nothing is kept at all. Recording is lock free and safe from any number of
+ * threads.
+ */
+class LatencyWindows
+{
+private:
+    /** When the warmup ends and the first window starts (monotonicNs()). */
+    uint64_t start_;
+    /** The length of each window, or 0 for one window with everything. */
+    uint64_t length_;
+    /** From start_ to the latest value recorded. */
+    std::atomic<uint64_t> measured_;
+    std::atomic<LatencyHistogram*> windows_[HIST_WINDOWS];
+
+    LatencyHistogram* open(size_t window);
+
+public:
+    LatencyWindows();
+    ~LatencyWindows();
+
+    LatencyWindows(const LatencyWindows&) = delete;
+    LatencyWindows& operator=(const LatencyWindows&) = delete;
+
+    /**
+     * Forget everything that has been recorded and start again. Not safe
+     * while other threads are recording.
+     *
+     * @param startNs When the warmup ends (monotonicNs()); nothing before
+     *      then is recorded.
+     * @param lengthNs The length of each window, or 0 for just one.
+     */
+    void reset(uint64_t startNs, uint64_t lengthNs);
+
+    /**
+     * @param nowNs When the latency was measured (monotonicNs()).
+     * @param ns The latency to count, in nanoseconds.
+     * @return False if it's still the warmup, so the latency wasn't counted
+     *      and shouldn't be anywhere else either.
+     */
+    bool record(uint64_t nowNs, uint64_t ns);
+
+    /**
+     * Add values saved from another LatencyWindows' window, such as one in
+     * another process, to the same window of this one.
+     *
+     * @param window Which window, from 0.
+     * @param saved HIST_SAVED values from LatencyHistogram::save().
+     */
+    void merge(size_t window, const uint64_t* saved);
+
+    /**
+     * Make measured() at least ns, as when merging another's windows.
+     *
+     * @param ns From the end of the warmup, in nanoseconds.
+     */
+    void extend(uint64_t ns);
+
+    /**
+     * @return Nanoseconds from the end of the warmup to the latest value
+     *      recorded.
+     */
+    uint64_t measured() const;
+
+    /**
+     * @return The length of each window, in nanoseconds.
+     */
+    uint64_t length() const;
+
+    /**
+     * @return The number of windows up to the last with anything in it.
+     */
+    size_t size() const;
+
+    /**
+     * @param window Which window, from 0.
+     * @return What was recorded in it, or NULL if nothing was.
+     */
+    const LatencyHistogram* window(size_t window) const;
+};
+
+} // namespace dm
+#endif
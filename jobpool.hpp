@@ -0,0 +1,281 @@
+#ifndef DM_JOBPOOL_HPP
+#define DM_JOBPOOL_HPP
+#include <cstddef>
+#include <new>
+#include <pthread.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "tpool.h"
+namespace dm {
+
+/** Bytes of inline storage in each job. Enough for a few pointers and sizes. */
+#define JOB_INLINE_SIZE     48
+
+/**
+ * A move-only, type erased void() callable that stores the callable inside
+ * the object itself. Callables that don't fit are rejected at compile time,
+ * so constructing an InlineJob never allocates.
+ */
+template <std::size_t Capacity = JOB_INLINE_SIZE>
+class InlineJob
+{
+private:
+    typedef void (*Invoker)(void*);
+    typedef void (*Mover)(void*, void*);
+    typedef void (*Destroyer)(void*);
+
+    alignas(std::max_align_t) unsigned char storage_[Capacity];
+    Invoker invoke_;
+    Mover move_;
+    Destroyer destroy_;
+
+    template <typename F>
+    static void invokeImpl(void* p)
+    {
+        (*static_cast<F*>(p))();
+    }
+
+    template <typename F>
+    static void moveImpl(void* from, void* to)
+    {
+        new (to) F(std::move(*static_cast<F*>(from)));
+        static_cast<F*>(from)->~F();
+    }
+
+    template <typename F>
+    static void destroyImpl(void* p)
+    {
+        static_cast<F*>(p)->~F();
+    }
+
+public:
+    InlineJob() : invoke_(NULL), move_(NULL), destroy_(NULL) {}
+
+    template <typename F, typename Fn = typename std::decay<F>::type,
+            typename = typename std::enable_if<
+                !std::is_same<Fn, InlineJob>::value>::type>
+    InlineJob(F&& f)
+        : invoke_(&invokeImpl<Fn>), move_(&moveImpl<Fn>),
+          destroy_(&destroyImpl<Fn>)
+    {
+        static_assert(sizeof(Fn) <= Capacity,
+                "callable is too large for the job's inline storage");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t),
+                "callable is over-aligned for the job's inline storage");
+        new (storage_) Fn(std::forward<F>(f));
+    }
+
+    InlineJob(InlineJob&& other)
+        : invoke_(other.invoke_), move_(other.move_), destroy_(other.destroy_)
+    {
+        if (move_)
+        {
+            move_(other.storage_, storage_);
+            other.invoke_ = NULL;
+            other.move_ = NULL;
+            other.destroy_ = NULL;
+        }
+    }
+
+    InlineJob& operator=(InlineJob&& other)
+    {
+        if (this != &other)
+        {
+            reset();
+            invoke_ = other.invoke_;
+            move_ = other.move_;
+            destroy_ = other.destroy_;
+            if (move_)
+            {
+                move_(other.storage_, storage_);
+                other.invoke_ = NULL;
+                other.move_ = NULL;
+                other.destroy_ = NULL;
+            }
+        }
+        return *this;
+    }
+
+    InlineJob(const InlineJob&) = delete;
+    InlineJob& operator=(const InlineJob&) = delete;
+
+    ~InlineJob()
+    {
+        reset();
+    }
+
+    /**
+     * Destroys the stored callable, if there is one.
+     */
+    void reset()
+    {
+        if (destroy_)
+        {
+            destroy_(storage_);
+            invoke_ = NULL;
+            move_ = NULL;
+            destroy_ = NULL;
+        }
+    }
+
+    /**
+     * Runs the stored callable.
+     */
+    void operator()()
+    {
+        invoke_(storage_);
+    }
+
+    explicit operator bool() const
+    {
+        return invoke_ != NULL;
+    }
+};
+
+
+/**
+ * Describes how JobPool talks to the queue underneath it. Specialize this for
+ * any queue that can run a void(*)(void*) routine with an argument; it needs
+ * add() with tPoolAddJob() semantics and maxOutstanding(), the most jobs that
+ * can be queued or running at once.
+ */
+template <typename Pool>
+struct PoolTraits;
+
+template <>
+struct PoolTraits<tPool>
+{
+    static int add(tPool* pool, void (*routine)(void*), void* arg)
+    {
+        return tPoolAddJob(pool, routine, arg);
+    }
+
+    static std::size_t maxOutstanding(tPool* pool)
+    {
+        return pool->maxQueueSize + pool->numThreads;
+    }
+};
+
+
+/**
+ * Typed front end for a thread pool. Jobs are any move-only callable that fits
+ * in an InlineJob, and are stored in slots that are allocated once when the
+ * JobPool is created and recycled afterwards, so submitting a job doesn't touch
+ * the heap.
+ */
+template <typename Pool = tPool, std::size_t Capacity = JOB_INLINE_SIZE>
+class JobPool
+{
+private:
+    struct Slot
+    {
+        InlineJob<Capacity> job;
+        JobPool* owner;
+        Slot* next;
+    };
+
+    /** The queue that runs the jobs. */
+    Pool* pool_;
+    /** Storage for every job that can be outstanding at once. */
+    std::vector<Slot> slots_;
+    /** Slots that are not holding a job. */
+    Slot* free_;
+    /** Protects free_. */
+    pthread_mutex_t freeLock_;
+
+    static void run(void* arg)
+    {
+        Slot* slot = static_cast<Slot*>(arg);
+        slot->job();
+        slot->job.reset();
+        slot->owner->release(slot);
+    }
+
+    Slot* acquire()
+    {
+        pthread_mutex_lock(&freeLock_);
+        Slot* slot = free_;
+        if (slot)
+        {
+            free_ = slot->next;
+        }
+        pthread_mutex_unlock(&freeLock_);
+        return slot;
+    }
+
+    void release(Slot* slot)
+    {
+        pthread_mutex_lock(&freeLock_);
+        slot->next = free_;
+        free_ = slot;
+        pthread_mutex_unlock(&freeLock_);
+    }
+
+public:
+    /**
+     * Wraps an existing pool. The pool must outlive the JobPool.
+     *
+     * @param pool The queue that will run the jobs.
+     * @param submitters The number of threads that may be blocked in submit()
+     *      at the same time. Each one can hold a slot while it waits.
+     */
+    explicit JobPool(Pool* pool, std::size_t submitters = 1)
+        : pool_(pool),
+          slots_(PoolTraits<Pool>::maxOutstanding(pool) + submitters),
+          free_(NULL)
+    {
+        pthread_mutex_init(&freeLock_, NULL);
+        for (std::size_t i = 0; i < slots_.size(); i++)
+        {
+            slots_[i].owner = this;
+            slots_[i].next = free_;
+            free_ = &slots_[i];
+        }
+    }
+
+    ~JobPool()
+    {
+        pthread_mutex_destroy(&freeLock_);
+    }
+
+    JobPool(const JobPool&) = delete;
+    JobPool& operator=(const JobPool&) = delete;
+
+    /**
+     * Adds a job to the pool.
+     *
+     * @param f The callable to run on a worker thread.
+     * @return 0 on success, otherwise the error from the underlying pool
+     *      (TPOOL_QUEUE_FULL if every slot is in use).
+     */
+    template <typename F>
+    int submit(F&& f)
+    {
+        Slot* slot = acquire();
+        if (!slot)
+        {
+            return TPOOL_QUEUE_FULL;
+        }
+        slot->job = InlineJob<Capacity>(std::forward<F>(f));
+
+        int rtn = PoolTraits<Pool>::add(pool_, &JobPool::run, slot);
+        if (rtn)
+        {
+            slot->job.reset();
+            release(slot);
+        }
+        return rtn;
+    }
+
+    /**
+     * @return The pool underneath this one.
+     */
+    Pool* getPool()
+    {
+        return pool_;
+    }
+};
+
+} // namespace dm
+#endif
@@ -0,0 +1,91 @@
+#include "loopqueue.hpp"
+#include <stddef.h>
+namespace dm {
+
+
+LoopQueue::LoopQueue()
+    : head_(&stub_), tail_(&stub_), pending_(false)
+{
+    stub_.next.store(NULL, std::memory_order_relaxed);
+}
+
+
+void
+LoopQueue::enqueue(LoopMessage* msg)
+{
+    msg->next.store(NULL, std::memory_order_relaxed);
+    LoopMessage* prev = head_.exchange(msg, std::memory_order_acq_rel);
+    prev->next.store(msg, std::memory_order_release);
+}
+
+
+void
+LoopQueue::push(LoopMessage* msg)
+{
+    enqueue(msg);
+
+    // only the first push since the loop last woke up needs to notify it
+    if (!pending_.exchange(true, std::memory_order_acq_rel))
+    {
+        notifier_.notify();
+    }
+}
+
+
+void
+LoopQueue::acknowledge()
+{
+    notifier_.drain();
+    pending_.exchange(false, std::memory_order_acq_rel);
+}
+
+
+LoopMessage*
+LoopQueue::pop()
+{
+    LoopMessage* tail = tail_;
+    LoopMessage* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &stub_)
+    {
+        if (!next)
+        {
+            return NULL;
+        }
+        tail_ = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next)
+    {
+        tail_ = next;
+        return tail;
+    }
+
+    if (tail != head_.load(std::memory_order_acquire))
+    {
+        // a producer is part way through pushing; it will notify us
+        return NULL;
+    }
+
+    // tail is the last message; put the stub behind it so it can be removed
+    enqueue(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+
+    if (next)
+    {
+        tail_ = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+int
+LoopQueue::getFd()
+{
+    return notifier_.getFd();
+}
+
+} // namespace dm
@@ -0,0 +1,79 @@
+#ifndef DM_LOOPQUEUE_HPP
+#define DM_LOOPQUEUE_HPP
+#include <atomic>
+#include "notifier.hpp"
+namespace dm {
+
+/**
+ * Anything that is passed to an event loop through a LoopQueue. Derive from
+ * this and cast back after pop().
+ */
+struct LoopMessage
+{
+    /** Used by the queue; don't touch. */
+    std::atomic<LoopMessage*> next;
+};
+
+/**
+ * A multiple producer, single consumer queue for handing work back to the
+ * thread running an event loop. Pushing is lock free and only costs a system
+ * call when the loop isn't already due to wake up. The loop watches getFd()
+ * for readability, calls acknowledge(), then pop()s until it returns NULL.
+ *
+ * Based on Dmitry Vyukov's intrusive MPSC node-based queue.
+ */
+class LoopQueue
+{
+private:
+    /** The most recently pushed message. Written by producers. */
+    std::atomic<LoopMessage*> head_;
+    /** The next message to pop. Only used by the loop thread. */
+    LoopMessage* tail_;
+    /** Placeholder so the queue is never truly empty. */
+    LoopMessage stub_;
+    /** True if the loop has been notified and hasn't acknowledged it yet. */
+    std::atomic<bool> pending_;
+    /** Wakes up the loop. */
+    Notifier notifier_;
+
+    void enqueue(LoopMessage* msg);
+
+public:
+    /**
+     * @throws exception the notification descriptor could not be created.
+     */
+    LoopQueue();
+
+    LoopQueue(const LoopQueue&) = delete;
+    LoopQueue& operator=(const LoopQueue&) = delete;
+
+    /**
+     * Hand a message to the loop. Safe to call from any thread.
+     *
+     * @param msg The message. The loop thread owns it once it's popped.
+     */
+    void push(LoopMessage* msg);
+
+    /**
+     * Clear the notification. The loop thread must call this before it starts
+     * popping messages, so that anything pushed afterwards wakes it up again.
+     */
+    void acknowledge();
+
+    /**
+     * Take the oldest message off the queue. Only the loop thread may call
+     * this.
+     *
+     * @return The message, or NULL if there are none (or the only one is still
+     *      being pushed, in which case the loop will be notified again).
+     */
+    LoopMessage* pop();
+
+    /**
+     * @return The descriptor that becomes readable when messages are pushed.
+     */
+    int getFd();
+};
+
+} // namespace dm
+#endif
@@ -1,7 +1,11 @@
 #include "network.hpp"
 #include <errno.h>
+#include <fcntl.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 namespace dm
 {
 
@@ -36,6 +40,354 @@ int clearSocket(int fd, char* buf, int bufsize)
 }
 
 
+/** How big SpliceSink asks for its pipe to be; it gets the default (64 KiB)
+ * if that's over the limit. */
+#define SPLICE_PIPE_SIZE    (1024 * 1024)
+
+
+SpliceSink::SpliceSink()
+    : null_(-1), size_(65536)
+{
+#ifdef __linux__
+    int size = 0;
+
+    if (pipe2(pipe_, O_CLOEXEC) == -1)
+    {
+        throw std::exception();
+    }
+    if ((null_ = open("/dev/null", O_WRONLY | O_CLOEXEC)) == -1)
+    {
+        close(pipe_[0]);
+        close(pipe_[1]);
+        throw std::exception();
+    }
+    if ((size = fcntl(pipe_[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE)) > 0
+            || (size = fcntl(pipe_[1], F_GETPIPE_SZ)) > 0)
+    {
+        size_ = size;
+    }
+#else
+    throw std::exception();
+#endif
+}
+
+
+SpliceSink::~SpliceSink()
+{
+    close(pipe_[0]);
+    close(pipe_[1]);
+    close(null_);
+}
+
+
+int
+SpliceSink::drain(int fd, size_t len)
+{
+#ifdef __linux__
+    ssize_t moved = 0;
+    ssize_t out = 0;
+    ssize_t rtn = 0;
+
+    if ((moved = splice(fd, NULL, pipe_[1], NULL, len < size_ ? len : size_,
+                        SPLICE_F_MOVE)) <= 0)
+    {
+        return moved;
+    }
+    // /dev/null takes everything, so the pipe is empty again after this
+    for (out = 0; out < moved; out += rtn)
+    {
+        if ((rtn = splice(pipe_[0], NULL, null_, NULL, moved - out, 
+                          SPLICE_F_MOVE)) <= 0)
+        {
+            if (rtn == -1 && errno == EINTR)
+            {
+                rtn = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    return moved;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+SocketReader::SocketReader(int fd, size_t capacity)
+    : buf_(new char[capacity]), capacity_(capacity), start_(0), end_(0),
+      calls_(0), discardMode_(DISCARD_COPY), sink_(NULL), fd_(fd)
+{
+}
+
+
+SocketReader::~SocketReader()
+{
+    delete[] buf_;
+}
+
+
+int
+SocketReader::readSome(char* buf, size_t len)
+{
+    return recv(fd_, buf, len, 0);
+}
+
+
+int
+SocketReader::fill(size_t len)
+{
+    int read = 0;
+
+    if (start_ + len > capacity_)
+    {
+        // slide what's left to the front to make room
+        memmove(buf_, buf_ + start_, end_ - start_);
+        end_ -= start_;
+        start_ = 0;
+    }
+
+    while (end_ - start_ < len)
+    {
+        if ((read = readSome(buf_ + end_, capacity_ - end_)) <= 0)
+        {
+            if (read == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (!read)
+            {
+                // so a closed socket can't be mistaken for a slow one
+                errno = 0;
+            }
+            return read;
+        }
+        calls_++;
+        end_ += read;
+    }
+    return 1;
+}
+
+
+long
+SocketReader::partial(size_t done, int result)
+{
+    if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        // the receive timeout ran out
+        return done;
+    }
+    return -1;
+}
+
+
+const char*
+SocketReader::peek(size_t len)
+{
+    if (end_ - start_ < len && fill(len) != 1)
+    {
+        return NULL;
+    }
+    return buf_ + start_;
+}
+
+
+int
+SocketReader::read(char* buf, size_t len)
+{
+    size_t done = end_ - start_ < len ? end_ - start_ : len;
+    int read = 0;
+
+    memcpy(buf, buf_ + start_, done);
+    start_ += done;
+
+    while (done < len)
+    {
+        if (len - done < capacity_)
+        {
+            // small enough to stage, picking up whatever follows it too
+            if ((read = fill(len - done)) != 1)
+            {
+                return partial(done, read);
+            }
+            memcpy(buf + done, buf_ + start_, len - done);
+            start_ += len - done;
+            break;
+        }
+        if ((read = readSome(buf + done, len - done)) <= 0)
+        {
+            if (read == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return partial(done, read);
+        }
+        calls_++;
+        done += read;
+    }
+    return len;
+}
+
+
+long
+SocketReader::discard(size_t len)
+{
+    size_t done = end_ - start_ < len ? end_ - start_ : len;
+    int read = 0;
+
+    start_ += done;
+
+    // the buffer is empty from here on, so it doubles as scratch space
+    while (done < len)
+    {
+        start_ = end_ = 0;
+        if (discardMode_ == DISCARD_TRUNC)
+        {
+            read = recv(fd_, NULL, len - done, MSG_TRUNC);
+        }
+        else if (discardMode_ == DISCARD_SPLICE)
+        {
+            read = sink_->drain(fd_, len - done);
+        }
+        else
+        {
+            read = readSome(buf_, capacity_);
+        }
+        if (read <= 0)
+        {
+            if (read == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return partial(done, read);
+        }
+        calls_++;
+        done += read;
+        if (discardMode_ == DISCARD_COPY)
+        {
+            end_ = read;
+            start_ = read;
+        }
+    }
+    // keep anything read past the end
+    start_ -= done - len;
+    return len;
+}
+
+
+int recvDatagrams(int fd, char* buf, int bufsize)
+{
+    struct mmsghdr msgs[DATAGRAM_BATCH];
+    struct iovec iov[DATAGRAM_BATCH];
+    int bytesRead = 0;
+    int received = 0;
+    int i = 0;
+
+    while (bytesRead < bufsize)
+    {
+        int offset = bytesRead;
+        int n = 0;
+
+        memset(msgs, 0, sizeof(msgs));
+        for (n = 0; n < DATAGRAM_BATCH && offset < bufsize; n++)
+        {
+            iov[n].iov_base = buf + offset;
+            iov[n].iov_len = (bufsize - offset < MAX_DATAGRAM) 
+                    ? bufsize - offset : MAX_DATAGRAM;
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            offset += iov[n].iov_len;
+        }
+
+        if ((received = recvMessages(fd, msgs, n, MSG_WAITFORONE)) == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            sockError("recvmmsg()", 0);
+            return -1;
+        }
+        for (i = 0; i < received; i++)
+        {
+            bytesRead += msgs[i].msg_len;
+        }
+    }
+    return bytesRead;
+}
+
+
+int recvMessages(int fd, struct mmsghdr* msgs, unsigned int n, int flags)
+{
+#ifdef __linux__
+    return recvmmsg(fd, msgs, n, flags, NULL);
+#else
+    unsigned int i = 0;
+    ssize_t len = 0;
+    bool waitForOne = flags & MSG_WAITFORONE;
+
+    flags &= ~MSG_WAITFORONE;
+    for (i = 0; i < n; i++)
+    {
+        if ((len = recvmsg(fd, &msgs[i].msg_hdr, 
+                        (i && waitForOne) ? flags | MSG_DONTWAIT : flags)) == -1)
+        {
+            return i ? (int) i : -1;
+        }
+        msgs[i].msg_len = len;
+    }
+    return n;
+#endif
+}
+
+
+int sendMessages(int fd, struct mmsghdr* msgs, unsigned int n)
+{
+    unsigned int sent = 0;
+    int rtn = 0;
+
+    while (sent < n)
+    {
+#ifdef __linux__
+        rtn = sendmmsg(fd, msgs + sent, n - sent, 0);
+#else
+        rtn = (sendmsg(fd, &msgs[sent].msg_hdr, 0) == -1) ? -1 : 1;
+#endif
+        if (rtn == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return sent ? (int) sent : -1;
+        }
+        sent += rtn;
+    }
+    return sent;
+}
+
+
+int setBusyPoll(int fd, int usec)
+{
+#ifdef SO_BUSY_POLL
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1)
+    {
+        return -1;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    // older kernels don't know it; SO_BUSY_POLL alone still helps
+    int prefer = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+    return 0;
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+
 int sockError(const char* msg, int err)
 {
     if (!err)
@@ -1,5 +1,6 @@
 #ifndef DM_NETWORK_HPP
 #define DM_NETWORK_HPP
+#include <stddef.h>
 #include <stdio.h>
 #include <sys/socket.h>
 namespace dm
@@ -7,6 +8,26 @@ namespace dm
 
 /** The total size of the request packets sent to the server. */
 #define REQUEST_SIZE    66
+/** The biggest UDP payload over IPv4. Responses over UDP are split into
+ * datagrams this big (the last one holds whatever is left). */
+#define MAX_DATAGRAM    65507
+/** The most datagrams moved by one recvMessages() or sendMessages() call. */
+#define DATAGRAM_BATCH  64
+/** The default size of a SocketReader's read-ahead buffer. */
+#define READ_AHEAD_SIZE 16384
+
+#ifndef __linux__
+/** What recvmmsg() and sendmmsg() take on Linux. */
+struct mmsghdr
+{
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+#ifndef MSG_WAITFORONE
+/** Only recvMessages() understands this without recvmmsg(). */
+#define MSG_WAITFORONE  0x10000
+#endif
 
 /**
  * Keep reading from the socket until bufsize bytes are read.
@@ -19,6 +40,235 @@ namespace dm
  */
 int clearSocket(int fd, char* buf, int bufsize);
 
+/**
+ * How SocketReader::discard() gets rid of the bytes it skips.
+ */
+enum DiscardMode
+{
+    /** Read them into the read-ahead buffer, like anything else. */
+    DISCARD_COPY,
+    /** recv() them with MSG_TRUNC, which drops them without copying them
+     * out of the kernel. TCP only. */
+    DISCARD_TRUNC,
+    /** splice() them through a pipe into /dev/null, which doesn't copy them
+     * either, and works on unix domain sockets too. Linux only. */
+    DISCARD_SPLICE
+};
+
+/**
+ * A pipe to /dev/null for DISCARD_SPLICE. Each drain() leaves the pipe empty
+ * again, so every SocketReader on one thread can share one sink.
+ */
+class SpliceSink
+{
+private:
+    int pipe_[2];
+    int null_;
+    /** The most the pipe holds. */
+    size_t size_;
+
+public:
+    /**
+     * @throws exception The pipe or /dev/null couldn't be opened.
+     */
+    SpliceSink();
+    ~SpliceSink();
+
+    SpliceSink(const SpliceSink&) = delete;
+    SpliceSink& operator=(const SpliceSink&) = delete;
+
+    /**
+     * Move up to len bytes from a socket to /dev/null.
+     *
+     * @param fd The socket.
+     * @param len The most bytes to move.
+     * @return The number of bytes moved, 0 if the socket has closed, or -1
+     *      on error.
+     */
+    int drain(int fd, size_t len);
+};
+
+/**
+ * Reads a stream socket through a read-ahead buffer, so that a run of small
+ * frames (requests, response headers) costs one recv() rather than one each.
+ * Reads bigger than the buffer go straight into the caller's memory.
+ */
+class SocketReader
+{
+private:
+    char* buf_;
+    size_t capacity_;
+    /** The unread bytes are buf_[start_, end_). */
+    size_t start_;
+    size_t end_;
+    unsigned long calls_;
+    DiscardMode discardMode_;
+    SpliceSink* sink_;
+
+    /**
+     * Read from the socket until at least len bytes are buffered.
+     *
+     * @return 1 once they are, 0 if the socket closed first, or -1 on error
+     *      (errno is set).
+     */
+    int fill(size_t len);
+
+    /**
+     * @return What read() and discard() return after reading done bytes and
+     *      then getting result from fill() or readSome().
+     */
+    static long partial(size_t done, int result);
+
+protected:
+    int fd_;
+
+    /**
+     * Read whatever the socket has, up to len bytes, blocking until there is
+     * something. Overridden to read through another layer, such as TLS.
+     *
+     * @param buf Where to put the bytes.
+     * @param len The most bytes to read.
+     * @return The number of bytes read, 0 if the socket has closed, or -1 on
+     *      error (including the receive timeout running out).
+     */
+    virtual int readSome(char* buf, size_t len);
+
+public:
+    /**
+     * @param fd The socket to read. It isn't closed by the reader.
+     * @param capacity The size of the read-ahead buffer.
+     * @throws bad_alloc The buffer couldn't be allocated.
+     */
+    explicit SocketReader(int fd, size_t capacity = READ_AHEAD_SIZE);
+    virtual ~SocketReader();
+
+    SocketReader(const SocketReader&) = delete;
+    SocketReader& operator=(const SocketReader&) = delete;
+
+    /**
+     * Look at the next len bytes without using them up, reading more from
+     * the socket if they aren't buffered yet.
+     *
+     * @param len The number of bytes wanted; at most the buffer's capacity.
+     * @return The bytes, valid until the next call on the reader, or NULL if
+     *      the socket closed (errno is 0), failed or timed out first. On a
+     *      non-blocking socket errno is EAGAIN if the bytes just haven't all
+     *      arrived yet; whatever has is kept.
+     */
+    const char* peek(size_t len);
+
+    /**
+     * Use up bytes returned by peek().
+     *
+     * @param len The number of bytes to drop; at most what was peeked.
+     */
+    void consume(size_t len)
+    {
+        start_ += len;
+    }
+
+    /**
+     * Read exactly len bytes, the buffered ones first.
+     *
+     * @param buf The buffer to fill.
+     * @param len The number of bytes to read.
+     * @return len, fewer if the receive timeout ran out, or -1 if the socket
+     *      has closed or failed.
+     */
+    int read(char* buf, size_t len);
+
+    /**
+     * Read and throw away exactly len bytes, such as a payload the caller
+     * doesn't look at.
+     *
+     * @param len The number of bytes to skip.
+     * @return len, fewer if the receive timeout ran out, or -1 if the socket
+     *      has closed or failed.
+     */
+    long discard(size_t len);
+
+    /**
+     * Choose how discard() gets rid of bytes that aren't buffered yet. The
+     * cheaper modes skip exactly what's asked for, so the next frame takes
+     * another read; they only pay off for big payloads. They also skip past
+     * any layer readSome() reads through, so they're only for plain sockets.
+     *
+     * @param mode How to discard.
+     * @param sink The pipe for DISCARD_SPLICE, kept by the caller.
+     */
+    void discardBy(DiscardMode mode, SpliceSink* sink = NULL)
+    {
+        discardMode_ = mode;
+        sink_ = sink;
+    }
+
+    /**
+     * Start on another socket, such as a fresh connection to the same
+     * server, keeping the buffer. Anything still buffered is dropped.
+     *
+     * @param fd The socket to read from now.
+     */
+    void reset(int fd)
+    {
+        fd_ = fd;
+        start_ = end_ = 0;
+    }
+
+    /**
+     * @return The number of reads made from the socket so far.
+     */
+    unsigned long calls() const
+    {
+        return calls_;
+    }
+};
+
+/**
+ * Keep reading datagrams from a connected UDP socket until bufsize bytes are
+ * read. Datagrams are expected to be MAX_DATAGRAM bytes, except the last.
+ *
+ * @param fd The socket to read from.
+ * @param buf The buffer to fill.
+ * @param bufsize The size of the buffer and the number of bytes to read.
+ * @return The number of bytes read (less than bufsize if the socket's receive
+ *      timeout ran out), or -1 on error.
+ */
+int recvDatagrams(int fd, char* buf, int bufsize);
+
+/**
+ * Receive up to n datagrams with one system call (recvmmsg() on Linux).
+ *
+ * @param fd The socket to read from.
+ * @param msgs Where to put the datagrams; msg_len is set to each one's size.
+ * @param n The number of entries in msgs.
+ * @param flags MSG_ flags, such as MSG_DONTWAIT or MSG_WAITFORONE.
+ * @return The number of datagrams received, or -1 on error.
+ */
+int recvMessages(int fd, struct mmsghdr* msgs, unsigned int n, int flags);
+
+/**
+ * Send n datagrams, with as few system calls as possible (sendmmsg() on
+ * Linux).
+ *
+ * @param fd The socket to write to.
+ * @param msgs The datagrams to send.
+ * @param n The number of entries in msgs.
+ * @return The number of datagrams sent, or -1 on error.
+ */
+int sendMessages(int fd, struct mmsghdr* msgs, unsigned int n);
+
+/**
+ * Ask the kernel to busy poll the device queue for up to usec microseconds
+ * when fd has nothing to read, instead of waiting for an interrupt
+ * (SO_BUSY_POLL, plus SO_PREFER_BUSY_POLL where the kernel has it). Linux
+ * only. Going over net.core.busy_read needs CAP_NET_ADMIN.
+ *
+ * @param fd The socket to busy poll.
+ * @param usec How long to poll for.
+ * @return 0 on success, or -1 if busy polling is not available (errno is set).
+ */
+int setBusyPoll(int fd, int usec);
+
 /**
  * Display detailed socket error info. The msg will be passed to perror() if err
  * is set to 0 (indicating that errno was set), otherwise it will be written to 
@@ -0,0 +1,95 @@
+#include "notifier.hpp"
+#include <errno.h>
+#include <exception>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+namespace dm {
+
+
+Notifier::Notifier()
+{
+#ifdef __linux__
+    if ((readFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        throw std::exception();
+    }
+    writeFd_ = readFd_;
+#else
+    int fds[2];
+
+    if (pipe(fds) == -1)
+    {
+        throw std::exception();
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    readFd_ = fds[0];
+    writeFd_ = fds[1];
+#endif
+}
+
+
+Notifier::~Notifier()
+{
+    close(readFd_);
+    if (writeFd_ != readFd_)
+    {
+        close(writeFd_);
+    }
+}
+
+
+void
+Notifier::notify()
+{
+    uint64_t one = 1;
+    ssize_t rtn = 0;
+
+    // EAGAIN means the loop already has a wake up pending
+    do
+    {
+#ifdef __linux__
+        rtn = write(writeFd_, &one, sizeof(one));
+#else
+        rtn = write(writeFd_, &one, 1);
+#endif
+    } while (rtn == -1 && errno == EINTR);
+}
+
+
+void
+Notifier::drain()
+{
+    uint64_t buf[16];
+    ssize_t rtn = 0;
+
+    while (true)
+    {
+        if ((rtn = read(readFd_, buf, sizeof(buf))) == -1 && errno == EINTR)
+        {
+            continue;
+        }
+#ifdef __linux__
+        // an eventfd is emptied by a single read
+        break;
+#else
+        if (rtn <= 0)
+        {
+            break;
+        }
+#endif
+    }
+}
+
+
+int
+Notifier::getFd()
+{
+    return readFd_;
+}
+
+} // namespace dm
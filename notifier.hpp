@@ -0,0 +1,43 @@
+#ifndef DM_NOTIFIER_HPP
+#define DM_NOTIFIER_HPP
+namespace dm {
+
+/**
+ * Lets any thread wake up an event loop. The loop watches getFd() for
+ * readability, and calls drain() once it wakes up. Uses an eventfd on Linux
+ * and a non-blocking pipe everywhere else. Several calls to notify() before the
+ * loop wakes up result in a single wake up.
+ */
+class Notifier
+{
+private:
+    /** The end of the eventfd / pipe that the loop watches. */
+    int readFd_;
+    /** The end of the eventfd / pipe that notify() writes to. */
+    int writeFd_;
+
+public:
+    /**
+     * @throws exception the eventfd or pipe could not be created.
+     */
+    Notifier();
+    ~Notifier();
+
+    /**
+     * Wake up the loop watching getFd(). Safe to call from any thread.
+     */
+    void notify();
+
+    /**
+     * Clear all pending notifications. Only the loop thread should call this.
+     */
+    void drain();
+
+    /**
+     * @return The descriptor that becomes readable after notify() is called.
+     */
+    int getFd();
+};
+
+} // namespace dm
+#endif
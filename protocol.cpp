@@ -0,0 +1,107 @@
+#include "protocol.hpp"
+#include <string.h>
+namespace dm {
+
+/**
+ * @return The little endian uint32_t at buf.
+ */
+static uint32_t getLe32(const char* buf)
+{
+    const unsigned char* b = (const unsigned char*) buf;
+
+    return (uint32_t) b[0] | (uint32_t) b[1] << 8
+         | (uint32_t) b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+
+/**
+ * Write value at buf, little endian.
+ */
+static void putLe32(char* buf, uint32_t value)
+{
+    buf[0] = value & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+    buf[2] = (value >> 16) & 0xFF;
+    buf[3] = (value >> 24) & 0xFF;
+}
+
+
+int parseRequest(const char* buf, size_t len, struct Request* req)
+{
+    if (len < sizeof(uint32_t))
+    {
+        return 0;
+    }
+
+    if (!isCompactRequest(buf))
+    {
+        if (len < REQUEST_SIZE)
+        {
+            return 0;
+        }
+        req->size = getLe32(buf);
+        req->id = 0;
+        req->flags = 0;
+        req->compact = false;
+        return REQUEST_SIZE;
+    }
+
+    if (memcmp(buf, PROTO_MAGIC, PROTO_MAGIC_LEN))
+    {
+        return -1;
+    }
+    if (len < COMPACT_REQUEST_SIZE)
+    {
+        return 0;
+    }
+    if (buf[4] != PROTO_VERSION)
+    {
+        return -1;
+    }
+    req->flags = buf[5];
+    req->id = getLe32(buf + 8);
+    req->size = getLe32(buf + 12);
+    req->compact = true;
+    return COMPACT_REQUEST_SIZE;
+}
+
+
+int writeRequest(char* buf, const struct Request& req)
+{
+    if (!req.compact)
+    {
+        memset(buf, 0, REQUEST_SIZE);
+        putLe32(buf, req.size);
+        return REQUEST_SIZE;
+    }
+
+    memcpy(buf, PROTO_MAGIC, PROTO_MAGIC_LEN);
+    buf[3] = (char) PROTO_MARKER;
+    buf[4] = PROTO_VERSION;
+    buf[5] = req.flags;
+    buf[6] = buf[7] = 0;
+    putLe32(buf + 8, req.id);
+    putLe32(buf + 12, req.size);
+    return COMPACT_REQUEST_SIZE;
+}
+
+
+int writeResponseHeader(char* buf, const struct Request& req)
+{
+    if (!req.compact)
+    {
+        return 0;
+    }
+    putLe32(buf, req.id);
+    putLe32(buf + 4, req.size);
+    return RESPONSE_HEADER_SIZE;
+}
+
+
+void parseResponseHeader(const char* buf, uint32_t* id, uint32_t* size)
+{
+    *id = getLe32(buf);
+    *size = getLe32(buf + 4);
+}
+
+} // namespace dm
@@ -0,0 +1,116 @@
+#ifndef DM_PROTOCOL_HPP
+#define DM_PROTOCOL_HPP
+#include <stddef.h>
+#include <stdint.h>
+#include "network.hpp"
+namespace dm {
+
+/**
+ * The wire formats. A legacy request is REQUEST_SIZE bytes, of which only the
+ * first 4 (the size wanted, little endian) mean anything, and its response is
+ * just the payload. A compact request is:
+ *
+ *      0   "DMP"       magic
+ *      3   uint8_t     PROTO_MARKER
+ *      4   uint8_t     version (PROTO_VERSION)
+ *      5   uint8_t     flags (PROTO_UNORDERED)
+ *      6   2 bytes     reserved, 0
+ *      8   uint32_t    request ID, picked by the client
+ *      12  uint32_t    size wanted
+ *
+ * and its response is the request ID and the size (both uint32_t) followed by
+ * the payload. Numbers are little endian. A connection may mix the two. The
+ * marker sits where a legacy request keeps the top byte of its size, so
+ * every legacy request under LEGACY_SIZE_LIMIT bytes is read as one.
+ */
+#define PROTO_MAGIC             "DMP"
+#define PROTO_MAGIC_LEN         3
+/** Byte 3 of a compact request; no legacy request sets it. */
+#define PROTO_MARKER            0xFF
+/** Legacy requests must ask for fewer bytes than this (4080 MiB). */
+#define LEGACY_SIZE_LIMIT       0xFF000000u
+/** The compact format this build speaks. */
+#define PROTO_VERSION           1
+/** The total size of a compact request. */
+#define COMPACT_REQUEST_SIZE    16
+/** The bytes in front of the payload of a compact response. */
+#define RESPONSE_HEADER_SIZE    8
+/** Request flag: the response may be sent before those of earlier requests
+ * on the connection, so it can be built alongside them. */
+#define PROTO_UNORDERED         0x01
+/** The most bytes parseRequest() needs to see to decode any request. */
+#define MAX_REQUEST_SIZE        REQUEST_SIZE
+
+/**
+ * One decoded request.
+ */
+struct Request
+{
+    /** The number of payload bytes asked for. */
+    uint32_t size;
+    /** Echoed back in the response; always 0 for legacy requests. */
+    uint32_t id;
+    /** PROTO_ flags; always 0 for legacy requests. */
+    uint8_t flags;
+    /** False for a legacy request, whose response has no header. */
+    bool compact;
+};
+
+/**
+ * Decode the request at the start of buf.
+ *
+ * @param buf The bytes received so far.
+ * @param len The number of bytes in buf.
+ * @param req Where to put the request.
+ * @return The number of bytes the request takes up, 0 if buf doesn't hold all
+ *      of it yet, or -1 if it's a compact request of an unknown version.
+ */
+int parseRequest(const char* buf, size_t len, struct Request* req);
+
+/**
+ * @param buf The first 4 bytes of a request.
+ * @return True if it's a compact request, false if it's a legacy one.
+ */
+inline bool isCompactRequest(const char* buf)
+{
+    return (unsigned char) buf[3] == PROTO_MARKER;
+}
+
+/**
+ * Encode a request.
+ *
+ * @param buf Where to write it; must have room for MAX_REQUEST_SIZE bytes.
+ * @param req The request. req.id and req.flags are ignored unless compact.
+ * @return The number of bytes written.
+ */
+int writeRequest(char* buf, const struct Request& req);
+
+/**
+ * @param req A request.
+ * @return The number of header bytes in front of the response's payload.
+ */
+inline int responseHeaderSize(const struct Request& req)
+{
+    return req.compact ? RESPONSE_HEADER_SIZE : 0;
+}
+
+/**
+ * Encode the header of the response to req, if it has one.
+ *
+ * @param buf Where to write it; must have room for RESPONSE_HEADER_SIZE bytes.
+ * @param req The request being answered.
+ * @return The number of bytes written (responseHeaderSize(req)).
+ */
+int writeResponseHeader(char* buf, const struct Request& req);
+
+/**
+ * Decode the header of a compact response.
+ *
+ * @param buf The first RESPONSE_HEADER_SIZE bytes of the response.
+ * @param id Where to put the request ID.
+ * @param size Where to put the payload size.
+ */
+void parseResponseHeader(const char* buf, uint32_t* id, uint32_t* size);
+
+} // namespace dm
+#endif
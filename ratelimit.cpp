@@ -0,0 +1,191 @@
+#include "ratelimit.hpp"
+#include "histogram.hpp"
+namespace dm {
+
+#define NS_PER_SEC  1e9
+
+
+TokenBucket::TokenBucket()
+    : tokens_(0), last_(0)
+{
+}
+
+
+void
+TokenBucket::reset(double rate, double burstSecs, uint64_t now)
+{
+    tokens_ = rate * burstSecs;
+    last_ = now;
+}
+
+
+uint64_t
+TokenBucket::wait(double rate, double burstSecs, uint64_t now)
+{
+    if (!rate)
+    {
+        return 0;
+    }
+    if (now > last_)
+    {
+        tokens_ += rate * (now - last_) / NS_PER_SEC;
+        if (tokens_ > rate * burstSecs)
+        {
+            tokens_ = rate * burstSecs;
+        }
+        last_ = now;
+    }
+    if (tokens_ > 0)
+    {
+        return 0;
+    }
+    // round up so the caller doesn't wake up a hair too early
+    return (uint64_t) (-tokens_ / rate * NS_PER_SEC) + 1;
+}
+
+
+void
+TokenBucket::take(double tokens)
+{
+    tokens_ -= tokens;
+}
+
+
+RateLimiter::RateLimiter(const RateLimits& limits)
+    : limits_(limits), admitted_(0), connRequestThrottles_(0),
+      connByteThrottles_(0), sourceRequestThrottles_(0),
+      sourceByteThrottles_(0)
+{
+    pthread_mutex_init(&lock_, NULL);
+}
+
+
+RateLimiter::~RateLimiter()
+{
+    pthread_mutex_destroy(&lock_);
+}
+
+
+void
+RateLimiter::open(int fd, const struct sockaddr_in* addr)
+{
+    uint64_t now = monotonicNs();
+
+    pthread_mutex_lock(&lock_);
+
+    if ((size_t) fd >= conns_.size())
+    {
+        conns_.resize(fd + 1);
+    }
+    conns_[fd].requests.reset(limits_.connRequests, limits_.burstSecs, now);
+    conns_[fd].bytes.reset(limits_.connBytes, limits_.burstSecs, now);
+
+    SourceBuckets& source = sources_[addr->sin_addr.s_addr];
+    if (!source.connections++)
+    {
+        source.requests.reset(limits_.sourceRequests, limits_.burstSecs, now);
+        source.bytes.reset(limits_.sourceBytes, limits_.burstSecs, now);
+    }
+
+    pthread_mutex_unlock(&lock_);
+}
+
+
+void
+RateLimiter::close(int, const struct sockaddr_in* addr)
+{
+    pthread_mutex_lock(&lock_);
+
+    std::unordered_map<uint32_t, SourceBuckets>::iterator it;
+    it = sources_.find(addr->sin_addr.s_addr);
+    if (it != sources_.end() && !--it->second.connections)
+    {
+        sources_.erase(it);
+    }
+
+    pthread_mutex_unlock(&lock_);
+}
+
+
+uint64_t
+RateLimiter::admit(int fd, const struct sockaddr_in* addr, uint32_t bytes)
+{
+    uint64_t now = monotonicNs();
+    uint64_t wait = 0;
+    uint64_t longest = 0;
+    unsigned long* reason = NULL;
+
+    pthread_mutex_lock(&lock_);
+
+    if ((size_t) fd >= conns_.size())
+    {
+        conns_.resize(fd + 1);
+    }
+    ConnBuckets& conn = conns_[fd];
+    SourceBuckets& source = sources_[addr->sin_addr.s_addr];
+
+    // every bucket is topped up, and the longest wait wins
+    if ((wait = conn.requests.wait(limits_.connRequests, limits_.burstSecs,
+                    now)) > longest)
+    {
+        longest = wait;
+        reason = &connRequestThrottles_;
+    }
+    if ((wait = conn.bytes.wait(limits_.connBytes, limits_.burstSecs,
+                    now)) > longest)
+    {
+        longest = wait;
+        reason = &connByteThrottles_;
+    }
+    if ((wait = source.requests.wait(limits_.sourceRequests,
+                    limits_.burstSecs, now)) > longest)
+    {
+        longest = wait;
+        reason = &sourceRequestThrottles_;
+    }
+    if ((wait = source.bytes.wait(limits_.sourceBytes, limits_.burstSecs,
+                    now)) > longest)
+    {
+        longest = wait;
+        reason = &sourceByteThrottles_;
+    }
+
+    if (reason)
+    {
+        (*reason)++;
+    }
+    else
+    {
+        conn.requests.take(1);
+        conn.bytes.take(bytes);
+        source.requests.take(1);
+        source.bytes.take(bytes);
+        admitted_++;
+    }
+
+    pthread_mutex_unlock(&lock_);
+    return longest;
+}
+
+
+void
+RateLimiter::printStats(std::ostream& out)
+{
+    pthread_mutex_lock(&lock_);
+
+    out << "Rate limits (0 is unlimited, " << limits_.burstSecs
+        << "s burst):\n"
+        << "\tPer connection:\t\t" << limits_.connRequests << " req/s, "
+        << limits_.connBytes << " B/s\n"
+        << "\tPer source:\t\t" << limits_.sourceRequests << " req/s, "
+        << limits_.sourceBytes << " B/s\n"
+        << "\tRequests admitted:\t" << admitted_ << "\n"
+        << "\tConn throttles:\t\t" << connRequestThrottles_ 
+        << " on requests, " << connByteThrottles_ << " on bytes\n"
+        << "\tSource throttles:\t" << sourceRequestThrottles_ 
+        << " on requests, " << sourceByteThrottles_ << " on bytes\n\n";
+
+    pthread_mutex_unlock(&lock_);
+}
+
+} // namespace dm
@@ -0,0 +1,155 @@
+#ifndef DM_RATELIMIT_HPP
+#define DM_RATELIMIT_HPP
+#include <netinet/in.h>
+#include <ostream>
+#include <pthread.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+namespace dm {
+
+/**
+ * How fast clients may go. A rate of 0 means no limit.
+ */
+struct RateLimits
+{
+    /** Requests per second on one connection. */
+    double connRequests;
+    /** Response bytes per second on one connection. */
+    double connBytes;
+    /** Requests per second from one source address, over all connections. */
+    double sourceRequests;
+    /** Response bytes per second to one source address. */
+    double sourceBytes;
+    /** How many seconds' worth of tokens an idle client can save up. */
+    double burstSecs;
+
+    RateLimits()
+        : connRequests(0), connBytes(0), sourceRequests(0), sourceBytes(0),
+          burstSecs(1)
+    {
+    }
+};
+
+/**
+ * Tokens trickle in at some rate, up to a burst. Taking more tokens than
+ * there are puts the bucket in debt, so a big response is allowed through
+ * and the client pays for it by waiting longer for the next one.
+ */
+class TokenBucket
+{
+private:
+    double tokens_;
+    /** When tokens_ was last topped up (monotonicNs()). */
+    uint64_t last_;
+
+public:
+    TokenBucket();
+
+    /**
+     * Fill the bucket to its burst.
+     *
+     * @param rate Tokens per second.
+     * @param burstSecs Seconds of tokens the bucket holds.
+     * @param now The current time (monotonicNs()).
+     */
+    void reset(double rate, double burstSecs, uint64_t now);
+
+    /**
+     * Top the bucket up and find out how long until it has a token.
+     *
+     * @param rate Tokens per second.
+     * @param burstSecs Seconds of tokens the bucket holds.
+     * @param now The current time (monotonicNs()).
+     * @return 0 if a token is available now, otherwise the nanoseconds until
+     *      there will be one.
+     */
+    uint64_t wait(double rate, double burstSecs, uint64_t now);
+
+    /**
+     * @param tokens How many tokens to take, even if there aren't that many.
+     */
+    void take(double tokens);
+};
+
+/**
+ * Per-connection and per-source-address token buckets for requests and
+ * response bytes. Clients over a limit are told how long to wait, not cut
+ * off. Safe to use from any thread.
+ */
+class RateLimiter
+{
+private:
+    struct ConnBuckets
+    {
+        TokenBucket requests;
+        TokenBucket bytes;
+    };
+
+    struct SourceBuckets
+    {
+        TokenBucket requests;
+        TokenBucket bytes;
+        /** Open connections from the source; forgotten at 0. */
+        int connections;
+    };
+
+    RateLimits limits_;
+    /** Indexed by fd. */
+    std::vector<ConnBuckets> conns_;
+    /** Keyed by IPv4 address (all unix domain clients share address 0). */
+    std::unordered_map<uint32_t, SourceBuckets> sources_;
+    pthread_mutex_t lock_;
+    unsigned long admitted_;
+    /** Requests held back by each of the four limits. */
+    unsigned long connRequestThrottles_;
+    unsigned long connByteThrottles_;
+    unsigned long sourceRequestThrottles_;
+    unsigned long sourceByteThrottles_;
+
+public:
+    /**
+     * @param limits The rates to enforce.
+     */
+    explicit RateLimiter(const RateLimits& limits);
+    ~RateLimiter();
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    /**
+     * Start limiting a new connection, with full buckets.
+     *
+     * @param fd The connection's socket.
+     * @param addr The client's address.
+     */
+    void open(int fd, const struct sockaddr_in* addr);
+
+    /**
+     * Stop limiting a connection.
+     *
+     * @param fd The connection's socket.
+     * @param addr The client's address.
+     */
+    void close(int fd, const struct sockaddr_in* addr);
+
+    /**
+     * Ask to serve a request. If every bucket has a token, the request and
+     * its response bytes are paid for.
+     *
+     * @param fd The connection's socket.
+     * @param addr The client's address.
+     * @param bytes The size of the response.
+     * @return 0 if the request may be served now, otherwise the nanoseconds
+     *      to wait before asking again.
+     */
+    uint64_t admit(int fd, const struct sockaddr_in* addr, uint32_t bytes);
+
+    /**
+     * @param out Where to write the limits and how often each one kicked in.
+     */
+    void printStats(std::ostream& out);
+};
+
+} // namespace dm
+#endif
@@ -0,0 +1,81 @@
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "samples.hpp"
+namespace po = boost::program_options;
+using namespace dm;
+
+/**
+ * Turns the sample files the client writes into response_times.csv. Several
+ * files, such as one per client machine, are merged into one CSV.
+ */
+int main(int argc, char** argv)
+{
+    std::vector<std::string> inputs;
+    std::vector<Sample> samples;
+    std::string output;
+    size_t i = 0;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("input,i", po::value<std::vector<std::string> >(&inputs),
+         "sample file to read (default response_times.bin); may be repeated")
+        ("output,o", po::value<std::string>(&output)->default_value(
+         "response_times.csv"),
+         "CSV file to write, or - for stdout")
+        ("help", "show this message")
+    ;
+    po::positional_options_description positional;
+    positional.add("input", -1);
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::command_line_parser(argc, argv).options(desc)
+                .positional(positional).run(), vm);
+        po::notify(vm);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << "\n";
+        return 0;
+    }
+    if (inputs.empty())
+    {
+        inputs.push_back("response_times.bin");
+    }
+
+    for (i = 0; i < inputs.size(); i++)
+    {
+        if (readSamples(inputs[i].c_str(), &samples) == -1)
+        {
+            perror(inputs[i].c_str());
+            return 1;
+        }
+    }
+    sortSamples(&samples);
+
+    if (output == "-")
+    {
+        writeCsv(std::cout, samples);
+        return 0;
+    }
+    std::ofstream out(output.c_str());
+    if (!out)
+    {
+        std::cerr << "unable to open \"" << output << "\"\n";
+        return 1;
+    }
+    writeCsv(out, samples);
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "samples.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+namespace dm {
+
+#define SAMPLE_MAGIC        "DMS"
+#define SAMPLE_MAGIC_LEN    3
+#define SAMPLE_VERSION      1
+/** Magic, version, then the size of a Sample as a uint32_t. */
+#define SAMPLE_HEADER_SIZE  8
+
+
+SampleBuffer::SampleBuffer(size_t expected)
+    : capacity_(expected < 1 ? 1 
+                : expected < SAMPLE_CHUNK ? expected : SAMPLE_CHUNK),
+      size_(0)
+{
+    chunks_.push_back(std::make_pair(new Sample[capacity_], 0));
+}
+
+
+SampleBuffer::~SampleBuffer()
+{
+    size_t i = 0;
+
+    for (i = 0; i < chunks_.size(); i++)
+    {
+        delete[] chunks_[i].first;
+    }
+}
+
+
+void
+SampleBuffer::copyTo(std::vector<Sample>* out) const
+{
+    size_t i = 0;
+
+    out->reserve(out->size() + size_);
+    for (i = 0; i < chunks_.size(); i++)
+    {
+        out->insert(out->end(), chunks_[i].first, 
+                    chunks_[i].first + chunks_[i].second);
+    }
+}
+
+
+/**
+ * @return True if a belongs before b.
+ */
+static bool sampleBefore(const Sample& a, const Sample& b)
+{
+    if (a.client != b.client)
+    {
+        return a.client < b.client;
+    }
+    return a.sendNs < b.sendNs;
+}
+
+
+void sortSamples(std::vector<Sample>* samples)
+{
+    std::stable_sort(samples->begin(), samples->end(), sampleBefore);
+}
+
+
+int writeSamples(const char* path, const std::vector<Sample>& samples)
+{
+    char header[SAMPLE_HEADER_SIZE];
+    uint32_t recordSize = sizeof(Sample);
+    FILE* file = NULL;
+
+    memcpy(header, SAMPLE_MAGIC, SAMPLE_MAGIC_LEN);
+    header[SAMPLE_MAGIC_LEN] = SAMPLE_VERSION;
+    memcpy(header + 4, &recordSize, sizeof(recordSize));
+
+    if (!(file = fopen(path, "wb")))
+    {
+        return -1;
+    }
+    if (fwrite(header, sizeof(header), 1, file) != 1
+            || (!samples.empty() && fwrite(&samples[0], sizeof(Sample),
+                        samples.size(), file) != samples.size()))
+    {
+        int err = errno;
+        fclose(file);
+        errno = err;
+        return -1;
+    }
+    return fclose(file) ? -1 : 0;
+}
+
+
+int readSamples(const char* path, std::vector<Sample>* samples)
+{
+    char header[SAMPLE_HEADER_SIZE];
+    uint32_t recordSize = 0;
+    Sample sample;
+    FILE* file = NULL;
+
+    if (!(file = fopen(path, "rb")))
+    {
+        return -1;
+    }
+    if (fread(header, sizeof(header), 1, file) != 1)
+    {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&recordSize, header + 4, sizeof(recordSize));
+    if (memcmp(header, SAMPLE_MAGIC, SAMPLE_MAGIC_LEN)
+            || header[SAMPLE_MAGIC_LEN] != SAMPLE_VERSION
+            || recordSize != sizeof(Sample))
+    {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (fread(&sample, sizeof(sample), 1, file) == 1)
+    {
+        samples->push_back(sample);
+    }
+    if (ferror(file))
+    {
+        int err = errno;
+        fclose(file);
+        errno = err;
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+
+void writeCsv(std::ostream& out, const std::vector<Sample>& samples)
+{
+    size_t i = 0;
+
+    out << "Thread ID,Message Count,Message Size,Seconds\n";
+    for (i = 0; i < samples.size(); i++)
+    {
+        out << samples[i].client << "," << samples[i].first << " to "
+            << samples[i].last << "," << samples[i].size << ","
+            << samples[i].ns / 1e9 << "\n";
+    }
+}
+
+} // namespace dm
@@ -0,0 +1,127 @@
+#ifndef DM_SAMPLES_HPP
+#define DM_SAMPLES_HPP
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+namespace dm {
+
+/** The most samples in each block of a SampleBuffer (128 KiB). */
+#define SAMPLE_CHUNK    4096
+
+/**
+ * The round trips of one or more requests in a row on one connection: a row
+ * of response_times.csv. Written to sample files as is, so the layout must
+ * not change without changing the file's version.
+ */
+struct Sample
+{
+    /** The client that sent the requests, from 1. */
+    uint32_t client;
+    /** The first and last requests covered, from 1. */
+    uint32_t first;
+    uint32_t last;
+    /** The size of each response. */
+    uint32_t size;
+    /** When the first request was sent, or meant to be (monotonicNs()). */
+    uint64_t sendNs;
+    /** From then until the last response arrived. */
+    uint64_t ns;
+};
+
+/**
+ * Collects one thread's samples with no locking and no copying: memory is
+ * taken in blocks, the first one up front, so that recording a sample never
+ * moves the ones before it.
+ */
+class SampleBuffer
+{
+private:
+    /** Each block and the number of samples in it. */
+    std::vector<std::pair<Sample*, size_t> > chunks_;
+    /** How many samples the last block holds. */
+    size_t capacity_;
+    size_t size_;
+
+public:
+    /**
+     * @param expected How many samples to make room for up front; at most
+     *      SAMPLE_CHUNK are.
+     * @throws bad_alloc The first block couldn't be allocated.
+     */
+    explicit SampleBuffer(size_t expected = SAMPLE_CHUNK);
+    ~SampleBuffer();
+
+    SampleBuffer(const SampleBuffer&) = delete;
+    SampleBuffer& operator=(const SampleBuffer&) = delete;
+
+    /**
+     * @param sample The sample to keep.
+     */
+    void add(const Sample& sample)
+    {
+        if (chunks_.back().second == capacity_)
+        {
+            chunks_.push_back(std::make_pair(new Sample[SAMPLE_CHUNK], 0));
+            capacity_ = SAMPLE_CHUNK;
+        }
+        chunks_.back().first[chunks_.back().second++] = sample;
+        size_++;
+    }
+
+    /**
+     * @return The number of samples kept.
+     */
+    size_t size() const
+    {
+        return size_;
+    }
+
+    /**
+     * Append every sample, oldest first.
+     *
+     * @param out Where to put them.
+     */
+    void copyTo(std::vector<Sample>* out) const;
+};
+
+/**
+ * Sort samples by client, then by when they were sent, so that each client's
+ * rows are together and in order.
+ *
+ * @param samples The samples to sort.
+ */
+void sortSamples(std::vector<Sample>* samples);
+
+/**
+ * Write samples to a binary file: a "DMS" magic, a version byte and the size
+ * of a Sample, then the samples in this machine's byte order.
+ *
+ * @param path The file to create or replace.
+ * @param samples The samples to write.
+ * @return 0 on success, or -1 on error (errno is set).
+ */
+int writeSamples(const char* path, const std::vector<Sample>& samples);
+
+/**
+ * Read a file written by writeSamples().
+ *
+ * @param path The file to read.
+ * @param samples Where to append the samples.
+ * @return 0 on success, or -1 if the file couldn't be read (errno is set) or
+ *      isn't a sample file from a machine like this one (errno is EINVAL).
+ */
+int readSamples(const char* path, std::vector<Sample>* samples);
+
+/**
+ * Write samples as the client's response_times.csv: a header line, then
+ * "client,first to last,size,seconds" for each sample.
+ *
+ * @param out Where to write them.
+ * @param samples The samples to write.
+ */
+void writeCsv(std::ostream& out, const std::vector<Sample>& samples);
+
+} // namespace dm
+#endif
@@ -1,21 +1,38 @@
 #include <arpa/inet.h>
+#include <atomic>
 #include <boost/program_options.hpp>
 #include <errno.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
 #include <event2/event.h>
 #include <event2/listener.h>
 #include <event2/thread.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
-#include <map>
+#include <openssl/err.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
 #include "badbaseexception.hpp"
+#include "allocator.hpp"
+#include "connectiontable.hpp"
+#include "connpool.hpp"
+#include "epolldriver.hpp"
 #include "eventbase.hpp"
+#include "histogram.hpp"
+#include "jobpool.hpp"
+#include "loopqueue.hpp"
 #include "network.hpp"
+#include "notifier.hpp"
+#include "protocol.hpp"
+#include "ratelimit.hpp"
+#include "tls.hpp"
 #include "tpool.h"
 namespace po = boost::program_options;
 using namespace dm;
@@ -24,13 +41,50 @@ using namespace dm;
 #define DFLT_QUEUE      4096
 #define DFLT_PORT       32000
 #define LISTEN_BACKLOG  65535
+#define DFLT_POOL_CONNS 1024
+#define DFLT_POOL_MB    64
+/** Socket buffer size for UDP, so bursts of datagrams aren't dropped. */
+#define DGRAM_BUFSIZE   (4 << 20)
+/** Drop a client that stalls for this long in the middle of a handshake. */
+#define TLS_HANDSHAKE_SECS  10
+/** The most responses to one connection that workers build at once. */
+#define MAX_IN_FLIGHT       64
+/** Read-ahead per connection in coroutine mode. Small, as there may be tens
+ * of thousands of connections. */
+#define CORO_READ_AHEAD     4096
+/** How long to stop accepting for after accept() fails (out of fds, say). */
+#define ACCEPT_RETRY_NS     10000000
 
-struct client
+/**
+ * What readSock() does when the thread pool's queue is full.
+ */
+enum OverloadPolicy
+{
+    /** Block the event loop until a worker frees a slot. */
+    OVERLOAD_BLOCK,
+    /** Stop reading from the connection until a worker frees a slot. */
+    OVERLOAD_PAUSE,
+    /** Answer the request immediately with an error reply. */
+    OVERLOAD_SHED
+};
+
+/**
+ * A response built by a worker in handoff mode, on its way back to the event
+ * loop. The payload follows the struct in the same allocation.
+ */
+struct response : public LoopMessage
 {
-    std::string hostName;
-    int port;
-    int requestsRecv;
-    unsigned long dataSent;
+    /** The connection the response is for. */
+    evutil_socket_t fd;
+    /** The connection's generation, in case the fd has been reused since. */
+    uint32_t generation;
+    /** When the loop picked up the request (monotonicNs()). */
+    uint64_t start;
+    /** Header plus payload. */
+    uint32_t size;
+    char* data;
+    /** The size of the block the response lives in. */
+    size_t capacity;
 };
 
 
@@ -39,24 +93,83 @@ struct client
  *
  * @author Dean Morin
  * @param method The desired event method to use.
+ * @param options How to configure the event base.
  * @return The initialized event base. This is heap allocated and so the caller
  *      must call delete on it later.
  */
-EventBase* initlibEvent(const char* method);
-evutil_socket_t listenSock(const int port);
+EventBase* initlibEvent(const char* method, const EventBaseOptions& options);
 void runServer(EventBase* eb, const int port, const int numWorkerThreads, 
-        const int maxQueueSize);
+        const int maxQueueSize, const OverloadPolicy overload,
+        const bool handoff, const int poolConns, const std::string& unixPath,
+        const bool udp);
 void runServerTh(const int port, const int numWorkerThreads, 
-        const int maxQueueSize);
+        const int maxQueueSize, const std::string& unixPath, const bool udp);
+
+/**
+ * Serve each connection with a coroutine that reads like readSockTh(), but
+ * waits on an epoll loop instead of holding a thread. Each of numThreads
+ * threads runs its own loop and accepts its own share of the connections.
+ *
+ * @param port The port to listen on, for IPv4.
+ * @param numThreads The number of loop threads.
+ * @param unixPath Where to listen instead, or "" for IPv4.
+ */
+void runServerCo(const int port, const int numThreads,
+        const std::string& unixPath);
 void updateClientStats(evutil_socket_t fd, int data);
+void setUpSocket(evutil_socket_t fd);
+
+/**
+ * Fill in the address to listen on: a unix domain socket at path, or port on
+ * every IPv4 interface if path is empty. A socket file left at path by an
+ * earlier run is removed.
+ *
+ * @param addr The address to fill in.
+ * @param port The port to listen on, for IPv4.
+ * @param path Where to create the unix domain socket, or "" for IPv4.
+ * @return The length of the address.
+ */
+socklen_t serverAddress(struct sockaddr_storage* addr, const int port,
+        const std::string& path);
+
+/**
+ * Create a UDP socket bound to addr.
+ *
+ * @param addr The address to bind to.
+ * @param len The length of addr.
+ * @return The socket.
+ */
+evutil_socket_t bindDatagram(const struct sockaddr* addr, socklen_t len);
+
+/**
+ * Answer one batch of requests waiting on a UDP socket. Each response is a
+ * packet of random characters split into datagrams of at most MAX_DATAGRAM
+ * bytes, sent back up to DATAGRAM_BATCH datagrams per system call.
+ *
+ * @param fd The UDP socket.
+ * @param flags MSG_DONTWAIT to return straight away if nothing is waiting, or
+ *      MSG_WAITFORONE to block until the first request arrives.
+ * @return The number of requests answered, or -1 on error.
+ */
+int serveDatagrams(evutil_socket_t fd, int flags);
+
+/**
+ * @return The number of bytes of memory the process has resident (the peak
+ *      value on systems without /proc).
+ */
+size_t residentBytes();
 
 /**
  * Increment the count of connected clients. Thread safe.
  * 
  * @author Dean Morin
- * @param sa The address info on the new connection.
+ * @param fd The new connection's socket.
+ * @param sa The address info on the new connection. Only IPv4 addresses are
+ *      kept; for anything else just the family is recorded.
+ * @return The connection's entry in the connection table, or NULL if the fd
+ *      doesn't fit in the table (in which case fd has been closed).
  */
-void incrementClients(evutil_socket_t fd, struct sockaddr_in* sa);
+ConnectionEntry* incrementClients(evutil_socket_t fd, struct sockaddr* sa);
 
 /**
  * Decrement the count of connected clients. Thread safe.
@@ -68,9 +181,68 @@ void decrementClients(evutil_socket_t fd);
 
 pthread_mutex_t clientMutex;
 pthread_mutex_t jobMutex;
-int clientCount;
-int maxClientCount;
-std::map<evutil_socket_t, struct client> clients;
+ConnectionTable* connections = NULL;
+/** Resident memory before any connections were accepted. */
+size_t baselineRss = 0;
+tPool* pool = NULL;
+OverloadPolicy overloadPolicy = OVERLOAD_PAUSE;
+Notifier* overloadNotifier = NULL;
+/** Connections that stopped reading because the pool's queue was full. Only
+ * touched by the event loop thread. */
+std::vector<struct bufferevent*> paused;
+unsigned long overloadPauses = 0;
+unsigned long overloadSheds = 0;
+/** Responses built by workers in handoff mode, waiting for the loop. */
+LoopQueue* responses = NULL;
+JobPool<>* jobs = NULL;
+unsigned long staleResponses = 0;
+/** Recycled bufferevents. Only touched by the loop thread. */
+BuffereventPool* bevPool = NULL;
+/** Recycled payload buffers. */
+BufferPool* buffers = NULL;
+/** The unix domain socket being listened on, if any, to remove at exit. */
+std::string socketPath;
+/** Set when serving over UDP. The counters are only touched by the thread
+ * reading the socket. */
+bool datagrams = false;
+unsigned long datagramRequests = 0;
+unsigned long datagramsSent = 0;
+unsigned long recvBatches = 0;
+unsigned long sendBatches = 0;
+/** Microseconds to busy poll each socket for; 0 means sleep as usual. */
+int busyPollUsec = 0;
+/** Passes made by the spinning event loop in busy poll mode. */
+unsigned long loopPasses = 0;
+/** Time from the server picking up a request to the response being queued
+ * for sending (or sent, without libevent). The loop has already woken up by
+ * then, so this doesn't show what --busy-poll saves. */
+LatencyHistogram* turnaround = NULL;
+/** Time spent taking in each connection (from it being accepted to it being
+ * ready for requests) and cleaning up after each one that closed. */
+LatencyHistogram* connectionSetup = NULL;
+LatencyHistogram* connectionTeardown = NULL;
+std::atomic<unsigned long> acceptedConnections(0);
+/** Set when connections are encrypted. */
+TlsContext* tls = NULL;
+std::atomic<unsigned long> tlsHandshakes(0);
+std::atomic<unsigned long> tlsFailures(0);
+/** Connections where the kernel took over encryption or decryption. */
+std::atomic<unsigned long> kernelSends(0);
+std::atomic<unsigned long> kernelRecvs(0);
+/** Set when clients are rate limited. */
+RateLimiter* limiter = NULL;
+/** Requests in the compact format, and how many of those were handed to a
+ * worker while another response to the same connection was being built. */
+std::atomic<unsigned long> compactRequests(0);
+std::atomic<unsigned long> overlappedRequests(0);
+/** Clients dropped for speaking a protocol version we don't. */
+std::atomic<unsigned long> badRequests(0);
+/** Reads from the socket and requests read, over the threaded and coroutine
+ * servers' connections. */
+std::atomic<unsigned long> readerCalls(0);
+std::atomic<unsigned long> readerRequests(0);
+/** One per loop thread in coroutine mode. */
+std::vector<EpollDriver*> drivers;
 
 /**
  * A server intended to test the differences in efficiency between the various
@@ -86,6 +258,9 @@ int main(int argc, char** argv)
     int queue = 0;
     EventBase* eb = NULL;
     std::string method = "";
+    std::string overload = "";
+    std::string unixPath = "";
+    bool udp = false;
 
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -94,12 +269,60 @@ int main(int argc, char** argv)
         ("select,s", "use select()")
         ("poll,p", "use poll()")
         ("threads,t", "use threads")
+        ("coroutines,C", "use a coroutine per connection, on an epoll loop "
+                "per pool thread")
         ("port,P", po::value<int>(&opt)->default_value(DFLT_PORT),
                 "port to listen on")
+        ("unix,u", po::value<std::string>(), 
+                "listen on a unix domain socket at this path instead of TCP")
+        ("udp", "answer requests over UDP instead of TCP")
+        ("busy-poll", po::value<int>(&opt)->default_value(0),
+                "busy poll sockets for this many usec and spin the event "
+                "loop instead of sleeping (0 to disable)")
+        ("tls", "encrypt connections with TLS, offloaded to the kernel "
+                "(kTLS) where possible")
+        ("cert", po::value<std::string>()->default_value(TLS_CERT_FILE),
+                "certificate for --tls ('make cert' makes one)")
+        ("key", po::value<std::string>()->default_value(TLS_KEY_FILE),
+                "private key for --tls")
+        ("limit-conn-rps", po::value<double>()->default_value(0),
+                "max requests per second on one connection (0 for no limit)")
+        ("limit-conn-bytes", po::value<double>()->default_value(0),
+                "max response bytes per second on one connection")
+        ("limit-ip-rps", po::value<double>()->default_value(0),
+                "max requests per second from one client address")
+        ("limit-ip-bytes", po::value<double>()->default_value(0),
+                "max response bytes per second to one client address")
+        ("limit-burst", po::value<double>()->default_value(1),
+                "seconds' worth of requests and bytes an idle client can "
+                "save up")
         ("thread-pool,T", po::value<int>(&opt)->default_value(DFLT_THREADS),
                 "number of threads in the thread pool")
         ("max-queue,M", po::value<int>(&opt)->default_value(DFLT_QUEUE),
                 "max number of jobs in the pool queue")
+        ("overload,O", po::value<std::string>()->default_value("pause"),
+                "when the pool queue is full: block, pause (stop reading "
+                "until there's room) or shed (reply with an error)")
+        ("handoff,H", "workers hand responses back to the event loop, "
+                "so libevent runs without locks")
+        ("no-cache-time", "check the time on every callback")
+        ("epoll-changelist", "batch epoll_ctl() changes until dispatch")
+        ("max-dispatch-ms", po::value<int>(&opt)->default_value(-1),
+                "check for events after running callbacks this long")
+        ("max-dispatch-callbacks", po::value<int>(&opt)->default_value(-1),
+                "check for events after running this many callbacks")
+        ("min-priority", po::value<int>(&opt)->default_value(0),
+                "the max dispatch limits only apply from this priority down")
+        ("priorities", po::value<int>(&opt)->default_value(1),
+                "number of event priorities")
+        ("require-et", "only use an event method that is edge-triggered")
+        ("require-o1", "only use an event method with O(1) operations")
+        ("pool-conns", po::value<int>(&opt)->default_value(DFLT_POOL_CONNS),
+                "max idle bufferevents to keep for new connections")
+        ("pool-buffer-mb", po::value<int>(&opt)->default_value(DFLT_POOL_MB),
+                "max MiB of idle payload buffers to keep")
+        ("system-malloc", "allocate with malloc() instead of per-thread "
+                "size classes")
         ("help", "show this message")
     ;
 
@@ -119,6 +342,68 @@ int main(int argc, char** argv)
     port = vm["port"].as<int>();
     threads = vm["thread-pool"].as<int>();
     queue = vm["max-queue"].as<int>();
+    overload = vm["overload"].as<std::string>();
+    udp = vm.count("udp");
+    busyPollUsec = vm["busy-poll"].as<int>();
+    if (vm.count("unix"))
+    {
+        unixPath = vm["unix"].as<std::string>();
+    }
+
+    if (udp && !unixPath.empty())
+    {
+        std::cerr << "Error: --unix and --udp can't be used together\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (vm.count("coroutines") && (udp || vm.count("tls")))
+    {
+        std::cerr << "Error: --coroutines serves plain stream connections\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+    if (udp && vm.count("tls"))
+    {
+        std::cerr << "Error: --tls needs a stream transport, not --udp\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
+
+    if (vm.count("tls"))
+    {
+        try
+        {
+            tls = new TlsContext(true, vm["cert"].as<std::string>().c_str(),
+                    vm["key"].as<std::string>().c_str());
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Error loading the TLS certificate and key\n";
+            std::cerr << "\trun 'make cert' to make a self-signed one\n";
+            return 1;
+        }
+        // OpenSSL writes to sockets without MSG_NOSIGNAL
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (!overload.compare("block"))
+    {
+        overloadPolicy = OVERLOAD_BLOCK;
+    }
+    else if (!overload.compare("pause"))
+    {
+        overloadPolicy = OVERLOAD_PAUSE;
+    }
+    else if (!overload.compare("shed"))
+    {
+        overloadPolicy = OVERLOAD_SHED;
+    }
+    else
+    {
+        std::cerr << "Error: unknown overload policy \"" << overload << "\"\n";
+        std::cerr << "\tuse --help to see program options\n";
+        return 1;
+    }
     
     if (pthread_mutex_init(&clientMutex, NULL))
     {
@@ -130,8 +415,33 @@ int main(int argc, char** argv)
         std::cerr << "Error creating mutex\n";
         exit(1);
     }
-    clientCount = 0;
-    maxClientCount = 0;
+    memUseSizeClasses(!vm.count("system-malloc"));
+    turnaround = new LatencyHistogram();
+    connectionSetup = new LatencyHistogram();
+    connectionTeardown = new LatencyHistogram();
+
+    RateLimits limits;
+    limits.connRequests = vm["limit-conn-rps"].as<double>();
+    limits.connBytes = vm["limit-conn-bytes"].as<double>();
+    limits.sourceRequests = vm["limit-ip-rps"].as<double>();
+    limits.sourceBytes = vm["limit-ip-bytes"].as<double>();
+    limits.burstSecs = vm["limit-burst"].as<double>();
+    if (limits.connRequests || limits.connBytes || limits.sourceRequests
+        || limits.sourceBytes)
+    {
+        limiter = new RateLimiter(limits);
+    }
+    buffers = new BufferPool((size_t) vm["pool-buffer-mb"].as<int>() << 20);
+
+    try
+    {
+        connections = new ConnectionTable();
+    }
+    catch (const std::bad_alloc&)
+    {
+        std::cerr << "Error reserving the connection table\n";
+        exit(1);
+    }
     
     if (vm.count("help"))
     {
@@ -154,10 +464,14 @@ int main(int argc, char** argv)
     {
         method = "poll";
     }
+    else if (vm.count("coroutines"))
+    {
+        runServerCo(port, threads, unixPath);
+    }
     else if (vm.count("threads"))
     {
         // run server with threads
-        runServerTh(port, threads, queue);
+        runServerTh(port, threads, queue, unixPath, udp);
     }
     else
     {
@@ -168,19 +482,39 @@ int main(int argc, char** argv)
     if (method.compare(""))
     {
         // run server with libevent and the specified event base
-        eb = initlibEvent(method.c_str());
-        runServer(eb, port, threads, queue);
+        bool handoff = vm.count("handoff");
+        EventBaseOptions options;
+
+        options.threadSafe = !handoff;
+        options.noCacheTime = vm.count("no-cache-time");
+        options.epollChangelist = vm.count("epoll-changelist");
+        options.maxDispatchMsec = vm["max-dispatch-ms"].as<int>();
+        options.maxDispatchCallbacks = vm["max-dispatch-callbacks"].as<int>();
+        options.minPriority = vm["min-priority"].as<int>();
+        options.priorities = vm["priorities"].as<int>();
+        options.requireEdgeTriggered = vm.count("require-et");
+        options.requireO1 = vm.count("require-o1");
+        options.sizeClassAllocator = !vm.count("system-malloc");
+
+        eb = initlibEvent(method.c_str(), options);
+        if (busyPollUsec)
+        {
+            std::cout << "Busy polling for " << busyPollUsec 
+                      << " usec, event loop spinning\n";
+        }
+        runServer(eb, port, threads, queue, overloadPolicy, handoff,
+                vm["pool-conns"].as<int>(), unixPath, udp);
     }
     return 0;
 }
 
 
-EventBase* initlibEvent(const char* method)
+EventBase* initlibEvent(const char* method, const EventBaseOptions& options)
 {
     try
     {
-        EventBase* eb = new EventBase(method);
-        std::cout << "Using: " << eb->getMethod() << "\n";
+        EventBase* eb = new EventBase(method, options);
+        eb->printConfig(std::cout);
         return eb;
     }
     catch (const BadBaseException& e)
@@ -189,6 +523,10 @@ EventBase* initlibEvent(const char* method)
         const char** methods = EventBase::getAvailableMethods();
 
         std::cerr << "Error: " << e.what() << "\n";
+        if (options.requireEdgeTriggered || options.requireO1)
+        {
+            std::cerr << "\t(or it lacks the required features)\n";
+        }
         std::cerr << "\tThe available event bases are:\n";
 
         for (i = 0; methods[i] != NULL; i++)
@@ -205,6 +543,81 @@ EventBase* initlibEvent(const char* method)
 }
 
 
+size_t residentBytes()
+{
+#ifdef __linux__
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+
+    if (statm)
+    {
+        if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#endif
+}
+
+/**
+ * Display how much memory each connection costs, measured from the growth in
+ * resident memory since startup, and what that projects to for large numbers
+ * of idle connections. Kernel socket buffers aren't included.
+ */
+void printMemoryReport()
+{
+    static const size_t projections[] = { 10000, 100000, 1000000 };
+
+    pthread_mutex_lock(&clientMutex);
+    size_t count = connections->count();
+    size_t table = connections->committedBytes();
+    pthread_mutex_unlock(&clientMutex);
+
+    size_t rss = residentBytes();
+    size_t growth = rss > baselineRss ? rss - baselineRss : 0;
+
+    std::cout << "Memory:\n"
+              << "\tConnections:\t\t" << count << "\n"
+              << "\tResident:\t\t" << rss << " bytes (+" << growth
+              << " since startup)\n"
+              << "\tTable entry:\t\t" << sizeof(ConnectionEntry) 
+              << " bytes (" << table << " committed)\n";
+
+    if (count)
+    {
+        size_t perConnection = growth / count;
+        std::cout << "\tPer connection:\t\t" << perConnection << " bytes\n";
+
+        for (size_t i = 0; i < sizeof(projections) / sizeof(size_t); i++)
+        {
+            std::cout << "\t" << projections[i] << " idle connections:\t"
+                      << (baselineRss + perConnection * projections[i]) 
+                          / (1024 * 1024)
+                      << " MiB\n";
+        }
+    }
+    std::cout << "\n";
+    memPrintStats(std::cout);
+}
+
+/**
+ * Display the memory report on SIGUSR1, so it can be taken while clients are
+ * connected. Called from the event loop or the SIGUSR1 thread, never from a
+ * signal handler, since it takes clientMutex and writes to std::cout.
+ */
+void reportMemory(int)
+{
+    printMemoryReport();
+    std::cout.flush();
+}
+
 /**
  * Display the maximum number of clients that were connected at one time, then
  * shut down the server. Initiated by ctrl-c.
@@ -213,25 +626,109 @@ EventBase* initlibEvent(const char* method)
  */
 void shutDown(int)
 {
-    std::cout << "\nHighest number of simultaneous connections: " 
-              << maxClientCount << "\n\n";
-
     pthread_mutex_lock(&clientMutex);
 
+    std::cout << "\nHighest number of simultaneous connections: " 
+              << connections->highWater() << "\n\n";
+
     std::cout << "Clients still connected: \n\n";
+    connections->printConnections(std::cout);
+
+    pthread_mutex_unlock(&clientMutex);
 
-    std::map<evutil_socket_t, struct client>::iterator it;
-    for (it = clients.begin(); it != clients.end(); ++it)
+    printMemoryReport();
+
+    if (bevPool)
     {
-        struct client c = it->second;
-        std::cout << "\tHost name:\t\t" << c.hostName << "\n"
-                  << "\tPort:\t\t\t" << c.port << "\n"
-                  << "\tRequests received:\t" << c.requestsRecv << "\n"
-                  << "\tData sent:\t\t" << c.dataSent << "\n\n";
+        bevPool->printStats(std::cout);
     }
+    buffers->printStats(std::cout);
 
-    pthread_mutex_unlock(&clientMutex);
+    turnaround->print(std::cout, 
+            busyPollUsec ? "Turnaround, busy poll" : "Turnaround, dispatch");
+    if (acceptedConnections)
+    {
+        std::cout << "Connections accepted:\t\t" << acceptedConnections 
+                  << "\n";
+        connectionSetup->print(std::cout, "Connection setup");
+        connectionTeardown->print(std::cout, "Connection teardown");
+    }
+    if (loopPasses)
+    {
+        std::cout << "Loop passes:\t\t\t" << loopPasses << "\n";
+    }
+    if (!drivers.empty())
+    {
+        unsigned long wakeups = 0;
+        unsigned long resumes = 0;
+        for (size_t i = 0; i < drivers.size(); i++)
+        {
+            wakeups += drivers[i]->wakeups();
+            resumes += drivers[i]->resumes();
+        }
+        std::cout << "Coroutine loops:\t\t" << drivers.size() << " threads, "
+                  << resumes << " resumes in " << wakeups << " wakeups\n";
+    }
+    if (readerRequests)
+    {
+        std::cout << "Socket reads:\t\t\t" << readerCalls << " for "
+                  << readerRequests << " requests\n";
+    }
+    std::cout << "\n";
+
+    if (limiter)
+    {
+        limiter->printStats(std::cout);
+    }
+
+    if (compactRequests || badRequests)
+    {
+        std::cout << "Compact protocol:\n"
+                  << "\tRequests:\t\t" << compactRequests << "\n"
+                  << "\tBuilt in parallel:\t" << overlappedRequests << "\n"
+                  << "\tBad versions:\t\t" << badRequests << "\n\n";
+    }
+
+    if (tls)
+    {
+        std::cout << "TLS:\n"
+                  << "\tHandshakes:\t\t" << tlsHandshakes << " ("
+                  << tlsFailures << " failed)\n"
+                  << "\tKernel send / recv:\t" << kernelSends << " / "
+                  << kernelRecvs << " connections\n\n";
+    }
+
+    if (datagrams)
+    {
+        std::cout << "Datagrams:\n"
+                  << "\tRequests:\t\t" << datagramRequests << "\n"
+                  << "\tDatagrams sent:\t\t" << datagramsSent << "\n"
+                  << "\tRequests per recv:\t" 
+                  << (recvBatches ? (double) datagramRequests / recvBatches : 0)
+                  << "\n"
+                  << "\tDatagrams per send:\t"
+                  << (sendBatches ? (double) datagramsSent / sendBatches : 0)
+                  << "\n\n";
+    }
 
+    if (pool)
+    {
+        std::cout << "Overload:\n"
+                  << "\tReads paused:\t\t" << overloadPauses << "\n"
+                  << "\tRequests shed:\t\t" << overloadSheds << "\n\n";
+        if (responses)
+        {
+            std::cout << "Stale responses dropped:\t" << staleResponses 
+                      << "\n\n";
+        }
+        std::cout.flush();
+        tPoolPrintStats(pool, stdout);
+    }
+
+    if (!socketPath.empty())
+    {
+        unlink(socketPath.c_str());
+    }
 	exit(0);
 }
 
@@ -239,21 +736,43 @@ void shutDown(int)
  * When ctrl-c is pressed and libevent is being used, this function frees the
  * listen socket, then calls shutDown().
  *
- * @param arg The struct responsible for the listening socket.
+ * @param arg The struct responsible for the listening socket, or NULL when
+ *      serving over UDP.
  * @author Dean Morin
  */
 void handleSigint(evutil_socket_t, short, void* arg)
 {
-    evconnlistener_free((struct evconnlistener*) arg);
+    if (arg)
+    {
+        evconnlistener_free((struct evconnlistener*) arg);
+    }
     shutDown(0);
 }
 
-void cancelJobs(tPool* tpool, struct bufferevent* bev)
+/**
+ * When SIGUSR1 is received and libevent is being used, display the memory
+ * report.
+ */
+void handleSigusr1(evutil_socket_t, short, void*)
+{
+    reportMemory(0);
+}
+
+/**
+ * Stop the queued jobs for a connection from doing anything. Jobs a worker
+ * has already taken off the queue aren't affected.
+ *
+ * @param tpool The pool the jobs were added to.
+ * @param bev The connection that closed.
+ * @return The number of jobs cancelled.
+ */
+int cancelJobs(tPool* tpool, struct bufferevent* bev)
 {
     pthread_mutex_lock(&tpool->queueLock);
 
     tPoolJob* currentJob = tpool->queueHead;
     struct bufferevent* currentBev;
+    int cancelled = 0;
 
     while(currentJob != NULL)
     {
@@ -261,171 +780,1350 @@ void cancelJobs(tPool* tpool, struct bufferevent* bev)
         if (currentBev == bev)
         {
             currentJob->arg = NULL;
+            cancelled++;
         }
         currentJob = currentJob->next;
     }
 
     pthread_mutex_unlock(&tpool->queueLock);
+    return cancelled;
 }
 
-static void sockEvent(struct bufferevent* bev, short events, void* arg)
+/**
+ * Forget about a connection that was paused by the overload policy.
+ *
+ * @param bev The connection that is being freed.
+ */
+static void unpause(struct bufferevent* bev)
 {
-    if (events & BEV_EVENT_ERROR)
+    ConnectionEntry* conn = connections->get(bufferevent_getfd(bev));
+    std::vector<struct bufferevent*>::iterator it;
+
+    if (!conn || !conn->paused)
     {
-        perror("Error from bufferevent");
+        return;
     }
-    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) 
+    conn->paused = 0;
+    for (it = paused.begin(); it != paused.end(); ++it)
     {
-        decrementClients(bufferevent_getfd(bev));
-
-        pthread_mutex_lock(&jobMutex);
-
-        cancelJobs((tPool*)arg, bev);
-        bufferevent_free(bev);
-
-        pthread_mutex_unlock(&jobMutex);
+        if (*it == bev)
+        {
+            paused.erase(it);
+            break;
+        }
     }
 }
 
-void handleRequest(void* args)
+/**
+ * Put a finished connection's bufferevent back in the pool, and end its TLS
+ * session if it has one. A bufferevent doing its own encryption can't be
+ * reused, so it is freed along with the session.
+ *
+ * @param bev The bufferevent of a connection that is done.
+ */
+static void releaseConnection(struct bufferevent* bev)
 {
-    pthread_mutex_lock(&jobMutex);
-    if (!args)
+    ConnectionEntry* conn = connections->get(bufferevent_getfd(bev));
+    SSL* ssl = conn ? conn->ssl : NULL;
+
+    if (conn)
     {
-        // bufferevent has been freed; this is a stale job
-        pthread_mutex_unlock(&jobMutex);
-        return;
+        conn->ssl = NULL;
     }
-
-    struct bufferevent* bev = (struct bufferevent*) args;
-    evutil_socket_t fd = bufferevent_getfd(bev);
-
-    struct evbuffer *input = bufferevent_get_input(bev);
-    struct evbuffer *output = bufferevent_get_output(bev);
-    uint32_t msgSize;
-
-    if (evbuffer_copyout(input, &msgSize, sizeof(uint32_t)) == -1)
+    if (ssl && bufferevent_openssl_get_ssl(bev))
     {
-        std::cerr << "Error: evbuffer_copyout\n";
+        // closes the socket and frees the session
+        bufferevent_free(bev);
+        return;
     }
-
-    char* buf = new char[msgSize];
-
-    // fill the packet with random characters
-    for (size_t i = 0; i < msgSize; i++)
+    bevPool->put(bev);
+    if (ssl)
     {
-        buf[i] = rand() % 93 + 33;
+        SSL_free(ssl);
     }
-    evbuffer_add(output, buf, msgSize);
-
-    pthread_mutex_unlock(&jobMutex);
+}
 
-    updateClientStats(fd, msgSize);
-    delete[] buf;
+/**
+ * Release a closed connection that a worker was still running a job for,
+ * once that job is done. Nothing else can use it by then: its other jobs
+ * were cancelled and reading stopped when it closed.
+ *
+ * @param arg The connection's bufferevent.
+ */
+static void releaseClosed(evutil_socket_t, short, void* arg)
+{
+    releaseConnection((struct bufferevent*) arg);
 }
 
-static void readSock(struct bufferevent* bev, void* arg)
+/**
+ * Count a pool job as finished. The last job for a connection that has
+ * closed hands the release to the event loop, which closeConnection() left
+ * for it. jobMutex must be held.
+ *
+ * @param bev The connection the job was for.
+ * @param conn The connection's entry.
+ */
+static void endJob(struct bufferevent* bev, ConnectionEntry* conn)
 {
-    if (tPoolAddJob((tPool*) arg, handleRequest, bev))
+    if (conn && !--conn->jobs && !conn->inUse)
     {
-        std::cerr << "Error adding new job to thread pool\n";
-        exit(1);
+        event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT,
+                releaseClosed, bev, NULL);
     }
 }
 
-static void acceptErr(struct evconnlistener* listener, void*)
+/**
+ * Cancel a closed connection's queued jobs and release it, unless a worker
+ * has already taken one of its jobs off the queue; endJob() releases it when
+ * that job is done. The fd stays open until then, so it can't be handed to
+ * a new client in the meantime.
+ *
+ * @param arg The connection's bufferevent.
+ */
+static void closeConnection(evutil_socket_t, short, void* arg)
 {
-    struct event_base *base = evconnlistener_get_base(listener);
-    int err = EVUTIL_SOCKET_ERROR();
-    std::cerr << "Error " << err << "(" << evutil_socket_error_to_string(err)
-              << ") on listening socket. Shutting down.\n";
-    event_base_loopexit(base, NULL);
-}
+    struct bufferevent* bev = (struct bufferevent*) arg;
+    ConnectionEntry* conn = connections->get(bufferevent_getfd(bev));
+    uint64_t start = monotonicNs();
 
-static void acceptClient(struct evconnlistener* listener, evutil_socket_t fd,
-        struct sockaddr* sa, int, void* arg)
-{
-    incrementClients(fd, (sockaddr_in*) sa);
+    // under jobMutex, so a worker that sees the entry closed knows this has
+    // already decided not to release it
+    pthread_mutex_lock(&jobMutex);
 
-    struct event_base* base = evconnlistener_get_base(listener);
-    struct bufferevent* bev = bufferevent_socket_new(base, fd, 
-            BEV_OPT_CLOSE_ON_FREE);
+    decrementClients(bufferevent_getfd(bev));
+    int cancelled = cancelJobs(pool, bev);
+    if (conn)
+    {
+        conn->jobs -= cancelled;
+    }
+    if (!conn || !conn->jobs)
+    {
+        releaseConnection(bev);
+    }
 
-    bufferevent_setcb(bev, readSock, NULL, sockEvent, arg);
-    bufferevent_enable(bev, EV_READ | EV_WRITE); 
+    pthread_mutex_unlock(&jobMutex);
+    connectionTeardown->record(monotonicNs() - start);
 }
 
-void runServer(EventBase* eb, const int port, const int numWorkerThreads,
-        const int maxQueueSize) 
+static void sockEvent(struct bufferevent* bev, short events, void*)
 {
-	struct sockaddr_in addr;
-    struct evconnlistener* listener;
-
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    tPool* pool = NULL;
-    int blockWhenQueueFull = 1;
-
-    if (tPoolInit(&pool, numWorkerThreads, maxQueueSize, blockWhenQueueFull))
+    if (events & BEV_EVENT_ERROR)
     {
-        std::cerr << "Error initializing thread pool\n";
-        exit(1);
+        perror("Error from bufferevent");
     }
-
-    if (!(listener = evconnlistener_new_bind(eb->getBase(), acceptClient, pool, 
-            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, LISTEN_BACKLOG, 
-            (struct sockaddr*) &addr, sizeof(addr))))
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) 
     {
-        exit(sockError("evconnlistener_new_bind()", 0));
-    }
-    evconnlistener_set_error_cb(listener, acceptErr);
-
-    struct event* sigint;
-    sigint = evsignal_new(eb->getBase(), SIGINT, handleSigint, listener);
-    evsignal_add(sigint, NULL);
+        unpause(bev);
 
-    event_base_dispatch(eb->getBase());
-    event_del(sigint);
+        // bev is locked while this runs, and a worker holding jobMutex may be
+        // waiting for it, so the rest is left until the callback returns
+        bufferevent_disable(bev, EV_READ | EV_WRITE);
+        event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, 
+                closeConnection, bev, NULL);
+    }
 }
 
 /**
- * Read message from fd, the return a packet of random characters.
- * @param args The socket to read from / write to.
- * @author Dean Morin
+ * Decode the request at the front of a connection's input buffer, without
+ * removing it.
+ *
+ * @param input The connection's input buffer.
+ * @param req Where to put the request.
+ * @return The number of bytes the request takes up, 0 if it hasn't all
+ *      arrived yet, or -1 if the client speaks a version we don't.
  */
-void readSockTh(void* args)
+static int peekRequest(struct evbuffer* input, struct Request* req)
 {
-    evutil_socket_t* fd = (evutil_socket_t*) args;
-    char readBuf[REQUEST_SIZE];
-    uint32_t msgSize;
+    char head[MAX_REQUEST_SIZE];
+    size_t len = evbuffer_get_length(input);
 
-    while (clearSocket(*fd, readBuf, REQUEST_SIZE) != -1)
+    if (len > sizeof(head))
     {
-        msgSize = ((readBuf[3] << 24) & 0xFF000000)
-                + ((readBuf[2] << 16) & 0x00FF0000)
-                + ((readBuf[1] <<  8) & 0x0000FF00)
-                + ( readBuf[0]        & 0x000000FF);
-
-        char* writeBuf = new char[msgSize];
+        len = sizeof(head);
+    }
+    evbuffer_copyout(input, head, len);
+    return parseRequest(head, len, req);
+}
 
-        // fill the packet with random characters
-        for (size_t i = 0; i < msgSize; i++)
+/**
+ * Hang up on a client that sent a request we can't decode. Only the socket is
+ * shut down, so the connection is cleaned up by its event callback as usual.
+ *
+ * @param fd The client's socket.
+ */
+static void rejectClient(evutil_socket_t fd)
+{
+    if (!badRequests++)
+    {
+        std::cerr << "Error: client sent a request we can't decode\n";
+    }
+    shutdown(fd, SHUT_RDWR);
+}
+
+/**
+ * Fill a response: the header, if req has one, then req.size random
+ * characters.
+ *
+ * @param buf Where to build it; responseHeaderSize(req) + req.size bytes.
+ * @param req The request being answered.
+ */
+static void fillResponse(char* buf, const struct Request& req)
+{
+    char* payload = buf + writeResponseHeader(buf, req);
+
+    // fill the packet with random characters
+    for (size_t i = 0; i < req.size; i++)
+    {
+        payload[i] = rand() % 93 + 33;
+    }
+}
+
+/**
+ * Runs when a throttled connection has waited long enough. Starts reading
+ * again, unless the connection has closed since or is paused by the overload
+ * policy (in which case resumeReading() will get to it).
+ *
+ * @param arg The connection's fd and generation, from throttle().
+ */
+static void endThrottle(evutil_socket_t, short, void* arg)
+{
+    std::pair<evutil_socket_t, uint32_t>* id 
+            = (std::pair<evutil_socket_t, uint32_t>*) arg;
+    ConnectionEntry* conn = connections->get(id->first);
+
+    if (!conn || !conn->inUse || conn->generation != id->second)
+    {
+        delete id;
+        return;
+    }
+    conn->throttled = 0;
+
+    if (conn->bev && !conn->paused)
+    {
+        bufferevent_enable(conn->bev, EV_READ);
+        bufferevent_trigger(conn->bev, EV_READ, 0);
+    }
+    delete id;
+}
+
+/**
+ * Stop reading from a client that's over its rate limit until it's allowed
+ * another request. Safe to call from a worker in pool mode.
+ *
+ * @param bev The client's connection.
+ * @param conn The connection's entry.
+ * @param wait Nanoseconds until the client may be served again.
+ */
+static void throttle(struct bufferevent* bev, ConnectionEntry* conn,
+        uint64_t wait)
+{
+    struct timeval tv;
+    tv.tv_sec = wait / 1000000000;
+    tv.tv_usec = (wait % 1000000000) / 1000 + 1;
+
+    bufferevent_disable(bev, EV_READ);
+    if (conn->throttled.exchange(1))
+    {
+        return;
+    }
+    event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, endThrottle,
+            new std::pair<evutil_socket_t, uint32_t>(bufferevent_getfd(bev),
+                conn->generation), &tv);
+}
+
+void handleRequest(void* args)
+{
+    pthread_mutex_lock(&jobMutex);
+    if (!args)
+    {
+        // bufferevent has been freed; this is a stale job
+        pthread_mutex_unlock(&jobMutex);
+        return;
+    }
+
+    struct bufferevent* bev = (struct bufferevent*) args;
+    evutil_socket_t fd = bufferevent_getfd(bev);
+
+    struct evbuffer *input = bufferevent_get_input(bev);
+    struct evbuffer *output = bufferevent_get_output(bev);
+    ConnectionEntry* conn = connections->get(fd);
+    if (conn && !conn->inUse)
+    {
+        // the client has gone; nobody is left to answer
+        endJob(bev, conn);
+        pthread_mutex_unlock(&jobMutex);
+        return;
+    }
+    struct Request req;
+    size_t inCapacity = 0;
+    size_t outCapacity = 0;
+    size_t used = 0;
+    size_t at = 0;
+    uint32_t total = 0;
+    uint64_t wait = 0;
+    int len = 0;
+
+    // Answer every whole request that has arrived, and that the rate limits
+    // allow, with one write; later jobs for the same connection find nothing
+    // left to do. The bufferevent stays ours until endJob(): closeConnection()
+    // won't release it while this job is counted in conn->jobs.
+    size_t avail = evbuffer_get_length(input);
+    char* in = (char*) buffers->get(avail, &inCapacity);
+    avail = evbuffer_copyout(input, in, avail);
+    uint64_t start = conn
+            ? conn->requestStart.exchange(0, std::memory_order_relaxed) : 0;
+
+    while ((len = parseRequest(in + used, avail - used, &req)) > 0)
+    {
+        // each request answered is paid for; the rest stay in the input
+        // until the client may have them
+        if (limiter && conn && (wait = limiter->admit(fd, &conn->addr,
+                        responseHeaderSize(req) + req.size)))
+        {
+            throttle(bev, conn, wait);
+            break;
+        }
+        total += responseHeaderSize(req) + req.size;
+        used += len;
+    }
+    if (len == -1)
+    {
+        rejectClient(fd);
+    }
+    if (start && !used)
+    {
+        // nothing answered; the oldest request is still waiting
+        uint64_t none = 0;
+        conn->requestStart.compare_exchange_strong(none, start,
+                std::memory_order_relaxed);
+    }
+
+    char* out = (char*) buffers->get(total, &outCapacity);
+    char* op = out;
+
+    for (at = 0; at < used; at += len)
+    {
+        len = parseRequest(in + at, used - at, &req);
+        fillResponse(op, req);
+        op += responseHeaderSize(req) + req.size;
+    }
+    if (used)
+    {
+        evbuffer_drain(input, used);
+        evbuffer_add(output, out, total);
+    }
+    if (start && used)
+    {
+        // only the oldest request's pickup is known, so it's the one timed
+        turnaround->record(monotonicNs() - start);
+    }
+
+    for (at = 0; at < used; at += len)
+    {
+        len = parseRequest(in + at, used - at, &req);
+        compactRequests += req.compact;
+        updateClientStats(fd, responseHeaderSize(req) + req.size);
+    }
+    endJob(bev, conn);
+
+    pthread_mutex_unlock(&jobMutex);
+
+    buffers->put(in, inCapacity);
+    buffers->put(out, outCapacity);
+}
+
+/**
+ * Answer the oldest request on bev straight from the event loop with an error
+ * reply: the requested number of bytes, starting with a '\0' (which never
+ * appears in a normal payload), after the header if the request was compact.
+ *
+ * Nothing else may be writing to bev's output at the same time, and no
+ * ordered response to an earlier request may still be on its way.
+ *
+ * @param bev The connection to answer.
+ * @return False if there isn't a whole request to answer yet.
+ */
+static bool shedRequest(struct bufferevent* bev)
+{
+    struct evbuffer* input = bufferevent_get_input(bev);
+    struct evbuffer* output = bufferevent_get_output(bev);
+    struct evbuffer_iovec vec;
+    struct Request req;
+    int len = 0;
+
+    if ((len = peekRequest(input, &req)) <= 0)
+    {
+        if (len == -1)
+        {
+            rejectClient(bufferevent_getfd(bev));
+        }
+        return false;
+    }
+    evbuffer_drain(input, len);
+    uint32_t total = responseHeaderSize(req) + req.size;
+
+    if (total && evbuffer_reserve_space(output, total, &vec, 1) == 1)
+    {
+        memset(vec.iov_base, 0, total);
+        writeResponseHeader((char*) vec.iov_base, req);
+        vec.iov_len = total;
+        evbuffer_commit_space(output, &vec, 1);
+    }
+    compactRequests += req.compact;
+    updateClientStats(bufferevent_getfd(bev), total);
+    overloadSheds++;
+    return true;
+}
+
+/**
+ * Stop reading from bev until a worker makes room in the queue;
+ * resumeReading() will pick up whatever is already in the input buffer. A
+ * connection that is already paused stays where it is in the list.
+ *
+ * @param bev The connection whose request didn't fit in the queue.
+ */
+static void pauseReading(struct bufferevent* bev)
+{
+    ConnectionEntry* conn = connections->get(bufferevent_getfd(bev));
+
+    bufferevent_disable(bev, EV_READ);
+    if (conn && conn->paused)
+    {
+        return;
+    }
+    if (conn)
+    {
+        conn->paused = 1;
+    }
+    paused.push_back(bev);
+    overloadPauses++;
+}
+
+/**
+ * Check the next request on bev against the rate limits. A client over its
+ * limit isn't dropped; reading from it stops until it's allowed another
+ * request.
+ *
+ * @param bev The connection with a request waiting.
+ * @param conn The connection's entry.
+ * @return True if the request may be served now.
+ */
+static bool admitRequest(struct bufferevent* bev, ConnectionEntry* conn)
+{
+    struct Request req;
+    uint64_t wait = 0;
+
+    // a partial or bad request is left for the caller to deal with
+    if (!limiter || peekRequest(bufferevent_get_input(bev), &req) <= 0)
+    {
+        return true;
+    }
+    if (!(wait = limiter->admit(bufferevent_getfd(bev), &conn->addr,
+                    responseHeaderSize(req) + req.size)))
+    {
+        return true;
+    }
+    throttle(bev, conn, wait);
+    return false;
+}
+
+/**
+ * Shed the requests waiting on a connection in pool mode, where workers write
+ * to the connection's output under jobMutex. All of them go, as the job that
+ * didn't fit would have answered them all, and no read callback comes for
+ * the rest until the client sends more. A reply shed while a job is still
+ * outstanding for the connection would overtake that job's responses, so
+ * nothing is shed then.
+ * jobMutex is only tried: the loop holds bev's lock during a read callback,
+ * and a worker holding jobMutex may be waiting for it.
+ *
+ * @param bev The connection whose job didn't fit in the queue.
+ * @param conn The connection's entry.
+ * @return False if the requests couldn't be shed, so reading should pause
+ *      instead.
+ */
+static bool shedPooled(struct bufferevent* bev, ConnectionEntry* conn)
+{
+    if (!conn || conn->jobs || pthread_mutex_trylock(&jobMutex))
+    {
+        return false;
+    }
+    while (shedRequest(bev))
+    {
+    }
+    pthread_mutex_unlock(&jobMutex);
+    return true;
+}
+
+static void readSock(struct bufferevent* bev, void* arg)
+{
+    ConnectionEntry* conn = connections->get(bufferevent_getfd(bev));
+    if (conn)
+    {
+        if (conn->throttled)
+        {
+            // endThrottle() will read again when the client may be served
+            return;
+        }
+        // a request already waiting for a worker keeps the older start
+        uint64_t none = 0;
+        conn->requestStart.compare_exchange_strong(none, monotonicNs(),
+                std::memory_order_relaxed);
+        // before the job is added, since a worker may finish it straight away
+        conn->jobs++;
+    }
+
+    int rtn = tPoolAddJob((tPool*) arg, handleRequest, bev);
+
+    if (rtn && conn)
+    {
+        conn->jobs--;
+    }
+    if (rtn == TPOOL_QUEUE_FULL && overloadPolicy == OVERLOAD_SHED
+            && shedPooled(bev, conn))
+    {
+        return;
+    }
+    else if (rtn == TPOOL_QUEUE_FULL)
+    {
+        pauseReading(bev);
+    }
+    else if (rtn)
+    {
+        std::cerr << "Error adding new job to thread pool\n";
+        exit(1);
+    }
+}
+
+/**
+ * Allocate a response and the space for its payload.
+ *
+ * @param fd The connection the response is for.
+ * @param generation The connection's generation.
+ * @param start When the loop picked up the request.
+ * @param size The number of bytes in the payload.
+ * @return The response, to be freed with freeResponse().
+ */
+static struct response* newResponse(evutil_socket_t fd, uint32_t generation,
+        uint64_t start, uint32_t size)
+{
+    size_t capacity = 0;
+    void* mem = buffers->get(sizeof(struct response) + size, &capacity);
+    if (!mem)
+    {
+        std::cerr << "Error allocating response\n";
+        exit(1);
+    }
+    struct response* r = new (mem) response();
+    r->fd = fd;
+    r->generation = generation;
+    r->start = start;
+    r->size = size;
+    r->data = (char*) (r + 1);
+    r->capacity = capacity;
+    return r;
+}
+
+static void freeResponse(const void*, size_t, void* arg)
+{
+    struct response* r = (struct response*) arg;
+    size_t capacity = r->capacity;
+    r->~response();
+    buffers->put(r, capacity);
+}
+
+/**
+ * Build a packet of random characters on a worker thread, then hand it to the
+ * event loop. Never touches libevent.
+ *
+ * @param fd The connection that asked for it.
+ * @param generation The connection's generation.
+ * @param req The request.
+ * @param start When the loop picked up the request.
+ */
+static void buildResponse(evutil_socket_t fd, uint32_t generation, 
+        const struct Request& req, uint64_t start)
+{
+    struct response* r = newResponse(fd, generation, start,
+            responseHeaderSize(req) + req.size);
+
+    fillResponse(r->data, req);
+    responses->push(r);
+}
+
+/**
+ * Read callback in handoff mode. Takes the next whole request out of the input
+ * buffer and hands it to the pool. Responses normally go out in order, so a
+ * request waits in the input buffer until the connection has nothing in
+ * flight, and deliverResponses() calls this again. A request flagged
+ * PROTO_UNORDERED doesn't wait (up to MAX_IN_FLIGHT per connection); its
+ * response goes out whenever it's ready, with the request ID on it.
+ *
+ * @param bev The connection with data to read.
+ * @param arg The connection's ConnectionEntry.
+ */
+static void readSockHandoff(struct bufferevent* bev, void* arg)
+{
+    ConnectionEntry* conn = (ConnectionEntry*) arg;
+    struct evbuffer* input = bufferevent_get_input(bev);
+    evutil_socket_t fd = bufferevent_getfd(bev);
+    uint32_t generation = conn->generation;
+    struct Request req;
+    int len = 0;
+    int rtn;
+
+    while ((len = peekRequest(input, &req)) > 0)
+    {
+        if (conn->inFlight && (!(req.flags & PROTO_UNORDERED)
+                               || conn->inFlight >= MAX_IN_FLIGHT))
+        {
+            return;
+        }
+        if (!admitRequest(bev, conn))
+        {
+            return;
+        }
+        uint64_t start = monotonicNs();
+        rtn = jobs->submit([fd, generation, req, start] 
+        { 
+            buildResponse(fd, generation, req, start); 
+        });
+
+        if (rtn == TPOOL_QUEUE_FULL && overloadPolicy == OVERLOAD_SHED)
+        {
+            shedRequest(bev);
+            continue;
+        }
+        else if (rtn == TPOOL_QUEUE_FULL)
+        {
+            pauseReading(bev);
+            return;
+        }
+        else if (rtn)
+        {
+            std::cerr << "Error adding new job to thread pool\n";
+            exit(1);
+        }
+        evbuffer_drain(input, len);
+        compactRequests += req.compact;
+        overlappedRequests += conn->inFlight > 0;
+        conn->inFlight++;
+    }
+    if (len == -1)
+    {
+        rejectClient(fd);
+    }
+}
+
+/**
+ * Runs in the event loop when workers have pushed responses. Queues each one
+ * on its connection's output buffer without copying it, then starts on the
+ * connection's next request.
+ */
+static void deliverResponses(evutil_socket_t, short, void*)
+{
+    LoopMessage* msg = NULL;
+
+    responses->acknowledge();
+
+    while ((msg = responses->pop()))
+    {
+        struct response* r = static_cast<struct response*>(msg);
+        ConnectionEntry* conn = connections->get(r->fd);
+
+        if (!conn || !conn->inUse || conn->generation != r->generation)
+        {
+            // the connection closed while the response was being built
+            staleResponses++;
+            freeResponse(NULL, 0, r);
+            continue;
+        }
+        evutil_socket_t fd = r->fd;
+        uint32_t size = r->size;
+        uint64_t start = r->start;
+
+        if (!size)
+        {
+            freeResponse(NULL, 0, r);
+        }
+        else if (evbuffer_add_reference(bufferevent_get_output(conn->bev), 
+                    r->data, size, freeResponse, r))
+        {
+            std::cerr << "Error: evbuffer_add_reference\n";
+            freeResponse(NULL, 0, r);
+        }
+        turnaround->record(monotonicNs() - start);
+        updateClientStats(fd, size);
+
+        conn->inFlight--;
+        // a paused connection waits its turn in resumeReading()
+        if (!conn->paused)
+        {
+            readSockHandoff(conn->bev, conn);
+        }
+    }
+}
+
+static void sockEventHandoff(struct bufferevent* bev, short events, void*)
+{
+    if (events & BEV_EVENT_ERROR)
+    {
+        perror("Error from bufferevent");
+    }
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) 
+    {
+        uint64_t start = monotonicNs();
+        decrementClients(bufferevent_getfd(bev));
+        unpause(bev);
+        releaseConnection(bev);
+        connectionTeardown->record(monotonicNs() - start);
+    }
+}
+
+/**
+ * Called by a worker thread when the pool's queue stops being full.
+ *
+ * @param arg The Notifier the event loop is watching.
+ */
+static void queueNotFull(void* arg)
+{
+    ((Notifier*) arg)->notify();
+}
+
+/**
+ * Runs in the event loop after queueNotFull(). Starts reading from the paused
+ * connections again, oldest first, and hands the request each one was waiting
+ * on to the pool. Stops as soon as the queue fills up again, leaving the rest
+ * paused.
+ */
+static void resumeReading(evutil_socket_t, short, void*)
+{
+    std::vector<struct bufferevent*> resume;
+    size_t i = 0;
+
+    overloadNotifier->drain();
+    resume.swap(paused);
+
+    for (i = 0; i < resume.size() && paused.empty(); i++)
+    {
+        // cleared first, since reading may pause it again
+        connections->get(bufferevent_getfd(resume[i]))->paused = 0;
+        bufferevent_enable(resume[i], EV_READ);
+        bufferevent_trigger(resume[i], EV_READ, 0);
+    }
+    paused.insert(paused.end(), resume.begin() + i, resume.end());
+}
+
+/**
+ * Turn on busy polling for a socket if --busy-poll asked for it. Complains the
+ * first time it doesn't work, then carries on without it.
+ *
+ * @param fd The socket.
+ */
+static void busyPoll(evutil_socket_t fd)
+{
+    static bool warned = false;
+
+    if (busyPollUsec && setBusyPoll(fd, busyPollUsec) == -1 && !warned)
+    {
+        warned = true;
+        sockError("setsockopt(SO_BUSY_POLL)", 0);
+    }
+}
+
+/**
+ * Run the event loop until it's told to exit. In busy poll mode the loop
+ * never sleeps: each pass checks for events with a zero timeout
+ * (EVLOOP_NONBLOCK), trading a whole core for wakeup latency.
+ *
+ * @param base The event base to run.
+ */
+static void runLoop(struct event_base* base)
+{
+    if (!busyPollUsec)
+    {
+        event_base_dispatch(base);
+        return;
+    }
+
+    while (!event_base_got_exit(base) && !event_base_got_break(base)
+           && event_base_loop(base, EVLOOP_NONBLOCK) == 0)
+    {
+        loopPasses++;
+    }
+}
+
+static void acceptErr(struct evconnlistener* listener, void*)
+{
+    struct event_base *base = evconnlistener_get_base(listener);
+    int err = EVUTIL_SOCKET_ERROR();
+    std::cerr << "Error " << err << "(" << evutil_socket_error_to_string(err)
+              << ") on listening socket. Shutting down.\n";
+    event_base_loopexit(base, NULL);
+}
+
+/**
+ * Give a connection that is ready for requests (just accepted, or done with
+ * its TLS handshake) a bufferevent. If the kernel handles TLS in both
+ * directions the socket is used as if it were plain text; otherwise OpenSSL
+ * does the record layer, through the kernel for whichever direction kTLS
+ * does cover.
+ *
+ * @param base The event base.
+ * @param fd The connection's socket.
+ * @param conn The connection's entry.
+ */
+static void openConnection(struct event_base* base, evutil_socket_t fd,
+        ConnectionEntry* conn)
+{
+    struct bufferevent* bev = NULL;
+    // only the loop thread touches a handoff bufferevent, so it needs no locks
+    int options = BEV_OPT_CLOSE_ON_FREE | (responses ? 0 : BEV_OPT_THREADSAFE);
+
+    if (conn->ssl && !(tlsKernelSend(conn->ssl) && tlsKernelRecv(conn->ssl)))
+    {
+        if (!(bev = bufferevent_openssl_socket_new(base, fd, conn->ssl,
+                        BUFFEREVENT_SSL_OPEN, options)))
+        {
+            std::cerr << "Error: bufferevent_openssl_socket_new\n";
+            decrementClients(fd);
+            SSL_free(conn->ssl);
+            conn->ssl = NULL;
+            evutil_closesocket(fd);
+            return;
+        }
+        // clients hang up without a close_notify
+        bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+    }
+    else
+    {
+        bev = bevPool->get(base, fd, options);
+    }
+    conn->bev = bev;
+
+    if (responses)
+    {
+        bufferevent_setcb(bev, readSockHandoff, NULL, sockEventHandoff, conn);
+    }
+    else
+    {
+        bufferevent_setcb(bev, readSock, NULL, sockEvent, pool);
+    }
+    bufferevent_enable(bev, EV_READ | EV_WRITE); 
+}
+
+/**
+ * Move a new connection's TLS handshake along without blocking the loop.
+ * Waits for whatever OpenSSL needs next, then hands the connection to
+ * openConnection() once the handshake is done. The connection is dropped if
+ * the handshake fails or stalls.
+ *
+ * @param fd The connection's socket.
+ * @param what EV_TIMEOUT if the client stalled.
+ * @param arg The handshake's own event.
+ */
+static void continueHandshake(evutil_socket_t fd, short what, void* arg)
+{
+    struct event* ev = (struct event*) arg;
+    struct event_base* base = event_get_base(ev);
+    ConnectionEntry* conn = connections->get(fd);
+    short wait = 0;
+    int rtn = 0;
+
+    if (!(what & EV_TIMEOUT))
+    {
+        if ((rtn = SSL_do_handshake(conn->ssl)) == 1)
+        {
+            event_free(ev);
+            tlsHandshakes++;
+            kernelSends += tlsKernelSend(conn->ssl);
+            kernelRecvs += tlsKernelRecv(conn->ssl);
+            openConnection(base, fd, conn);
+            return;
+        }
+
+        switch (SSL_get_error(conn->ssl, rtn))
+        {
+            case SSL_ERROR_WANT_READ:   wait = EV_READ;     break;
+            case SSL_ERROR_WANT_WRITE:  wait = EV_WRITE;    break;
+        }
+    }
+
+    if (wait)
+    {
+        struct timeval tv = { TLS_HANDSHAKE_SECS, 0 };
+        event_assign(ev, base, fd, wait, continueHandshake, ev);
+        event_add(ev, &tv);
+        return;
+    }
+
+    tlsFailures++;
+    ERR_clear_error();
+    event_free(ev);
+    decrementClients(fd);
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+    evutil_closesocket(fd);
+}
+
+static void acceptClient(struct evconnlistener* listener, evutil_socket_t fd,
+        struct sockaddr* sa, int, void*)
+{
+    uint64_t start = monotonicNs();
+    ConnectionEntry* conn = incrementClients(fd, sa);
+
+    if (!conn)
+    {
+        return;
+    }
+    busyPoll(fd);
+
+    struct event_base* base = evconnlistener_get_base(listener);
+
+    if (!tls)
+    {
+        openConnection(base, fd, conn);
+        connectionSetup->record(monotonicNs() - start);
+        return;
+    }
+
+    if (!(conn->ssl = tls->newSession(fd)))
+    {
+        std::cerr << "Error creating a TLS session\n";
+        decrementClients(fd);
+        evutil_closesocket(fd);
+        return;
+    }
+    continueHandshake(fd, EV_READ, 
+            event_new(base, fd, EV_READ, continueHandshake, 
+                event_self_cbarg()));
+    // the rest of the handshake waits for the client, so isn't counted
+    connectionSetup->record(monotonicNs() - start);
+}
+
+/**
+ * Send the datagrams queued up by serveDatagrams().
+ *
+ * @param fd The UDP socket.
+ * @param msgs The datagrams.
+ * @param n The number of datagrams.
+ */
+static void flushDatagrams(evutil_socket_t fd, struct mmsghdr* msgs, 
+        unsigned int n)
+{
+    int sent = 0;
+
+    if (!n)
+    {
+        return;
+    }
+    if ((sent = sendMessages(fd, msgs, n)) == -1)
+    {
+        // the client is gone; it will time out waiting for the rest
+        sockError("sendmmsg()", 0);
+        return;
+    }
+    datagramsSent += sent;
+    sendBatches++;
+}
+
+
+int serveDatagrams(evutil_socket_t fd, int flags)
+{
+    struct mmsghdr in[DATAGRAM_BATCH];
+    struct iovec inVec[DATAGRAM_BATCH];
+    char requests[DATAGRAM_BATCH][MAX_REQUEST_SIZE];
+    struct sockaddr_storage peers[DATAGRAM_BATCH];
+    struct mmsghdr out[DATAGRAM_BATCH];
+    struct iovec outVec[DATAGRAM_BATCH];
+    char* payloads[DATAGRAM_BATCH];
+    size_t capacities[DATAGRAM_BATCH];
+    unsigned int queued = 0;
+    int received = 0;
+    int i = 0;
+
+    memset(in, 0, sizeof(in));
+    for (i = 0; i < DATAGRAM_BATCH; i++)
+    {
+        inVec[i].iov_base = requests[i];
+        inVec[i].iov_len = MAX_REQUEST_SIZE;
+        in[i].msg_hdr.msg_name = &peers[i];
+        in[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        in[i].msg_hdr.msg_iov = &inVec[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if ((received = recvMessages(fd, in, DATAGRAM_BATCH, flags)) == -1)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                ? 0 : -1;
+    }
+    recvBatches++;
+    uint64_t start = monotonicNs();
+
+    for (i = 0; i < received; i++)
+    {
+        struct Request req;
+
+        payloads[i] = NULL;
+        if (parseRequest(requests[i], in[i].msg_len, &req) <= 0)
+        {
+            // a datagram is a whole request, or nothing we can answer
+            continue;
+        }
+        uint32_t msgSize = responseHeaderSize(req) + req.size;
+        payloads[i] = (char*) buffers->get(msgSize, &capacities[i]);
+        fillResponse(payloads[i], req);
+        compactRequests += req.compact;
+
+        for (uint32_t offset = 0; offset < msgSize; offset += MAX_DATAGRAM)
+        {
+            if (queued == DATAGRAM_BATCH)
+            {
+                flushDatagrams(fd, out, queued);
+                queued = 0;
+            }
+            memset(&out[queued], 0, sizeof(out[queued]));
+            outVec[queued].iov_base = payloads[i] + offset;
+            outVec[queued].iov_len = (msgSize - offset < MAX_DATAGRAM)
+                    ? msgSize - offset : MAX_DATAGRAM;
+            out[queued].msg_hdr.msg_name = &peers[i];
+            out[queued].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+            out[queued].msg_hdr.msg_iov = &outVec[queued];
+            out[queued].msg_hdr.msg_iovlen = 1;
+            queued++;
+        }
+        datagramRequests++;
+    }
+    flushDatagrams(fd, out, queued);
+    uint64_t elapsed = monotonicNs() - start;
+
+    for (i = 0; i < received; i++)
+    {
+        if (payloads[i])
+        {
+            turnaround->record(elapsed);
+            buffers->put(payloads[i], capacities[i]);
+        }
+    }
+    return received;
+}
+
+/**
+ * Runs in the event loop when the UDP socket is readable. Answers batches of
+ * requests until the socket is empty.
+ */
+static void readDatagrams(evutil_socket_t fd, short, void*)
+{
+    int served = 0;
+
+    while ((served = serveDatagrams(fd, MSG_DONTWAIT)) == DATAGRAM_BATCH)
+    {
+    }
+    if (served == -1)
+    {
+        sockError("recvmmsg()", 0);
+    }
+}
+
+
+socklen_t serverAddress(struct sockaddr_storage* addr, const int port,
+        const std::string& path)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (!path.empty())
+    {
+        struct sockaddr_un* un = (struct sockaddr_un*) addr;
+
+        if (path.size() >= sizeof(un->sun_path))
+        {
+            std::cerr << "Error: unix socket path is too long\n";
+            exit(1);
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path.c_str());
+        unlink(path.c_str());
+        socketPath = path;
+        return sizeof(struct sockaddr_un);
+    }
+
+    struct sockaddr_in* in = (struct sockaddr_in*) addr;
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = htonl(INADDR_ANY);
+    in->sin_port = htons(port);
+    return sizeof(struct sockaddr_in);
+}
+
+
+evutil_socket_t bindDatagram(const struct sockaddr* addr, socklen_t len)
+{
+    evutil_socket_t fd;
+    int size = DGRAM_BUFSIZE;
+
+    if ((fd = socket(addr->sa_family, SOCK_DGRAM, 0)) == -1)
+    {
+        exit(sockError("socket()", 0));
+    }
+    setUpSocket(fd);
+
+    // not fatal; the kernel may cap these
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    if (bind(fd, addr, len) == -1)
+    {
+        exit(sockError("bind()", 0));
+    }
+    busyPoll(fd);
+    datagrams = true;
+    return fd;
+}
+
+/**
+ * Serve requests over UDP straight from the event loop. There are no
+ * connections, so the thread pool isn't used.
+ *
+ * @param eb The event base to run.
+ * @param addr The address to bind to.
+ * @param len The length of addr.
+ */
+static void runServerUdp(EventBase* eb, const struct sockaddr* addr,
+        socklen_t len)
+{
+    evutil_socket_t fd = bindDatagram(addr, len);
+
+    struct event* readable;
+    readable = event_new(eb->getBase(), fd, EV_READ | EV_PERSIST,
+            readDatagrams, NULL);
+    event_add(readable, NULL);
+    std::cout << "Answering requests over UDP\n";
+
+    struct event* sigint;
+    sigint = evsignal_new(eb->getBase(), SIGINT, handleSigint, NULL);
+    evsignal_add(sigint, NULL);
+
+    struct event* sigusr1;
+    sigusr1 = evsignal_new(eb->getBase(), SIGUSR1, handleSigusr1, NULL);
+    evsignal_add(sigusr1, NULL);
+
+    baselineRss = residentBytes();
+    runLoop(eb->getBase());
+    event_free(readable);
+    event_del(sigint);
+    event_del(sigusr1);
+    close(fd);
+}
+
+void runServer(EventBase* eb, const int port, const int numWorkerThreads,
+        const int maxQueueSize, const OverloadPolicy overload,
+        const bool handoff, const int poolConns, const std::string& unixPath,
+        const bool udp) 
+{
+    struct sockaddr_storage addr;
+    socklen_t addrLen = serverAddress(&addr, port, unixPath);
+    struct evconnlistener* listener;
+
+    if (udp)
+    {
+        runServerUdp(eb, (struct sockaddr*) &addr, addrLen);
+        return;
+    }
+
+    int blockWhenQueueFull = (overload == OVERLOAD_BLOCK);
+
+    bevPool = new BuffereventPool(poolConns);
+
+    if (tPoolInit(&pool, numWorkerThreads, maxQueueSize, blockWhenQueueFull))
+    {
+        std::cerr << "Error initializing thread pool\n";
+        exit(1);
+    }
+
+    // shedding pauses too, when it can't shed (see shedPooled())
+    struct event* notFull = NULL;
+    if (overload != OVERLOAD_BLOCK)
+    {
+        try
+        {
+            overloadNotifier = new Notifier();
+        }
+        catch (const std::exception&)
+        {
+            exit(sockError("Notifier()", 0));
+        }
+        notFull = event_new(eb->getBase(), overloadNotifier->getFd(),
+                EV_READ | EV_PERSIST, resumeReading, pool);
+        event_priority_set(notFull, 0);
+        event_add(notFull, NULL);
+        tPoolSetNotFullCallback(pool, queueNotFull, overloadNotifier);
+    }
+
+    struct event* delivered = NULL;
+    if (handoff)
+    {
+        try
+        {
+            responses = new LoopQueue();
+        }
+        catch (const std::exception&)
+        {
+            exit(sockError("LoopQueue()", 0));
+        }
+        jobs = new JobPool<>(pool);
+        delivered = event_new(eb->getBase(), responses->getFd(),
+                EV_READ | EV_PERSIST, deliverResponses, NULL);
+        // with priorities, finished work goes out before new work comes in
+        event_priority_set(delivered, 0);
+        event_add(delivered, NULL);
+        std::cout << "Workers hand responses back to the event loop\n";
+    }
+
+    if (!(listener = evconnlistener_new_bind(eb->getBase(), acceptClient, pool, 
+            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, LISTEN_BACKLOG, 
+            (struct sockaddr*) &addr, addrLen)))
+    {
+        exit(sockError("evconnlistener_new_bind()", 0));
+    }
+    evconnlistener_set_error_cb(listener, acceptErr);
+
+    struct event* sigint;
+    sigint = evsignal_new(eb->getBase(), SIGINT, handleSigint, listener);
+    evsignal_add(sigint, NULL);
+
+    struct event* sigusr1;
+    sigusr1 = evsignal_new(eb->getBase(), SIGUSR1, handleSigusr1, NULL);
+    evsignal_add(sigusr1, NULL);
+
+    baselineRss = residentBytes();
+    runLoop(eb->getBase());
+    event_del(sigint);
+    event_del(sigusr1);
+
+    if (delivered)
+    {
+        event_free(delivered);
+        delete jobs;
+        jobs = NULL;
+    }
+    if (notFull)
+    {
+        tPoolSetNotFullCallback(pool, NULL, NULL);
+        event_free(notFull);
+        delete overloadNotifier;
+        overloadNotifier = NULL;
+    }
+}
+
+/**
+ * Read one whole request from a socket. Requests that arrive together are read
+ * with one system call.
+ *
+ * @param reader The connection's reader.
+ * @param req Where to put the request.
+ * @return 0 on success, or -1 if the socket has closed or the client sent a
+ *      request we can't decode. On a non-blocking socket, -1 with errno set to
+ *      EAGAIN means the request hasn't all arrived yet.
+ */
+static int readRequest(SocketReader* reader, struct Request* req)
+{
+    const char* buf = NULL;
+    int len = 0;
+
+    if (!(buf = reader->peek(sizeof(uint32_t))))
+    {
+        return -1;
+    }
+    // the magic says how long the request is
+    len = isCompactRequest(buf) ? COMPACT_REQUEST_SIZE : REQUEST_SIZE;
+    if (!(buf = reader->peek(len)))
+    {
+        return -1;
+    }
+    reader->consume(len);
+
+    if (parseRequest(buf, len, req) == -1)
+    {
+        if (!badRequests++)
+        {
+            std::cerr << "Error: client sent a request we can't decode\n";
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read message from fd, the return a packet of random characters.
+ * @param fd The socket to read from / write to.
+ * @author Dean Morin
+ */
+void readSockTh(evutil_socket_t fd)
+{
+    struct Request req;
+    uint32_t msgSize;
+    uint64_t wait = 0;
+    SSL* ssl = NULL;
+    ConnectionEntry* conn = connections->get(fd);
+
+    if (tls)
+    {
+        if (!(ssl = tls->newSession(fd)) || SSL_accept(ssl) != 1)
+        {
+            tlsFailures++;
+            ERR_clear_error();
+            SSL_free(ssl);
+            decrementClients(fd);
+            close(fd);
+            return;
+        }
+        tlsHandshakes++;
+        kernelSends += tlsKernelSend(ssl);
+        kernelRecvs += tlsKernelRecv(ssl);
+    }
+
+    SocketReader* reader = ssl ? new TlsReader(ssl, fd) : new SocketReader(fd);
+
+    while (readRequest(reader, &req) != -1)
+    {
+        msgSize = responseHeaderSize(req) + req.size;
+
+        // a client over its limit just waits; nobody else uses this thread
+        while (limiter && (wait = limiter->admit(fd, &conn->addr, msgSize)))
         {
-            writeBuf[i] = rand() % 93 + 33;
+            usleep(wait / 1000 + 1);
         }
+        uint64_t start = monotonicNs();
 
-        send(*fd, writeBuf, msgSize, 0);
+        size_t capacity = 0;
+        char* writeBuf = (char*) buffers->get(msgSize, &capacity);
+        fillResponse(writeBuf, req);
+        compactRequests += req.compact;
 
-        updateClientStats(*fd, msgSize);
+        if (ssl)
+        {
+            tlsSend(ssl, fd, writeBuf, msgSize);
+        }
+        else
+        {
+            send(fd, writeBuf, msgSize, 0);
+        }
+        turnaround->record(monotonicNs() - start);
 
-        delete writeBuf;
+        updateClientStats(fd, msgSize);
+
+        buffers->put(writeBuf, capacity);
+        readerRequests++;
     }
-    decrementClients(*fd);
-    close(*fd);
-    delete fd;
+    readerCalls += reader->calls();
+    delete reader;
+
+    uint64_t start = monotonicNs();
+    decrementClients(fd);
+    SSL_free(ssl);
+    close(fd);
+    connectionTeardown->record(monotonicNs() - start);
 }
 
 /**
@@ -448,41 +2146,53 @@ void setUpSocket(evutil_socket_t fd)
 evutil_socket_t acceptClientTh(evutil_socket_t fd)
 {
     evutil_socket_t fdNew;
-	struct sockaddr_in addr;
-	socklen_t addrSize = sizeof(struct sockaddr_in);
+    struct sockaddr_storage addr;
+    socklen_t addrSize = sizeof(addr);
 
     if ((fdNew = accept(fd, (struct sockaddr*) &addr, &addrSize)) == -1)
     {
         exit(sockError("accect()", 0));
     }
+    uint64_t start = monotonicNs();
     setUpSocket(fdNew);
-    
-    incrementClients(fd, &addr);
+    busyPoll(fdNew);
 
+    if (!incrementClients(fdNew, (struct sockaddr*) &addr))
+    {
+        return -1;
+    }
+    connectionSetup->record(monotonicNs() - start);
     return fdNew;
 }
 
 
-void runServerTh(const int port, const int numWorkerThreads,
-        const int maxQueueSize)
+/**
+ * Takes SIGUSR1 for the modes without libevent, so that the memory report is
+ * printed by a thread rather than in signal context.
+ * @param arg The set holding SIGUSR1.
+ */
+static void* waitForSigusr1(void* arg)
 {
-	struct sockaddr_in addr;
-    evutil_socket_t fd;
+    sigset_t* set = (sigset_t*) arg;
+    int sig = 0;
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    tPool* pool = NULL;
-    int blockWhenQueueFull = 1;
-
-    if (tPoolInit(&pool, numWorkerThreads, maxQueueSize, blockWhenQueueFull))
+    while (true)
     {
-        std::cerr << "Error initializing thread pool\n";
-        exit(1);
-    }        
-	
+        if (sigwait(set, &sig) == 0)
+        {
+            reportMemory(sig);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Without libevent: ctrl-c calls shutDown() and SIGUSR1 reports memory use.
+ * Must be called before any other thread is started, so that they all inherit
+ * the blocked SIGUSR1 and only waitForSigusr1() receives it.
+ */
+static void catchSignals()
+{
     struct sigaction sigint;
     sigint.sa_handler = shutDown;
     sigint.sa_flags = 0;
@@ -496,14 +2206,65 @@ void runServerTh(const int port, const int numWorkerThreads,
         exit(sockError("sigaction()", 0));
     }
 
-    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    static sigset_t sigusr1;
+    pthread_t thread;
+
+    if (sigemptyset(&sigusr1) == -1 || sigaddset(&sigusr1, SIGUSR1) == -1)
+    {
+        exit(sockError("sigemptyset()", 0));
+    }
+    if (pthread_sigmask(SIG_BLOCK, &sigusr1, NULL))
+    {
+        exit(sockError("pthread_sigmask()", 0));
+    }
+    if (pthread_create(&thread, NULL, waitForSigusr1, &sigusr1))
+    {
+        exit(sockError("pthread_create()", 0));
+    }
+    pthread_detach(thread);
+}
+
+
+void runServerTh(const int port, const int numWorkerThreads,
+        const int maxQueueSize, const std::string& unixPath, const bool udp)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrLen = serverAddress(&addr, port, unixPath);
+    evutil_socket_t fd;
+
+    catchSignals();
+
+    if (udp)
+    {
+        // one thread batching datagrams; there are no connections to hand out
+        fd = bindDatagram((struct sockaddr*) &addr, addrLen);
+        baselineRss = residentBytes();
+
+        while (true)
+        {
+            if (serveDatagrams(fd, MSG_WAITFORONE) == -1)
+            {
+                exit(sockError("recvmmsg()", 0));
+            }
+        }
+    }
+
+    int blockWhenQueueFull = 1;
+
+    if (tPoolInit(&pool, numWorkerThreads, maxQueueSize, blockWhenQueueFull))
+    {
+        std::cerr << "Error initializing thread pool\n";
+        exit(1);
+    }        
+
+    if ((fd = socket(addr.ss_family, SOCK_STREAM, 0)) == -1)
 	{
         exit(sockError("socket()", 0));
 	}
 
     setUpSocket(fd);
 
-	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+	if (bind(fd, (struct sockaddr*) &addr, addrLen) == -1)
 	{
         exit(sockError("bind()", 0));
 	}
@@ -512,12 +2273,18 @@ void runServerTh(const int port, const int numWorkerThreads,
         exit(sockError("listen()", 0));
     }
 
+    JobPool<> jobs(pool);
+    baselineRss = residentBytes();
+
     while (true)
     {
-        evutil_socket_t* fdNew = new evutil_socket_t();
-        *fdNew = acceptClientTh(fd);
+        evutil_socket_t fdNew = acceptClientTh(fd);
 
-        if (tPoolAddJob(pool, readSockTh, fdNew))
+        if (fdNew == -1)
+        {
+            continue;
+        }
+        if (jobs.submit([fdNew] { readSockTh(fdNew); }))
         {
             std::cerr << "Error adding new job to thread pool\n";
             exit(1);
@@ -526,33 +2293,264 @@ void runServerTh(const int port, const int numWorkerThreads,
 }
 
 
+/**
+ * Serve one connection until it closes, as readSockTh() does, but wait for the
+ * socket on the driver's loop whenever it isn't ready.
+ *
+ * @param driver The loop the connection belongs to.
+ * @param fd The connection's non-blocking socket.
+ */
+static Task serveCoroutine(EpollDriver* driver, evutil_socket_t fd)
+{
+    ConnectionEntry* conn = connections->get(fd);
+    SocketReader reader(fd, CORO_READ_AHEAD);
+    struct Request req;
+    uint32_t msgSize = 0;
+    uint32_t sent = 0;
+    uint64_t wait = 0;
+    int rtn = 0;
+
+    if (driver->watch(fd) == -1)
+    {
+        sockError("epoll_ctl()", 0);
+        decrementClients(fd);
+        close(fd);
+        co_return;
+    }
+
+    while (true)
+    {
+        while ((rtn = readRequest(&reader, &req)) == -1 && errno == EAGAIN)
+        {
+            co_await driver->readable(fd);
+        }
+        if (rtn == -1)
+        {
+            break;
+        }
+        msgSize = responseHeaderSize(req) + req.size;
+
+        // a client over its limit sleeps without holding up the thread
+        while (limiter && (wait = limiter->admit(fd, &conn->addr, msgSize)))
+        {
+            co_await driver->sleep(wait);
+        }
+        uint64_t start = monotonicNs();
+
+        size_t capacity = 0;
+        char* writeBuf = (char*) buffers->get(msgSize, &capacity);
+        fillResponse(writeBuf, req);
+        compactRequests += req.compact;
+
+        for (sent = 0; sent < msgSize; )
+        {
+            if ((rtn = send(fd, writeBuf + sent, msgSize - sent, 
+                            MSG_NOSIGNAL)) >= 0)
+            {
+                sent += rtn;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                co_await driver->writable(fd);
+            }
+            else if (errno != EINTR)
+            {
+                break;
+            }
+        }
+        turnaround->record(monotonicNs() - start);
+
+        updateClientStats(fd, msgSize);
+
+        buffers->put(writeBuf, capacity);
+        readerRequests++;
+
+        if (sent < msgSize)
+        {
+            break;
+        }
+    }
+    readerCalls += reader.calls();
+
+    uint64_t start = monotonicNs();
+    driver->forget(fd);
+    decrementClients(fd);
+    close(fd);
+    connectionTeardown->record(monotonicNs() - start);
+}
+
+/**
+ * Accept connections for one loop, starting a coroutine for each. Every loop
+ * runs one of these on the same listening socket; the kernel wakes one loop
+ * per new connection.
+ *
+ * @param driver The loop to serve the connections on.
+ * @param listenFd The non-blocking listening socket.
+ */
+static Task acceptCoroutine(EpollDriver* driver, evutil_socket_t listenFd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrSize = 0;
+    evutil_socket_t fd;
+
+    if (driver->watch(listenFd, true) == -1)
+    {
+        exit(sockError("epoll_ctl()", 0));
+    }
+
+    while (true)
+    {
+        addrSize = sizeof(addr);
+        if ((fd = accept(listenFd, (struct sockaddr*) &addr, &addrSize)) == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                co_await driver->readable(listenFd);
+            }
+            else if (errno != EINTR && errno != ECONNABORTED)
+            {
+                // most likely out of fds; let some connections close first
+                sockError("accept()", 0);
+                co_await driver->sleep(ACCEPT_RETRY_NS);
+            }
+            continue;
+        }
+        uint64_t start = monotonicNs();
+        evutil_make_socket_nonblocking(fd);
+
+        if (!incrementClients(fd, (struct sockaddr*) &addr))
+        {
+            continue;
+        }
+        busyPoll(fd);
+        connectionSetup->record(monotonicNs() - start);
+        serveCoroutine(driver, fd);
+    }
+}
+
+/**
+ * Body of a coroutine mode thread.
+ *
+ * @param arg The thread's driver and the listening socket, which are freed.
+ * @return Never returns.
+ */
+static void* runDriver(void* arg)
+{
+    std::pair<EpollDriver*, evutil_socket_t>* args 
+            = (std::pair<EpollDriver*, evutil_socket_t>*) arg;
+    EpollDriver* driver = args->first;
+
+    acceptCoroutine(driver, args->second);
+    delete args;
+    driver->run();
+    return NULL;
+}
+
+
+void runServerCo(const int port, const int numThreads,
+        const std::string& unixPath)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrLen = serverAddress(&addr, port, unixPath);
+    evutil_socket_t fd;
+    pthread_t thread;
+    int i = 0;
+
+    catchSignals();
+
+    if ((fd = socket(addr.ss_family, SOCK_STREAM, 0)) == -1)
+    {
+        exit(sockError("socket()", 0));
+    }
+    setUpSocket(fd);
+
+    if (bind(fd, (struct sockaddr*) &addr, addrLen) == -1)
+    {
+        exit(sockError("bind()", 0));
+    }
+    if (listen(fd, LISTEN_BACKLOG))
+    {
+        exit(sockError("listen()", 0));
+    }
+    evutil_make_socket_nonblocking(fd);
+
+    try
+    {
+        for (i = 0; i < numThreads; i++)
+        {
+            drivers.push_back(new EpollDriver());
+        }
+    }
+    catch (const std::exception&)
+    {
+        exit(sockError("epoll_create1()", 0));
+    }
+    baselineRss = residentBytes();
+    std::cout << "Serving connections with coroutines on " << numThreads
+              << " threads\n";
+
+    for (i = 1; i < numThreads; i++)
+    {
+        if (pthread_create(&thread, NULL, runDriver, 
+                    new std::pair<EpollDriver*, evutil_socket_t>(drivers[i], 
+                        fd)))
+        {
+            std::cerr << "Error creating a loop thread\n";
+            exit(1);
+        }
+    }
+    runDriver(new std::pair<EpollDriver*, evutil_socket_t>(drivers[0], fd));
+}
+
+
 void updateClientStats(evutil_socket_t fd, int data)
 {
     pthread_mutex_lock(&clientMutex);
 
-    clients[fd].requestsRecv++;
-    clients[fd].dataSent += data;
+    ConnectionEntry* c = connections->get(fd);
+    if (c && c->inUse)
+    {
+        c->requestsRecv++;
+        c->dataSent += data;
+    }
 
     pthread_mutex_unlock(&clientMutex);
 }
 
 
-void incrementClients(evutil_socket_t fd, struct sockaddr_in* sa)
+ConnectionEntry* incrementClients(evutil_socket_t fd, struct sockaddr* sa)
 {
+    struct sockaddr_in local;
+
+    if (sa->sa_family != AF_INET)
+    {
+        memset(&local, 0, sizeof(local));
+        local.sin_family = sa->sa_family;
+        sa = (struct sockaddr*) &local;
+    }
+
     pthread_mutex_lock(&clientMutex);
 
-    if (++clientCount > maxClientCount)
+    ConnectionEntry* c = connections->open(fd, (struct sockaddr_in*) sa);
+    if (c && limiter)
     {
-        maxClientCount = clientCount;
+        limiter->open(fd, &c->addr);
     }
 #ifdef DEBUG
-    std::cout << "Clients++ " << clientCount << "\n";
+    std::cout << "Clients++ " << connections->count() << "\n";
 #endif
-    // add client to map
-    clients[fd].hostName = inet_ntoa(sa->sin_addr);
-    clients[fd].port = sa->sin_port;
 
     pthread_mutex_unlock(&clientMutex);
+
+    if (!c)
+    {
+        std::cerr << "Error: fd " << fd << " doesn't fit in the connection "
+                  << "table\n";
+        close(fd);
+        return NULL;
+    }
+    acceptedConnections++;
+    return c;
 }
 
 
@@ -560,11 +2558,15 @@ void decrementClients(evutil_socket_t fd)
 {
     pthread_mutex_lock(&clientMutex);
 
-    clientCount--;
+    ConnectionEntry* c = connections->get(fd);
+    if (c && c->inUse && limiter)
+    {
+        limiter->close(fd, &c->addr);
+    }
+    connections->close(fd);
 #ifdef DEBUG
-    std::cout << "Clients-- " << clientCount << "\n";
+    std::cout << "Clients-- " << connections->count() << "\n";
 #endif
-    clients.erase(fd);
 
     pthread_mutex_unlock(&clientMutex);
 }
@@ -0,0 +1,438 @@
+#include "sizes.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <fstream>
+#include <math.h>
+#include <sstream>
+#include <stdlib.h>
+namespace dm {
+
+#define NS_PER_SEC  1e9
+
+
+/**
+ * Parse a size such as "512", "4K" or "1.5M".
+ *
+ * @return False if text isn't one, or is over SIZE_LIMIT.
+ */
+static bool parseSize(const std::string& text, double* size)
+{
+    char* end = NULL;
+    double value = strtod(text.c_str(), &end);
+
+    if (end == text.c_str() || value < 0)
+    {
+        return false;
+    }
+    if (*end == 'K' || *end == 'k')
+    {
+        value *= 1024;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        value *= 1024 * 1024;
+        end++;
+    }
+    *size = value;
+    return !*end && value <= SIZE_LIMIT;
+}
+
+
+/**
+ * Parse a plain number.
+ *
+ * @return False if text isn't one.
+ */
+static bool parseNumber(const std::string& text, double* number)
+{
+    char* end = NULL;
+
+    *number = strtod(text.c_str(), &end);
+    return end != text.c_str() && !*end;
+}
+
+
+/**
+ * @return text split at every delimiter.
+ */
+static std::vector<std::string> split(const std::string& text, char delimiter)
+{
+    std::vector<std::string> parts;
+    std::stringstream in(text);
+    std::string part;
+
+    while (std::getline(in, part, delimiter))
+    {
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+
+/**
+ * log1p(x) / x, accurate near 0.
+ */
+static double log1pOverX(double x)
+{
+    return fabs(x) > 1e-8 ? log1p(x) / x
+                          : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+
+/**
+ * expm1(x) / x, accurate near 0.
+ */
+static double expm1OverX(double x)
+{
+    return fabs(x) > 1e-8 ? expm1(x) / x
+                          : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+
+SizeDistribution::SizeDistribution()
+    : kind_(FIXED), a_(0), b_(0), c_(0), hX1_(0), hN_(0), s_(0)
+{
+}
+
+
+double
+SizeDistribution::h(double x) const
+{
+    return exp(-c_ * log(x));
+}
+
+
+double
+SizeDistribution::hIntegral(double x) const
+{
+    double logX = log(x);
+    return expm1OverX((1 - c_) * logX) * logX;
+}
+
+
+double
+SizeDistribution::hIntegralInverse(double x) const
+{
+    double t = x * (1 - c_);
+    return exp(log1pOverX(t < -1 ? -1 : t) * x);
+}
+
+
+SizeDistribution*
+SizeDistribution::parse(const std::string& spec)
+{
+    std::vector<std::string> parts = split(spec, ':');
+    SizeDistribution* dist = new SizeDistribution();
+    bool ok = false;
+
+    dist->spec_ = spec;
+    if (parts.size() == 1)
+    {
+        dist->kind_ = FIXED;
+        ok = parseSize(parts[0], &dist->a_);
+    }
+    else if (parts[0] == "fixed" && parts.size() == 2)
+    {
+        dist->kind_ = FIXED;
+        ok = parseSize(parts[1], &dist->a_);
+    }
+    else if (parts[0] == "uniform" && parts.size() == 3)
+    {
+        dist->kind_ = UNIFORM;
+        ok = parseSize(parts[1], &dist->a_) && parseSize(parts[2], &dist->b_)
+                && dist->a_ <= dist->b_;
+    }
+    else if (parts[0] == "lognormal" && parts.size() == 3)
+    {
+        dist->kind_ = LOGNORMAL;
+        ok = parseSize(parts[1], &dist->a_) && dist->a_ >= 1
+                && parseNumber(parts[2], &dist->b_) && dist->b_ >= 0;
+    }
+    else if (parts[0] == "zipf" && parts.size() == 3)
+    {
+        dist->kind_ = ZIPF;
+        ok = parseSize(parts[1], &dist->a_) && dist->a_ >= 1
+                && parseNumber(parts[2], &dist->c_) && dist->c_ > 0;
+        if (ok)
+        {
+            dist->a_ = floor(dist->a_);
+            dist->hX1_ = dist->hIntegral(1.5) - 1;
+            dist->hN_ = dist->hIntegral(dist->a_ + 0.5);
+            dist->s_ = 2 - dist->hIntegralInverse(dist->hIntegral(2.5)
+                                                  - dist->h(2));
+        }
+    }
+    else if (parts[0] == "bimodal" && parts.size() == 4)
+    {
+        dist->kind_ = BIMODAL;
+        ok = parseSize(parts[1], &dist->a_) && parseSize(parts[2], &dist->b_)
+                && parseNumber(parts[3], &dist->c_)
+                && dist->c_ >= 0 && dist->c_ <= 1;
+    }
+
+    if (!ok)
+    {
+        delete dist;
+        return NULL;
+    }
+    return dist;
+}
+
+
+uint32_t
+SizeDistribution::next(SizeRng& rng) const
+{
+    double size = 0;
+
+    switch (kind_)
+    {
+    case FIXED:
+        return (uint32_t) a_;
+    case UNIFORM:
+        return std::uniform_int_distribution<uint32_t>(a_, b_)(rng);
+    case LOGNORMAL:
+        size = std::lognormal_distribution<double>(log(a_), b_)(rng);
+        return size < SIZE_LIMIT ? (uint32_t) (size + 0.5) : SIZE_LIMIT;
+    case ZIPF:
+        // rejection-inversion (Hormann and Derflinger, 1996): no table, so
+        // MAX can be large
+        while (true)
+        {
+            double u = hN_ + std::uniform_real_distribution<double>()(rng)
+                    * (hX1_ - hN_);
+            double x = hIntegralInverse(u);
+            double k = floor(x + 0.5);
+
+            k = k < 1 ? 1 : k > a_ ? a_ : k;
+            if (k - x <= s_ || u >= hIntegral(k + 0.5) - h(k))
+            {
+                return (uint32_t) k;
+            }
+        }
+    case BIMODAL:
+        return (uint32_t) (std::uniform_real_distribution<double>()(rng) < c_
+                ? b_ : a_);
+    }
+    return 0;
+}
+
+
+uint32_t
+SizeDistribution::max() const
+{
+    switch (kind_)
+    {
+    case FIXED:
+    case ZIPF:
+        return (uint32_t) a_;
+    case UNIFORM:
+        return (uint32_t) b_;
+    case LOGNORMAL:
+        return SIZE_LIMIT;
+    case BIMODAL:
+        return (uint32_t) (a_ > b_ ? a_ : b_);
+    }
+    return 0;
+}
+
+
+SizeMix::SizeMix()
+{
+}
+
+
+SizeMix::~SizeMix()
+{
+    size_t i = 0;
+
+    for (i = 0; i < parts_.size(); i++)
+    {
+        delete parts_[i].second;
+    }
+}
+
+
+bool
+SizeMix::add(const std::string& spec)
+{
+    size_t star = spec.find('*');
+    double weight = 1;
+    SizeDistribution* dist = NULL;
+
+    if (star != std::string::npos
+            && (!parseNumber(spec.substr(0, star), &weight) || weight < 1
+                || weight != floor(weight)))
+    {
+        return false;
+    }
+    if (!(dist = SizeDistribution::parse(
+                    star == std::string::npos ? spec : spec.substr(star + 1))))
+    {
+        return false;
+    }
+    parts_.push_back(std::make_pair(
+                (parts_.empty() ? 0 : parts_.back().first) + (int) weight,
+                dist));
+    return true;
+}
+
+
+const SizeDistribution*
+SizeMix::forClient(int clientID) const
+{
+    int slot = (clientID - 1) % parts_.back().first;
+    size_t i = 0;
+
+    for (i = 0; parts_[i].first <= slot; i++)
+    {
+    }
+    return parts_[i].second;
+}
+
+
+uint32_t
+SizeMix::max() const
+{
+    uint32_t biggest = 0;
+    size_t i = 0;
+
+    for (i = 0; i < parts_.size(); i++)
+    {
+        biggest = std::max(biggest, parts_[i].second->max());
+    }
+    return biggest;
+}
+
+
+bool
+SizeMix::varies() const
+{
+    size_t i = 0;
+
+    for (i = 0; i < parts_.size(); i++)
+    {
+        if (!parts_[i].second->fixed()
+                || parts_[i].second->max() != parts_[0].second->max())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+std::string
+SizeMix::describe() const
+{
+    std::stringstream out;
+    size_t i = 0;
+
+    for (i = 0; i < parts_.size(); i++)
+    {
+        out << (i ? ", " : "");
+        if (parts_.size() > 1)
+        {
+            out << parts_[i].first - (i ? parts_[i - 1].first : 0) << "*";
+        }
+        out << parts_[i].second->spec();
+    }
+    return out.str();
+}
+
+
+/**
+ * @return True if a was made before b.
+ */
+static bool traceBefore(const TraceEntry& a, const TraceEntry& b)
+{
+    return a.ns < b.ns;
+}
+
+
+int loadTrace(const char* path, std::vector<TraceEntry>* trace,
+        size_t* line)
+{
+    std::ifstream in(path);
+    std::string text;
+    size_t first = trace->size();
+    size_t i = 0;
+
+    *line = 0;
+    if (!in)
+    {
+        return -1;
+    }
+    while (std::getline(in, text))
+    {
+        std::vector<std::string> fields;
+        std::string field;
+        double seconds = 0;
+        double size = 0;
+
+        (*line)++;
+        std::replace(text.begin(), text.end(), ',', ' ');
+        std::stringstream words(text);
+        while (words >> field)
+        {
+            fields.push_back(field);
+        }
+        if (fields.empty() || fields[0][0] == '#')
+        {
+            continue;
+        }
+        if (fields.size() != 2 || !parseNumber(fields[0], &seconds)
+                || seconds < 0 || !parseSize(fields[1], &size))
+        {
+            if (*line == 1)
+            {
+                // a header
+                continue;
+            }
+            errno = EINVAL;
+            return -1;
+        }
+        TraceEntry entry;
+        entry.ns = (uint64_t) (seconds * NS_PER_SEC);
+        entry.size = (uint32_t) size;
+        trace->push_back(entry);
+    }
+    if (in.bad())
+    {
+        return -1;
+    }
+
+    std::stable_sort(trace->begin() + first, trace->end(), traceBefore);
+    for (i = trace->size(); i > first; i--)
+    {
+        (*trace)[i - 1].ns -= (*trace)[first].ns;
+    }
+    return 0;
+}
+
+
+int sizeBucket(uint32_t size)
+{
+    int bucket = 0;
+    uint32_t top = 256;
+
+    while (bucket < SIZE_BUCKETS - 1 && size > top)
+    {
+        top *= 4;
+        bucket++;
+    }
+    return bucket;
+}
+
+
+const char* sizeBucketName(int bucket)
+{
+    static const char* names[SIZE_BUCKETS] = {
+        "<= 256 B", "<= 1 KiB", "<= 4 KiB", "<= 16 KiB", "<= 64 KiB",
+        "<= 256 KiB", "<= 1 MiB", "> 1 MiB"
+    };
+
+    return names[bucket];
+}
+
+} // namespace dm
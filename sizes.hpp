@@ -0,0 +1,189 @@
+#ifndef DM_SIZES_HPP
+#define DM_SIZES_HPP
+#include <random>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+namespace dm {
+
+/** No distribution asks for a response bigger than this (64 MiB). */
+#define SIZE_LIMIT      (64u << 20)
+/** Latency is broken out by response size into buckets of up to 256 bytes,
+ * 1 KiB, 4 KiB and so on by fours, with the last taking everything over
+ * 1 MiB. */
+#define SIZE_BUCKETS    8
+
+/** What each client draws its sizes with; small, since there may be 100k. */
+typedef std::minstd_rand SizeRng;
+
+/**
+ * Where response sizes come from. Parsed from specs like these, where sizes
+ * may end in K or M (times 1024 or 1024 * 1024):
+ *
+ *  - "N" or "fixed:N": always N bytes.
+ *  - "uniform:MIN:MAX": anything from MIN to MAX, evenly.
+ *  - "lognormal:MEDIAN:SIGMA": half below MEDIAN, with SIGMA the standard
+ *    deviation of the size's natural log (1 gives a long tail).
+ *  - "zipf:MAX:S": 1 to MAX bytes, k bytes with a chance proportional to
+ *    1/k^S, so small sizes are common and big ones rare.
+ *  - "bimodal:SMALL:LARGE:P": LARGE with chance P, otherwise SMALL.
+ *
+ * Drawing doesn't change the distribution, so one can be shared by any number
+ * of threads, each with its own SizeRng.
+ */
+class SizeDistribution
+{
+private:
+    enum Kind
+    {
+        FIXED,
+        UNIFORM,
+        LOGNORMAL,
+        ZIPF,
+        BIMODAL
+    };
+
+    Kind kind_;
+    std::string spec_;
+    /** What the numbers in the spec are for depends on kind_. */
+    double a_;
+    double b_;
+    double c_;
+    /** Precomputed for zipf (rejection-inversion sampling). */
+    double hX1_;
+    double hN_;
+    double s_;
+
+    SizeDistribution();
+
+    double h(double x) const;
+    double hIntegral(double x) const;
+    double hIntegralInverse(double x) const;
+
+public:
+    /**
+     * @param spec What to draw from, as described above.
+     * @return The distribution, or NULL if spec doesn't make sense.
+     */
+    static SizeDistribution* parse(const std::string& spec);
+
+    /**
+     * @param rng The caller's random numbers.
+     * @return A size, at most max().
+     */
+    uint32_t next(SizeRng& rng) const;
+
+    /**
+     * @return The biggest size next() can return.
+     */
+    uint32_t max() const;
+
+    /**
+     * @return True if every size is the same.
+     */
+    bool fixed() const
+    {
+        return kind_ == FIXED;
+    }
+
+    /**
+     * @return The spec it was parsed from.
+     */
+    const std::string& spec() const
+    {
+        return spec_;
+    }
+};
+
+/**
+ * Several size distributions, each used by its share of the clients. Each
+ * spec may start with "WEIGHT*" (for example "9*fixed:100" and
+ * "1*uniform:1M:4M"), otherwise its weight is 1.
+ */
+class SizeMix
+{
+private:
+    /** Each distribution, and the running total of weights up to it. */
+    std::vector<std::pair<int, SizeDistribution*> > parts_;
+
+public:
+    SizeMix();
+    ~SizeMix();
+
+    SizeMix(const SizeMix&) = delete;
+    SizeMix& operator=(const SizeMix&) = delete;
+
+    /**
+     * @param spec A weight (optional) and a SizeDistribution spec.
+     * @return False if spec doesn't make sense.
+     */
+    bool add(const std::string& spec);
+
+    /**
+     * Spread the clients over the distributions in proportion to their
+     * weights: with weights 9 and 1, clients 1 to 9 get the first, 10 the
+     * second, 11 to 19 the first again and so on.
+     *
+     * @param clientID The client, from 1.
+     * @return The distribution the client should use.
+     */
+    const SizeDistribution* forClient(int clientID) const;
+
+    /**
+     * @return The biggest size any client can be given.
+     */
+    uint32_t max() const;
+
+    /**
+     * @return True unless every response is the same size.
+     */
+    bool varies() const;
+
+    /**
+     * @return The specs, comma separated, with their weights if there are
+     *      several.
+     */
+    std::string describe() const;
+};
+
+/**
+ * A recorded sequence of requests to replay: when each was made, relative to
+ * the first, and how big its response was.
+ */
+struct TraceEntry
+{
+    uint64_t ns;
+    uint32_t size;
+};
+
+/**
+ * Load a trace: a text file with a timestamp in seconds and a size on each
+ * line, separated by a comma or white space. Blank lines and ones starting
+ * with '#' are skipped, as is a first line that isn't numbers (a CSV
+ * header). The entries are sorted by time and made relative to the first.
+ *
+ * @param path The file to read.
+ * @param trace Where to put the entries.
+ * @param line Set to the number of the last line read.
+ * @return 0 on success, or -1 if the file can't be read (errno is set) or a
+ *      line doesn't make sense (errno is EINVAL and line says which).
+ */
+int loadTrace(const char* path, std::vector<TraceEntry>* trace,
+        size_t* line);
+
+/**
+ * @param size A response size.
+ * @return Which of the SIZE_BUCKETS it falls in.
+ */
+int sizeBucket(uint32_t size);
+
+/**
+ * @param bucket One of the SIZE_BUCKETS.
+ * @return A label for it, such as "<= 4 KiB".
+ */
+const char* sizeBucketName(int bucket);
+
+} // namespace dm
+#endif
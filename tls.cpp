@@ -0,0 +1,171 @@
+#include "tls.hpp"
+#include <errno.h>
+#include <exception>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include "network.hpp"
+namespace dm {
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS  MSG_NOSIGNAL
+#else
+#define SEND_FLAGS  0
+#endif
+
+
+TlsContext::TlsContext(bool server, const char* certFile, const char* keyFile)
+    : ctx_(NULL), server_(server)
+{
+    if (!(ctx_ = SSL_CTX_new(server ? TLS_server_method()
+                                    : TLS_client_method())))
+    {
+        ERR_print_errors_fp(stderr);
+        throw std::exception();
+    }
+    SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // clients just close the socket when they're done
+    SSL_CTX_set_options(ctx_, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    if (!server)
+    {
+        SSL_CTX_set_verify(ctx_, SSL_VERIFY_NONE, NULL);
+        return;
+    }
+
+    // every connection does a full handshake, and nothing but application
+    // data ever reaches a client's kTLS socket
+    SSL_CTX_set_num_tickets(ctx_, 0);
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_OFF);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx_, certFile) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx_, keyFile, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx_) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx_);
+        throw std::exception();
+    }
+}
+
+
+TlsContext::~TlsContext()
+{
+    SSL_CTX_free(ctx_);
+}
+
+
+SSL*
+TlsContext::newSession(int fd)
+{
+    SSL* ssl = SSL_new(ctx_);
+
+    if (!ssl)
+    {
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    if (server_)
+    {
+        SSL_set_accept_state(ssl);
+    }
+    else
+    {
+        SSL_set_connect_state(ssl);
+    }
+    return ssl;
+}
+
+
+bool tlsKernelSend(SSL* ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+}
+
+
+bool tlsKernelRecv(SSL* ssl)
+{
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0;
+}
+
+
+int tlsSend(SSL* ssl, int fd, const char* buf, int len)
+{
+    int sent = 0;
+    int rtn = 0;
+
+    if (tlsKernelSend(ssl))
+    {
+        while (sent < len)
+        {
+            if ((rtn = send(fd, buf + sent, len - sent, SEND_FLAGS)) == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            sent += rtn;
+        }
+        return sent;
+    }
+
+    if (len && (rtn = SSL_write(ssl, buf, len)) <= 0)
+    {
+        ERR_clear_error();
+        return -1;
+    }
+    return len;
+}
+
+
+TlsReader::TlsReader(SSL* ssl, int fd, size_t capacity)
+    : SocketReader(fd, capacity), ssl_(ssl), kernelRecv_(tlsKernelRecv(ssl))
+{
+}
+
+
+int
+TlsReader::readSome(char* buf, size_t len)
+{
+    int read = 0;
+
+    if (kernelRecv_)
+    {
+        return SocketReader::readSome(buf, len);
+    }
+
+    // a SYSCALL error with errno still 0 is the peer hanging up
+    errno = 0;
+    if ((read = SSL_read(ssl_, buf, len)) <= 0)
+    {
+        int err = SSL_get_error(ssl_, read);
+
+        if (err == SSL_ERROR_ZERO_RETURN 
+            || (err == SSL_ERROR_SYSCALL && !errno))
+        {
+            ERR_clear_error();
+            return 0;
+        }
+        if (err != SSL_ERROR_SYSCALL)
+        {
+            ERR_print_errors_fp(stderr);
+            errno = EPROTO;
+        }
+        ERR_clear_error();
+        return -1;
+    }
+    return read;
+}
+
+} // namespace dm
@@ -0,0 +1,98 @@
+#ifndef DM_TLS_HPP
+#define DM_TLS_HPP
+#include <openssl/ssl.h>
+#include "network.hpp"
+namespace dm {
+
+/** The server's certificate and key, as made by 'make cert'. */
+#define TLS_CERT_FILE   "server.pem"
+#define TLS_KEY_FILE    "server.key"
+
+/**
+ * Wrapper around an OpenSSL context for one side of the benchmark. Handshakes
+ * happen in user space; afterwards the kernel does the record encryption
+ * (kTLS) wherever the kernel and cipher allow it, so payloads can go straight
+ * through send(). The client doesn't check the server's certificate, since
+ * it's self-signed.
+ */
+class TlsContext
+{
+private:
+    SSL_CTX* ctx_;
+    bool server_;
+
+public:
+    /**
+     * @param server True for the side that accepts connections.
+     * @param certFile The certificate to present (server only).
+     * @param keyFile The certificate's private key (server only).
+     * @throws exception The context couldn't be created or the certificate or
+     *      key couldn't be loaded. OpenSSL's errors are written to stderr.
+     */
+    TlsContext(bool server, const char* certFile = TLS_CERT_FILE,
+            const char* keyFile = TLS_KEY_FILE);
+    ~TlsContext();
+
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    /**
+     * Start a TLS session on a connected socket. Call SSL_do_handshake() (or
+     * SSL_accept()/SSL_connect()) on the result; it is already in the right
+     * state.
+     *
+     * @param fd The socket.
+     * @return The session, to be freed with SSL_free(), or NULL on failure.
+     */
+    SSL* newSession(int fd);
+};
+
+/**
+ * @param ssl A session that has finished its handshake.
+ * @return True if the kernel encrypts what is sent on the socket.
+ */
+bool tlsKernelSend(SSL* ssl);
+
+/**
+ * @param ssl A session that has finished its handshake.
+ * @return True if the kernel decrypts what is read from the socket.
+ */
+bool tlsKernelRecv(SSL* ssl);
+
+/**
+ * Send all of buf on a blocking socket. With kTLS the data goes straight to
+ * send(); otherwise it is encrypted by SSL_write().
+ *
+ * @param ssl The connection's session.
+ * @param fd The connection's socket.
+ * @param buf The data to send.
+ * @param len The number of bytes in buf.
+ * @return The number of bytes sent, or -1 on error.
+ */
+int tlsSend(SSL* ssl, int fd, const char* buf, int len);
+
+/**
+ * A SocketReader for a TLS connection. Reads go through SSL_read(), or
+ * straight to the socket if the kernel decrypts (kTLS).
+ */
+class TlsReader : public SocketReader
+{
+private:
+    SSL* ssl_;
+    bool kernelRecv_;
+
+protected:
+    int readSome(char* buf, size_t len) override;
+
+public:
+    /**
+     * @param ssl A session that has finished its handshake. It isn't freed by
+     *      the reader.
+     * @param fd The session's socket.
+     * @param capacity The size of the read-ahead buffer.
+     */
+    TlsReader(SSL* ssl, int fd, size_t capacity = READ_AHEAD_SIZE);
+};
+
+} // namespace dm
+#endif
@@ -1,6 +1,40 @@
 #include "tpool.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the worker counters are only written by their owner, but may be read by any
+ * thread through tPoolGetStats() */
+#define TPOOL_STAT_ADD(field, value) \
+    __atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+#define TPOOL_STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+
+/**
+ * @return The current time from a monotonic clock, in nanoseconds.
+ */
+static uint64_t tPoolNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @return The histogram bucket that ns belongs in.
+ */
+static int tPoolHistBucket(uint64_t ns)
+{
+    int bucket = 0;
+
+    while (ns > 1 && bucket < TPOOL_HIST_BUCKETS - 1)
+    {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
 
 
 int tPoolInit(tPool** tpoolp, int numWorkerThreads, int maxQueueSize,
@@ -20,8 +54,8 @@ int tPoolInit(tPool** tpoolp, int numWorkerThreads, int maxQueueSize,
     tpool->numThreads = numWorkerThreads;
     tpool->maxQueueSize = maxQueueSize;
     tpool->blockWhenQueueFull = blockWhenQueueFull;
-    if ((tpool->threads = (pthread_t*) malloc(
-            sizeof(pthread_t) * numWorkerThreads)) == NULL)
+    if ((tpool->workers = (tPoolWorker*) calloc(numWorkerThreads,
+            sizeof(tPoolWorker))) == NULL)
     {
         return TPOOL_ERR_MALLOC;
     }
@@ -30,7 +64,26 @@ int tPoolInit(tPool** tpoolp, int numWorkerThreads, int maxQueueSize,
     tpool->queueTail = NULL;
     tpool->queueClosed = 0;
     tpool->shutdown = 0;
-
+    tpool->startTime = tPoolNow();
+    tpool->queueHighWater = 0;
+    tpool->jobsAdded = 0;
+    tpool->addJobBlocked = 0;
+    tpool->addJobRejected = 0;
+    tpool->freeJobs = NULL;
+    tpool->notFullCallback = NULL;
+    tpool->notFullArg = NULL;
+
+    /* preallocate the job nodes so that tPoolAddJob() never has to */
+    for (i = 0; i < maxQueueSize; i++)
+    {
+        tPoolJob* job = NULL;
+        if ((job = (tPoolJob*) malloc(sizeof(tPoolJob))) == NULL)
+        {
+            return TPOOL_ERR_MALLOC;
+        }
+        job->next = tpool->freeJobs;
+        tpool->freeJobs = job;
+    }
 
     if ((rtn = pthread_mutex_init(&(tpool->queueLock), NULL)) != 0)
     {
@@ -55,8 +108,9 @@ int tPoolInit(tPool** tpoolp, int numWorkerThreads, int maxQueueSize,
     /* create the thread pool, one thread at a time */
     for (i = 0; i < numWorkerThreads; i++)
     {
-        if ((rtn = pthread_create(&(tpool->threads[i]), NULL, tPoolThreadDoJobs, 
-                           (void*) tpool)) != 0)
+        tpool->workers[i].pool = tpool;
+        if ((rtn = pthread_create(&(tpool->workers[i].thread), NULL,
+                           tPoolThreadDoJobs, (void*) &tpool->workers[i])) != 0)
         {
             return TPOOL_ERR_CREATE_THREAD;
         }
@@ -74,10 +128,16 @@ int tPoolAddJob(tPool* tpool, void (*routine)(void*), void* arg)
     if ((tpool->queueSize == tpool->maxQueueSize)
         && !tpool->blockWhenQueueFull)
     {
+        tpool->addJobRejected++;
         pthread_mutex_unlock(&tpool->queueLock);
         return TPOOL_QUEUE_FULL;
     }
 
+    if ((tpool->queueSize == tpool->maxQueueSize) 
+        && (!(tpool->shutdown || tpool->queueClosed)))
+    {
+        tpool->addJobBlocked++;
+    }
     while ((tpool->queueSize == tpool->maxQueueSize) 
            && (!(tpool->shutdown || tpool->queueClosed)))
     {
@@ -90,10 +150,20 @@ int tPoolAddJob(tPool* tpool, void (*routine)(void*), void* arg)
         return TPOOL_SHUTDOWN;
     }
 
-    /* allocate the data structure for work */
-    newJob = (tPoolJob*) malloc(sizeof(tPoolJob));
+    /* reuse a job node if one is available */
+    if (tpool->freeJobs != NULL)
+    {
+        newJob = tpool->freeJobs;
+        tpool->freeJobs = newJob->next;
+    }
+    else if ((newJob = (tPoolJob*) malloc(sizeof(tPoolJob))) == NULL)
+    {
+        pthread_mutex_unlock(&tpool->queueLock);
+        return TPOOL_ERR_JOB_MALLOC;
+    }
     newJob->routine = routine;
     newJob->arg = arg;
+    newJob->enqueueTime = tPoolNow();
     newJob->next = NULL;
 
     if (tpool->queueSize == 0)
@@ -107,11 +177,24 @@ int tPoolAddJob(tPool* tpool, void (*routine)(void*), void* arg)
     }
 
     tpool->queueSize++;
+    tpool->jobsAdded++;
+    if (tpool->queueSize > tpool->queueHighWater)
+    {
+        tpool->queueHighWater = tpool->queueSize;
+    }
     pthread_cond_signal(&tpool->queueNotEmpty);
     pthread_mutex_unlock(&tpool->queueLock);
     return 0;
 }
 
+void tPoolSetNotFullCallback(tPool* tpool, void (*callback)(void*), void* arg)
+{
+    pthread_mutex_lock(&tpool->queueLock);
+    tpool->notFullCallback = callback;
+    tpool->notFullArg = arg;
+    pthread_mutex_unlock(&tpool->queueLock);
+}
+
 int tPoolDestroy(tPool* tpool, int finishQueue)
 {
     int i = 0;
@@ -170,7 +253,7 @@ int tPoolDestroy(tPool* tpool, int finishQueue)
     /* wait for all worker threads to exit, then free them */
     for (i = 0; i < tpool->numThreads; i++)
     {
-        if (pthread_join(tpool->threads[i],NULL) != 0)
+        if (pthread_join(tpool->workers[i].thread, NULL) != 0)
         {
             return TPOOL_ERR_THREAD_JOIN;
         }
@@ -178,15 +261,22 @@ int tPoolDestroy(tPool* tpool, int finishQueue)
 
     /* now we need to cleanup and free all the thread pool structs here */
 
-    free(tpool->threads);
+    free(tpool->workers);
 
     while (tpool->queueHead != NULL)
     {
-        cur_nodep = tpool->queueHead->next;
+        cur_nodep = tpool->queueHead;
         tpool->queueHead = tpool->queueHead->next;
         free(cur_nodep);
     }
 
+    while (tpool->freeJobs != NULL)
+    {
+        cur_nodep = tpool->freeJobs;
+        tpool->freeJobs = tpool->freeJobs->next;
+        free(cur_nodep);
+    }
+
     /* release the mutex and condition variables */
     pthread_mutex_destroy(&(tpool->queueLock));
     pthread_cond_destroy(&(tpool->queueNotEmpty));
@@ -198,10 +288,142 @@ int tPoolDestroy(tPool* tpool, int finishQueue)
     return 0;
 }
 
-void* tPoolThreadDoJobs(void* tpool)
+int tPoolGetStats(tPool* tpool, tPoolStats* stats)
+{
+    int i = 0;
+    int b = 0;
+    tPoolWorkerStats ws;
+
+    memset(stats, 0, sizeof(tPoolStats));
+
+    pthread_mutex_lock(&tpool->queueLock);
+    stats->numThreads = tpool->numThreads;
+    stats->maxQueueSize = tpool->maxQueueSize;
+    stats->queueSize = tpool->queueSize;
+    stats->queueHighWater = tpool->queueHighWater;
+    stats->jobsAdded = tpool->jobsAdded;
+    stats->addJobBlocked = tpool->addJobBlocked;
+    stats->addJobRejected = tpool->addJobRejected;
+    pthread_mutex_unlock(&tpool->queueLock);
+
+    stats->uptimeNs = tPoolNow() - tpool->startTime;
+
+    for (i = 0; i < tpool->numThreads; i++)
+    {
+        tPoolGetWorkerStats(tpool, i, &ws);
+        stats->total.jobsRun += ws.jobsRun;
+        stats->total.busyNs += ws.busyNs;
+        stats->total.idleNs += ws.idleNs;
+
+        for (b = 0; b < TPOOL_HIST_BUCKETS; b++)
+        {
+            stats->total.queueWaitHist[b] += ws.queueWaitHist[b];
+            stats->total.runTimeHist[b] += ws.runTimeHist[b];
+        }
+    }
+    return 0;
+}
+
+int tPoolGetWorkerStats(tPool* tpool, int worker, tPoolWorkerStats* stats)
+{
+    int b = 0;
+    tPoolWorkerStats* ws = NULL;
+
+    if (worker < 0 || worker >= tpool->numThreads)
+    {
+        return TPOOL_ERR_NO_WORKER;
+    }
+    ws = &tpool->workers[worker].stats;
+
+    stats->jobsRun = TPOOL_STAT_GET(ws->jobsRun);
+    stats->busyNs = TPOOL_STAT_GET(ws->busyNs);
+    stats->idleNs = TPOOL_STAT_GET(ws->idleNs);
+
+    for (b = 0; b < TPOOL_HIST_BUCKETS; b++)
+    {
+        stats->queueWaitHist[b] = TPOOL_STAT_GET(ws->queueWaitHist[b]);
+        stats->runTimeHist[b] = TPOOL_STAT_GET(ws->runTimeHist[b]);
+    }
+    return 0;
+}
+
+uint64_t tPoolHistPercentile(const uint64_t* hist, double percentile)
+{
+    int b = 0;
+    uint64_t total = 0;
+    uint64_t seen = 0;
+
+    for (b = 0; b < TPOOL_HIST_BUCKETS; b++)
+    {
+        total += hist[b];
+    }
+    if (!total)
+    {
+        return 0;
+    }
+
+    for (b = 0; b < TPOOL_HIST_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen * 100.0 >= total * percentile)
+        {
+            break;
+        }
+    }
+    return (b >= TPOOL_HIST_BUCKETS - 1) ? UINT64_MAX : (2ULL << b);
+}
+
+void tPoolPrintStats(tPool* tpool, FILE* out)
+{
+    int i = 0;
+    double util = 0;
+    tPoolStats stats;
+    tPoolWorkerStats ws;
+
+    tPoolGetStats(tpool, &stats);
+
+    fprintf(out, "Thread pool:\n");
+    fprintf(out, "\tWorkers:\t\t%d\n", stats.numThreads);
+    fprintf(out, "\tJobs added:\t\t%llu\n",
+            (unsigned long long) stats.jobsAdded);
+    fprintf(out, "\tJobs run:\t\t%llu\n",
+            (unsigned long long) stats.total.jobsRun);
+    fprintf(out, "\tQueue high water:\t%d / %d\n", stats.queueHighWater,
+            stats.maxQueueSize);
+    fprintf(out, "\tBlocked adds:\t\t%llu\n",
+            (unsigned long long) stats.addJobBlocked);
+    fprintf(out, "\tRejected adds:\t\t%llu\n",
+            (unsigned long long) stats.addJobRejected);
+    fprintf(out, "\tQueue wait p50/p99:\t<%llu / <%llu ns\n",
+            (unsigned long long) tPoolHistPercentile(stats.total.queueWaitHist, 50),
+            (unsigned long long) tPoolHistPercentile(stats.total.queueWaitHist, 99));
+    fprintf(out, "\tRun time p50/p99:\t<%llu / <%llu ns\n",
+            (unsigned long long) tPoolHistPercentile(stats.total.runTimeHist, 50),
+            (unsigned long long) tPoolHistPercentile(stats.total.runTimeHist, 99));
+
+    for (i = 0; i < stats.numThreads; i++)
+    {
+        tPoolGetWorkerStats(tpool, i, &ws);
+        util = (ws.busyNs + ws.idleNs)
+             ? 100.0 * ws.busyNs / (ws.busyNs + ws.idleNs) : 0;
+        fprintf(out, "\tWorker %d:\t\t%llu jobs, %.1f%% busy\n", i,
+                (unsigned long long) ws.jobsRun, util);
+    }
+    fprintf(out, "\n");
+}
+
+void* tPoolThreadDoJobs(void* worker)
 {
     tPoolJob* job = NULL;
-    tPool* tpoolp = (tPool*) tpool;
+    tPoolJob current;
+    void (*notFull)(void*) = NULL;
+    void* notFullArg = NULL;
+    tPoolWorker* self = (tPoolWorker*) worker;
+    tPool* tpoolp = self->pool;
+    tPoolWorkerStats* stats = &self->stats;
+    uint64_t idleStart = tPoolNow();
+    uint64_t runStart = 0;
+    uint64_t runEnd = 0;
 
     while (1)
     {
@@ -234,6 +456,11 @@ void* tPoolThreadDoJobs(void* tpool)
             tpoolp->queueHead = job->next;
         }
 
+        /* copy the job out so the node can go straight back on the free list */
+        current = *job;
+        job->next = tpoolp->freeJobs;
+        tpoolp->freeJobs = job;
+
         if (tpoolp->blockWhenQueueFull
             && tpoolp->queueSize == tpoolp->maxQueueSize - 1)
         {
@@ -241,10 +468,35 @@ void* tPoolThreadDoJobs(void* tpool)
             pthread_cond_signal(&(tpoolp->queueNotFull));
         }
 
+        notFull = NULL;
+        if (tpoolp->notFullCallback
+            && tpoolp->queueSize == tpoolp->maxQueueSize - 1)
+        {
+            notFull = tpoolp->notFullCallback;
+            notFullArg = tpoolp->notFullArg;
+        }
+
         pthread_mutex_unlock(&(tpoolp->queueLock));
-        (*(job->routine))(job->arg);
+
+        if (notFull)
+        {
+            (*notFull)(notFullArg);
+        }
+
+        runStart = tPoolNow();
+        TPOOL_STAT_ADD(stats->idleNs, runStart - idleStart);
+        TPOOL_STAT_ADD(stats->queueWaitHist[tPoolHistBucket(
+                    runStart - current.enqueueTime)], 1);
+
+        (*(current.routine))(current.arg);
         /*fprintf(stderr, "\tqueue size: %d\n", tpoolp->queueSize);*/
-        free(job);
+
+        runEnd = tPoolNow();
+        TPOOL_STAT_ADD(stats->busyNs, runEnd - runStart);
+        TPOOL_STAT_ADD(stats->runTimeHist[tPoolHistBucket(
+                    runEnd - runStart)], 1);
+        TPOOL_STAT_ADD(stats->jobsRun, 1);
+        idleStart = runEnd;
     }
 }
 
@@ -2,6 +2,8 @@
 #define TANTALUS_TPOOL_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 /* tPoolInit return codes */
@@ -12,12 +14,19 @@
 /* tPoolAddJob return codes */
 #define TPOOL_QUEUE_FULL            201
 #define TPOOL_SHUTDOWN              202
+#define TPOOL_ERR_JOB_MALLOC        203
 /* tPoolDestroy return codes */
 #define TPOOL_ERR_MUTEX             301
 #define TPOOL_ERR_COND_WAIT         302
 #define TPOOL_ERR_COND_BROAD        303
 #define TPOOL_ERR_THREAD_JOIN       304
+/* tPoolGetWorkerStats return codes */
+#define TPOOL_ERR_NO_WORKER         401
 
+/** Number of buckets in the queue wait and run time histograms. Bucket i
+ * counts jobs that took less than 2^(i+1) nanoseconds (and at least 2^i, for
+ * i > 0). The last bucket also holds everything that is larger. */
+#define TPOOL_HIST_BUCKETS          40
 
 /**
  * A job that can be added to a job queue in order to be processed by a worker
@@ -29,16 +38,81 @@ typedef struct tPoolJob_struct
     void(*routine)(void*);
     /** Argument that will be passed to the worker thread. */
     void* arg;
+    /** When the job was added to the queue (monotonic nanoseconds). */
+    uint64_t enqueueTime;
     /** The next job in the job queue. */
     struct tPoolJob_struct* next;
 
 } tPoolJob;
 
+/**
+ * Counters kept by each worker thread. Only the owning worker writes to them,
+ * so recording a job is a handful of relaxed stores and never takes a lock.
+ * Readers get a consistent value for each counter, but not necessarily a
+ * consistent snapshot across counters while the pool is running.
+ */
+typedef struct
+{
+    /** Number of jobs this worker has completed. */
+    uint64_t jobsRun;
+    /** Nanoseconds spent running jobs. */
+    uint64_t busyNs;
+    /** Nanoseconds spent waiting for a job to arrive. */
+    uint64_t idleNs;
+    /** Time from tPoolAddJob() until a worker picked the job up. */
+    uint64_t queueWaitHist[TPOOL_HIST_BUCKETS];
+    /** Time spent running the job's routine. */
+    uint64_t runTimeHist[TPOOL_HIST_BUCKETS];
+
+} tPoolWorkerStats;
+
+struct tPool_struct;
+
+/**
+ * A worker thread and the counters it owns.
+ */
+typedef struct
+{
+    /** The pool that the worker belongs to. */
+    struct tPool_struct* pool;
+    /** The worker thread. */
+    pthread_t thread;
+    /** Counters recorded by this worker. */
+    tPoolWorkerStats stats;
+
+} tPoolWorker;
+
+/**
+ * A snapshot of a pool's counters, filled in by tPoolGetStats().
+ */
+typedef struct
+{
+    /** Number of worker threads in the pool. */
+    int32_t numThreads;
+    /** The maximum number of pending jobs in the job queue. */
+    int32_t maxQueueSize;
+    /** Number of jobs in the queue when the snapshot was taken. */
+    int32_t queueSize;
+    /** The largest number of jobs that have been in the queue at once. */
+    int32_t queueHighWater;
+    /** Number of jobs successfully added to the queue. */
+    uint64_t jobsAdded;
+    /** Number of times tPoolAddJob() had to wait on queueNotFull. */
+    uint64_t addJobBlocked;
+    /** Number of times tPoolAddJob() returned TPOOL_QUEUE_FULL. */
+    uint64_t addJobRejected;
+    /** Nanoseconds since the pool was created. */
+    uint64_t uptimeNs;
+    /** The counters of every worker summed together. */
+    tPoolWorkerStats total;
+
+} tPoolStats;
+
 /**
  * The tPool structure represents a thread pool. A tPool should be initialized
  * by calling tpoolInit(). Jobs can then be added with tpoolAddJob().
  */
-typedef struct
+typedef struct tPool_struct
 {
     /* thread pool characteristics */
 
@@ -61,6 +135,8 @@ typedef struct
     tPoolJob* queueHead;
     /** Last job in the job queue. */
     tPoolJob* queueTail;
+    /** Job nodes that are not in use, so adding a job doesn't malloc(). */
+    tPoolJob* freeJobs;
     /** The mutex used by this pool. */
     pthread_mutex_t queueLock;
     /** Indicates when the queue is empty. */
@@ -70,7 +146,24 @@ typedef struct
     /** Indicates when the queue is empty. */
     pthread_cond_t queueEmpty;
     /** The worker threads. */
-    pthread_t* threads;
+    tPoolWorker* workers;
+    /** Called by a worker when it takes a job out of a full queue. */
+    void (*notFullCallback)(void*);
+    /** Argument passed to notFullCallback. */
+    void* notFullArg;
+
+    /* thread pool statistics, protected by queueLock */
+
+    /** When the pool was created (monotonic nanoseconds). */
+    uint64_t startTime;
+    /** The largest value queueSize has reached. */
+    int32_t queueHighWater;
+    /** Number of jobs successfully added to the queue. */
+    uint64_t jobsAdded;
+    /** Number of times tPoolAddJob() had to wait on queueNotFull. */
+    uint64_t addJobBlocked;
+    /** Number of times tPoolAddJob() returned TPOOL_QUEUE_FULL. */
+    uint64_t addJobRejected;
 
 } tPool;
 
@@ -99,10 +192,24 @@ int tPoolInit(tPool** tpoolp, int numWorkerThreads, int maxQueueSize,
  * @param tpool The thread pool that the job should be added to.
  * @param routine The function that the worker thread will run.
  * @param arg The argument that will be passed to the worker thread.
- * @return 1 on a job being successfully added to the queue
+ * @return 0 on a job being successfully added to the queue, TPOOL_QUEUE_FULL
+ *      if the queue is full and the pool does not block, TPOOL_SHUTDOWN if
+ *      the pool is shutting down.
  */
 int tPoolAddJob(tPool* tpool, void (*routine)(void*), void* arg);
 
+/**
+ * Registers a function that a worker thread will call (without holding the
+ * queue lock) each time it takes a job out of a full queue. This lets a caller
+ * using a non-blocking pool find out when tPoolAddJob() will succeed again,
+ * without having to poll.
+ *
+ * @param tpool The thread pool to watch.
+ * @param callback The function to call, or NULL to remove the callback.
+ * @param arg The argument that will be passed to callback.
+ */
+void tPoolSetNotFullCallback(tPool* tpool, void (*callback)(void*), void* arg);
+
 /**
  * Destroys a thread pool.
  *
@@ -114,6 +221,44 @@ int tPoolAddJob(tPool* tpool, void (*routine)(void*), void* arg);
  */
 int tPoolDestroy(tPool* tpool, int finishQueue);
 
+/**
+ * Takes a snapshot of the pool-wide counters and the sum of all the worker
+ * counters.
+ *
+ * @param tpool The thread pool to read.
+ * @param stats Filled in with the pool's counters.
+ * @return 0 on success.
+ */
+int tPoolGetStats(tPool* tpool, tPoolStats* stats);
+
+/**
+ * Copies the counters of a single worker thread.
+ *
+ * @param tpool The thread pool to read.
+ * @param worker The index of the worker (0 to numThreads - 1).
+ * @param stats Filled in with the worker's counters.
+ * @return 0 on success, TPOOL_ERR_NO_WORKER if worker is out of range.
+ */
+int tPoolGetWorkerStats(tPool* tpool, int worker, tPoolWorkerStats* stats);
+
+/**
+ * Estimates a percentile from one of the histograms in tPoolWorkerStats.
+ *
+ * @param hist A histogram with TPOOL_HIST_BUCKETS buckets.
+ * @param percentile The percentile to find (0 - 100).
+ * @return The upper bound, in nanoseconds, of the bucket that holds the
+ *      percentile, or 0 if the histogram is empty.
+ */
+uint64_t tPoolHistPercentile(const uint64_t* hist, double percentile);
+
+/**
+ * Writes a human readable report of the pool and per-worker counters.
+ *
+ * @param tpool The thread pool to report on.
+ * @param out Where to write the report.
+ */
+void tPoolPrintStats(tPool* tpool, FILE* out);
+
 /**
  * The threads created in tPoolInit() run this function. This function runs in a 
  * forever loop until it shuts down. It will block when the job queue is empty. 
@@ -122,9 +267,9 @@ int tPoolDestroy(tPool* tpool, int finishQueue);
  * tPoolInit()
  *
  * @author Dean Morin (based on work by Igor Cheifot)
- * @param tpool The thread pool that the thread belongs to.
+ * @param worker The tPoolWorker that this thread records its counters in.
  */
-void* tPoolThreadDoJobs(void* tpool);
+void* tPoolThreadDoJobs(void* worker);
 
 #endif
 